@@ -0,0 +1,138 @@
+/* spritec.c - compile XPM toon images into C arrays of raw pixels
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Run at build time over the XPM files of a sprite set:
+ *
+ *    spritec walker.xpm faller.xpm ... > sprites.h
+ *
+ * For each image it writes the premultiplied 0xAARRGGBB pixels, an XBM
+ * style mask and a table of the opaque spans of each row, then a
+ * ToonRawImage table tying them to the XPM arrays by name. Included after
+ * def.h and passed to ToonUseRaw(), this lets the images be sent to a
+ * TrueColor display without Xpm parsing or matching a single colour.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "toonP.h"
+
+#define SPRITEC_TABLE "penguin_raw"
+
+char *table_name = SPRITEC_TABLE;
+
+/* Write an array of numbers, a dozen or so to a line */
+void WriteArray(char *type, char *name, char *suffix, void *values, int n,
+      int size, int perline)
+{
+   int i;
+   printf("static %s %s_%s[] = {", type, name, suffix);
+   for (i=0; i<n; i++) {
+      if (i % perline == 0) printf("\n  ");
+      if (size == 4)
+         printf(" 0x%08x,", ((unsigned int *) values)[i]);
+      else if (size == 2)
+         printf(" %u,", ((unsigned short *) values)[i]);
+      else
+         printf(" 0x%02x,", ((unsigned char *) values)[i]);
+   }
+   printf("\n};\n");
+   return;
+}
+
+/* Compile one XPM file, noting the name and size of its image */
+/* Returns 0 on success, 1 on failure */
+int Compile(char *path, char *name, int nname, int *width, int *height)
+{
+   char *text, **strings;
+   unsigned char *mask_bits;
+   unsigned short *spans;
+   _ToonImage image;
+   int nstrings, nspans, w, h, ncolors, cpp, status = 1;
+
+   if ((text = _ToonReadFile(path)) == NULL) {
+      fprintf(stderr, "spritec: can't read %s\n", path);
+      return 1;
+   }
+   nstrings = _ToonSplitXpm(text, &strings, name, nname);
+   if (nstrings < 1 || sscanf(strings[0], "%d %d %d %d", &w, &h, &ncolors,
+         &cpp) != 4 || nstrings < 1+ncolors+h
+         || _ToonDecodeXpm(strings, &image)) {
+      fprintf(stderr, "spritec: can't decode %s\n", path);
+   }
+   else if ((mask_bits = malloc(((w+7)/8)*h)) == NULL
+         || (nspans = _ToonMakeSpans(&image, &spans)) < 0) {
+      fprintf(stderr, "spritec: %s is too big\n", path);
+      _ToonFreeImage(&image);
+   }
+   else {
+      _ToonPremultiply(&image, mask_bits);
+      printf("\n/* %s: %dx%d */\n", path, w, h);
+      WriteArray("unsigned int", name, "pixels", image.pixels, w*h, 4, 6);
+      WriteArray("unsigned char", name, "mask_bits", mask_bits, ((w+7)/8)*h,
+            1, 12);
+      WriteArray("unsigned short", name, "spans", spans, nspans, 2, 12);
+      free(mask_bits);
+      free(spans);
+      _ToonFreeImage(&image);
+      *width = w;
+      *height = h;
+      status = 0;
+   }
+   if (nstrings >= 0) free(strings);
+   free(text);
+   return status;
+}
+
+int main(int argc, char **argv)
+{
+   char (*names)[64];
+   int i, n, first = 1, *sizes;
+
+   if (argc > 2 && strcmp(argv[1], "-name") == 0) {
+      table_name = argv[2];
+      first = 3;
+   }
+   if (first >= argc) {
+      fprintf(stderr, "Usage: %s [-name table] file.xpm ... > sprites.h\n",
+            argv[0]);
+      exit(1);
+   }
+   if ((names = malloc((argc-first)*sizeof(names[0]))) == NULL
+         || (sizes = malloc(2*(argc-first)*sizeof(int))) == NULL) {
+      fprintf(stderr, "spritec: out of memory\n");
+      exit(1);
+   }
+
+   printf("/* Generated by spritec - do not edit */\n");
+   for (i=first, n=0; i<argc; i++, n++) {
+      if (Compile(argv[i], names[n], sizeof(names[0]), sizes+2*n,
+            sizes+2*n+1))
+         exit(1);
+   }
+
+   printf("\nToonRawImage %s[] = {\n", table_name);
+   for (n=0; n<argc-first; n++)
+      printf("   { %s, %s_pixels, %s_mask_bits, %s_spans, %d, %d },\n",
+            names[n], names[n], names[n], names[n], sizes[2*n], sizes[2*n+1]);
+   printf("   { NULL }\n};\n");
+   free(names);
+   free(sizes);
+   return 0;
+}
@@ -18,79 +18,241 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <string.h>
 #include <signal.h>
 #include <limits.h>
-
-#include "toon.h"
+#include <sys/select.h>
+#include <pthread.h>
+
+#include "toonP.h"
+#include <X11/Xatom.h>
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#ifdef HAVE_XPRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
+#ifdef HAVE_XINPUT2
+#include <X11/extensions/XInput2.h>
+#endif
 
 /* Handle some `virtual' window managers */
 #include "vroot.h"
 
 typedef int ErrorHandler();
 
-typedef struct {
-   int solid;
-   unsigned int wid;
-   XRectangle pos;
-} _ToonWindowData;
-
-Display *display;
-int screen = 0;
-Window root;
-int display_width, display_height;
-GC draw_toonGC;
-Pixel black, white;
-Region windows = NULL;
-Window *children = NULL;
-unsigned int nwindows = 0;
-
-_ToonWindowData *windata = NULL;
-ToonData *toon_data;
-int error_value = 0;
+#define TOON_MAXPAUSE 1e9 /* longest sleep between checks for signals, ns */
+
+/* States of the types in toon_installed */
+#define TOON_TYPEPENDING 0
+#define TOON_TYPEINSTALLED 1
+#define TOON_TYPEFAILED 2
+#define TOON_SHAREMAXLENGTH 65536 /* longest property of shared images read */
+
+/* Per display: see TOON_LOCAL in toonP.h */
+TOON_LOCAL Display *display;
+TOON_LOCAL int screen = 0;
+TOON_LOCAL Window root;
+TOON_LOCAL int display_width, display_height;
+TOON_LOCAL GC draw_toonGC;
+TOON_LOCAL GC fill_gc; /* solid fills, for the particles */
+TOON_LOCAL Pixel black, white;
+TOON_LOCAL Region windows = NULL;
+TOON_LOCAL Region covered = NULL; /* everything that hides the root window */
+TOON_LOCAL Window *children = NULL;
+TOON_LOCAL unsigned int nwindows = 0;
+
+TOON_LOCAL _ToonWindowData *windata = NULL;
+TOON_LOCAL ToonData *toon_data;
+TOON_LOCAL char *toon_installed = NULL; /* upload state of each type */
+TOON_LOCAL int toon_ntypes = 0, toon_npending = 0;
+TOON_LOCAL int error_value = 0;
+TOON_LOCAL int catch_errors = 0; /* X errors go in error_value, not fatal */
+/* The X error handler belongs to the whole process, so it is installed
+   once, by the first ToonOpenDisplay(), and never taken away */
+ErrorHandler *toon_default_error_handler = NULL;
+pthread_once_t toon_error_handler_once = PTHREAD_ONCE_INIT;
 /* Do the edges block movement?
  * If only the sides and the bottom block movement then edge_block = 2 */
-char edge_block = 0;
-char shaped_windows = 1;
+TOON_LOCAL char edge_block = 0;
+TOON_LOCAL char shaped_windows = 1;
 /* If solid_popups is set to 0 then the toons fall behind `popup' windows.
  * This includes the KDE panel */
-char solid_popups = 1;
-int toon_signal = 0;
-char toon_error_message[TOON_MESSAGE_LENGTH] = "";
-Toon *toons_to_erase = NULL;
-int ntoons_to_erase = 0;
-int max_relocate_up = TOON_DEFAULTMAXRELOCATE;
-int max_relocate_down = TOON_DEFAULTMAXRELOCATE;
-int max_relocate_left = TOON_DEFAULTMAXRELOCATE;
-int max_relocate_right = TOON_DEFAULTMAXRELOCATE;
-
-/* INTERNAL FUNCTION PROTOTYPES */
+TOON_LOCAL char solid_popups = 1;
+volatile sig_atomic_t toon_signal = 0; /* the last signal caught... */
+volatile sig_atomic_t toon_signals = 0; /* ...how many for every display... */
+TOON_LOCAL sig_atomic_t toon_signals_seen = 0; /* ...and seen by this one */
+volatile sig_atomic_t toon_exit = 0; /* caught with TOON_EXITGRACEFULLY */
+TOON_LOCAL char toon_error_message[TOON_MESSAGE_LENGTH] = "";
+TOON_LOCAL XRectangle *toons_drawn = NULL; /* by the last ToonDraw() */
+TOON_LOCAL int ntoons_drawn = 0, toons_drawn_size = 0;
+TOON_LOCAL Region exposed = NULL; /* uncovered parts of the root window */
+TOON_LOCAL int max_relocate_up = TOON_DEFAULTMAXRELOCATE;
+TOON_LOCAL int max_relocate_down = TOON_DEFAULTMAXRELOCATE;
+TOON_LOCAL int max_relocate_left = TOON_DEFAULTMAXRELOCATE;
+TOON_LOCAL int max_relocate_right = TOON_DEFAULTMAXRELOCATE;
+TOON_LOCAL unsigned long xlib_round_trips = 0;
+TOON_LOCAL char share_pixmaps = 0;
+TOON_LOCAL char *xlib_shared = NULL; /* whether each type is shared */
+TOON_LOCAL int xlib_nshared = 0;
+TOON_LOCAL char xlib_sharing = 0; /* 1 if shared, -1 if not, 0 if not tried */
+TOON_LOCAL Atom xlib_share = None; /* property of the shared images */
+TOON_LOCAL Pixmap xlib_sharekey = None; /* one of the maker's pixmaps */
+TOON_LOCAL Window xlib_holder = None; /* listed in the properties we hold */
+TOON_LOCAL double frame_deadline = 0.0; /* monotonic time the next frame is due */
+TOON_LOCAL XRectangle *monitors = NULL;
+TOON_LOCAL int nmonitors = 0;
+TOON_LOCAL Region gaps = NULL; /* parts of the screen that no monitor shows */
+TOON_LOCAL char gap_walls = 1;
+TOON_LOCAL int xrandr_event_base = -1; /* -1 without XRandR */
+/* Frames between updates of toons at each level of detail: 1 updates
+   them every frame, with full collision detection */
+TOON_LOCAL int detail_step[TOON_DETAILS] = { 1, 1, 1 };
+/* Seconds a frame, and animation frames a second, if velocities are in
+   fixed-point pixels a second; 0 if they are in pixels a frame */
+TOON_LOCAL double time_step = 0.0, frame_rate = 0.0;
+/* Frames started on vertical blanks, with the Present extension */
+TOON_LOCAL char vsync = 0;
+TOON_LOCAL int present_opcode = -1; /* -1 without Present */
+TOON_LOCAL unsigned long long present_msc = 0; /* last blank heard of */
+TOON_LOCAL double present_ust = 0.0; /* ...and when it was, ns */
+TOON_LOCAL double present_interval = 0.0; /* ns between blanks, 0 if unknown */
+TOON_LOCAL unsigned long long present_target = 0; /* blank asked for */
+TOON_LOCAL unsigned long long present_blanks = 1; /* ...blanks a frame */
+TOON_LOCAL double present_deadline = 0.0; /* give up waiting for it */
+TOON_LOCAL char present_pending = 0, present_arrived = 0;
+TOON_LOCAL unsigned int present_serial = 0;
+TOON_LOCAL double present_flushed = 0.0; /* first flush since a blank */
+/* The pointer as last heard of, from XInput2 events (or the null backend),
+   for ToonPointer() */
+TOON_LOCAL char pointer_known = 0;
+TOON_LOCAL double pointer_x = 0.0, pointer_y = 0.0;
+TOON_LOCAL unsigned int pointer_buttons = 0; /* bit n-1 for button n */
+TOON_LOCAL int xinput_opcode = -1; /* -1 without XInput2 */
+#ifdef HAVE_XINPUT2
+/* How each pointing device's x and y move the pointer, from XIQueryDevice */
+typedef struct {
+   int deviceid;
+   char absolute[2];
+   double min[2], max[2];
+} _ToonPointerDevice;
+TOON_LOCAL _ToonPointerDevice *pointer_devices = NULL;
+TOON_LOCAL int npointer_devices = 0;
+#endif
+/* Uniform grid over the screen for ToonNeighbours(): the toons indexed by
+   ToonIndexNeighbours(), sorted by the cell their top left corner is in */
+TOON_LOCAL Toon *grid_toon = NULL;
+TOON_LOCAL int *grid_start = NULL; /* first entry of each cell, and the end */
+TOON_LOCAL int *grid_entries = NULL;
+TOON_LOCAL int grid_cell, grid_columns, grid_rows;
+TOON_LOCAL int grid_ncells_size = 0, grid_entries_size = 0;
+
+ToonBackend toon_xlib_backend = {
+   "xlib",
+   _ToonXOpenDisplay,
+   _ToonXInstallData,
+   _ToonXFreeData,
+   _ToonXDraw,
+   _ToonXErase,
+   _ToonXFill,
+   _ToonXDraw,
+   _ToonXFlush,
+   _ToonXLocateWindows,
+   _ToonXWindowsMoved,
+   _ToonXCloseDisplay,
+   _ToonXCountRequests,
+   _ToonXWait
+};
+extern ToonBackend toon_null_backend;
+extern ToonBackend toon_async_backend;
+
+/* Backends that may be selected by name, the first is the default */
+ToonBackend *toon_backends[] = {
+   &toon_xlib_backend,
+   &toon_async_backend,
+   &toon_null_backend,
+   NULL
+};
+TOON_LOCAL ToonBackend *toon_backend = &toon_xlib_backend;
+
 void _ToonSignalHandler(int sig);
+void _ToonExitSignalHandler(int sig);
+void _ToonExitIfAsked();
 int _ToonError(Display *display, XErrorEvent *error);
-void _ToonExitGracefully(int sig);
+void _ToonXInstallErrorHandler();
+#ifdef HAVE_XINPUT2
+void _ToonXInputDevices();
+void _ToonXInputStart();
+void _ToonXInputEvent(int evtype, void *data);
+#endif
+
+/* REQUEST ACCOUNTING */
+
+/* Charge the requests and round trips made since the backend totals were
+   `requests' and `round_trips' to a call */
+void _ToonAccount(int call, unsigned long requests, unsigned long round_trips)
+{
+   unsigned long r, t;
+   toon_backend->count_requests(&r, &t);
+   _ToonStatsRequests(call, r - requests, t - round_trips);
+   return;
+}
+
+/* Xlib backend: the request sequence number counts every request sent;
+   round trips are counted by hand wherever we wait for a reply */
+void _ToonXCountRequests(unsigned long *requests, unsigned long *round_trips)
+{
+   *requests = display ? NextRequest(display) - 1 : 0;
+   *round_trips = xlib_round_trips;
+   return;
+}
 
 /* SIGNAL AND ERROR HANDLING FUNCTIONS */
 
-/* Signal Handler: stores caught signal in toon_signal */
+/* Signal Handler: stores caught signal in toon_signal, and counts it */
 void _ToonSignalHandler(int sig)
 {
    toon_signal=sig;
+   toon_signals++;
+   return;
+}
+
+/* Signal Handler for TOON_EXITGRACEFULLY: the display threads do the rest
+   in _ToonExitIfAsked() */
+void _ToonExitSignalHandler(int sig)
+{
+   toon_exit=sig;
    return;
 }
 
-/* Error handler for X */
+/* Error handler for X: it is called in the thread that made the request,
+   so only a thread that is looking for the windows has its errors kept
+   (a window may go between being listed and being looked at); any others
+   go to the handler there was before */
 int _ToonXErrorHandler(Display *display, XErrorEvent *error)
 {
-    error_value = error->error_code;
-    return 0;
+   if (catch_errors || toon_default_error_handler == NULL) {
+      error_value = error->error_code;
+      return 0;
+   }
+   return toon_default_error_handler(display, error);
 }
 
-/* Has a signal been caught? If so return it */
+void _ToonXInstallErrorHandler()
+{
+   toon_default_error_handler = XSetErrorHandler(_ToonXErrorHandler);
+   return;
+}
+
+/* Has a signal been caught since the last call? If so return it. Each
+   display's thread has it from its own calls, so every loop sees it once */
 int ToonSignal()
 {
-   int sig = toon_signal;
-   toon_signal = 0;
-   return sig;
+   if (toon_signals_seen == toon_signals)
+      return 0;
+   toon_signals_seen = toon_signals;
+   return toon_signal;
 }
 
 /* Return error message */
@@ -102,8 +264,84 @@ char * ToonErrorMessage()
 
 /* STARTUP FUNCTIONS */
 
+/* Choose the display backend by name; must be called before
+ * ToonOpenDisplay() */
+/* Returns 0 on success, 1 if there is no backend of that name */
+int ToonSetBackend(char *name)
+{
+   int i;
+   for (i=0; toon_backends[i]; i++) {
+      if (strcmp(toon_backends[i]->name, name) == 0) {
+         toon_backend = toon_backends[i];
+         return 0;
+      }
+   }
+   snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+         "Unknown backend `%s'", name);
+   return 1;
+}
+
 /* Open display, set GC etc. */
-Display *ToonOpenDisplay(char *display_name)
+/* Returns 0 on success, 1 on failure (see ToonErrorMessage()) */
+int ToonOpenDisplay(char *display_name)
+{
+   pthread_once(&toon_error_handler_once, _ToonXInstallErrorHandler);
+   windows = XCreateRegion();
+   covered = XCreateRegion();
+   gaps = XCreateRegion();
+   exposed = XCreateRegion();
+   if (toon_backend->open_display(display_name)) {
+      XDestroyRegion(windows);
+      XDestroyRegion(covered);
+      XDestroyRegion(gaps);
+      XDestroyRegion(exposed);
+      windows = covered = gaps = exposed = NULL;
+      return 1;
+   }
+   /* A backend that knows no better has one monitor filling the screen */
+   if (nmonitors == 0)
+      _ToonSetMonitors(NULL, 0);
+   return 0;
+}
+
+/* Name each screen of a display, as "host:display.screen", so that they
+   can be opened one by one. A display that can't be opened here is left
+   for ToonOpenDisplay() to complain about */
+/* Returns the number of screens, with the names in *names; free each name
+   and then the array */
+int ToonScreenNames(char *display_name, char ***names)
+{
+   Display *d;
+   char *name, *colon, *dot;
+   int i, n = 1, len;
+
+   /* Each screen may be driven from a thread of its own */
+   XInitThreads();
+   if ((d = XOpenDisplay(display_name)))
+      n = ScreenCount(d);
+   if ((*names = malloc(n*sizeof(char *))) == NULL) {
+      if (d) XCloseDisplay(d);
+      return 0;
+   }
+   if (d == NULL || n == 1) {
+      (*names)[0] = display_name ? strdup(display_name) : NULL;
+      if (d) XCloseDisplay(d);
+      return 1;
+   }
+   name = DisplayString(d);
+   len = strlen(name);
+   if ((colon = strrchr(name, ':')) && (dot = strchr(colon, '.')))
+      len = dot - name;
+   for (i=0; i<n; i++) {
+      if (((*names)[i] = malloc(len+16)))
+         snprintf((*names)[i], len+16, "%.*s.%d", len, name, i);
+   }
+   XCloseDisplay(d);
+   return n;
+}
+
+/* Xlib backend: open the display and set up the GC */
+int _ToonXOpenDisplay(char *display_name)
 {
    XGCValues gc_values;
 
@@ -115,7 +353,7 @@ Display *ToonOpenDisplay(char *display_name)
       else
          strncpy(toon_error_message,"Can't open display",
                TOON_MESSAGE_LENGTH);
-      return(NULL);
+      return 1;
    }
    screen = DefaultScreen(display);
    root = RootWindow(display, screen);
@@ -130,20 +368,217 @@ Display *ToonOpenDisplay(char *display_name)
    gc_values.fill_style = FillTiled;
    draw_toonGC = XCreateGC(display,root,
       GCFunction | GCFillStyle | GCGraphicsExposures,&gc_values);
+   fill_gc = XCreateGC(display, root, GCFunction | GCGraphicsExposures,
+         &gc_values);
+
+   /* Notify if the root window changes, the screen changes size or parts
+      of the root are uncovered */
+   XSelectInput(display, root, SubstructureNotifyMask | StructureNotifyMask
+         | ExposureMask);
+   xrandr_event_base = -1;
+#ifdef HAVE_XRANDR
+   {
+      int error_base;
+      if (XRRQueryExtension(display, &xrandr_event_base, &error_base))
+         XRRSelectInput(display, root, RRScreenChangeNotifyMask
+               | RRCrtcChangeNotifyMask);
+      else
+         xrandr_event_base = -1;
+   }
+#endif
+   present_opcode = -1;
+#ifdef HAVE_XPRESENT
+   {
+      int event_base, error_base;
+      if (XPresentQueryExtension(display, &present_opcode, &event_base,
+            &error_base))
+         XPresentSelectInput(display, root, PresentCompleteNotifyMask);
+      else
+         present_opcode = -1;
+   }
+#endif
+   xinput_opcode = -1;
+   pointer_known = 0;
+   pointer_buttons = 0;
+#ifdef HAVE_XINPUT2
+   {
+      int event_base, error_base, major = 2, minor = 2;
+      unsigned char bits[XIMaskLen(XI_LASTEVENT)];
+      XIEventMask mask;
+      if (XQueryExtension(display, "XInputExtension", &xinput_opcode,
+            &event_base, &error_base)
+            && XIQueryVersion(display, &major, &minor) == Success) {
+         /* Raw events come whichever window the pointer is over, but
+            only motion over the root window itself says exactly where */
+         memset(bits, 0, sizeof(bits));
+         XISetMask(bits, XI_RawMotion);
+         XISetMask(bits, XI_RawButtonPress);
+         XISetMask(bits, XI_RawButtonRelease);
+         XISetMask(bits, XI_Motion);
+         XISetMask(bits, XI_HierarchyChanged);
+         mask.deviceid = XIAllDevices;
+         mask.mask_len = sizeof(bits);
+         mask.mask = bits;
+         XISelectEvents(display, root, &mask, 1);
+         _ToonXInputDevices();
+         _ToonXInputStart();
+      }
+      else
+         xinput_opcode = -1;
+   }
+#endif
+   _ToonXLocateMonitors();
 
-   /* Regions */
-   windows = XCreateRegion();
+   return 0;
+}
+
+#ifdef HAVE_XINPUT2
+/* Xlib backend: note how each slave pointer's axes move the pointer, as
+   the devices come and go */
+void _ToonXInputDevices()
+{
+   XIDeviceInfo *info;
+   XIValuatorClassInfo *v;
+   _ToonPointerDevice *d;
+   int i, j, n;
+
+   if (pointer_devices) free(pointer_devices);
+   pointer_devices = NULL;
+   npointer_devices = 0;
+   info = XIQueryDevice(display, XIAllDevices, &n);
+   xlib_round_trips++;
+   if (info == NULL) return;
+   if ((pointer_devices = calloc(n, sizeof(_ToonPointerDevice))) == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      _ToonExitGracefully(1);
+   }
+   for (i=0; i<n; i++) {
+      if (info[i].use != XISlavePointer) continue;
+      d = pointer_devices + npointer_devices++;
+      d->deviceid = info[i].deviceid;
+      for (j=0; j<info[i].num_classes; j++) {
+         v = (XIValuatorClassInfo *) info[i].classes[j];
+         if (v->type != XIValuatorClass || v->number > 1) continue;
+         d->absolute[v->number] = v->mode == XIModeAbsolute
+               && v->max > v->min;
+         d->min[v->number] = v->min;
+         d->max[v->number] = v->max;
+      }
+   }
+   XIFreeDeviceInfo(info);
+   return;
+}
 
-   /* Notify if the root window changes */
-   XSelectInput(display, root, SubstructureNotifyMask);
+/* Xlib backend: ask where the pointer is, once, to follow it from */
+void _ToonXInputStart()
+{
+   Window root_return, child;
+   int x, y, wx, wy;
+   unsigned int mask;
+   if (XQueryPointer(display, root, &root_return, &child, &x, &y,
+         &wx, &wy, &mask)) {
+      pointer_x = x;
+      pointer_y = y;
+      pointer_buttons = (mask >> 8) & 0x1f; /* Button1Mask is 1<<8 */
+      pointer_known = 1;
+   }
+   xlib_round_trips++;
+   return;
+}
+
+/* Xlib backend: follow the pointer from an XInput2 event. Relative
+   devices move it by their (accelerated) motion, absolute ones put it at
+   their place on the screen; motion over the root window corrects any
+   drift, and then say exactly where it is */
+void _ToonXInputEvent(int evtype, void *data)
+{
+   XIRawEvent *raw = data;
+   XIDeviceEvent *event = data;
+   _ToonPointerDevice *d;
+   double value, *p;
+   int i, axis, size;
+
+   if (evtype == XI_HierarchyChanged) {
+      _ToonXInputDevices();
+      return;
+   }
+   if (evtype == XI_Motion) {
+      pointer_x = event->root_x;
+      pointer_y = event->root_y;
+      pointer_known = 1;
+      return;
+   }
+   /* Masters send raw events too, the same again */
+   for (i=0, d=pointer_devices; i<npointer_devices; i++, d++)
+      if (d->deviceid == raw->deviceid) break;
+   if (i == npointer_devices) return;
+   if (evtype == XI_RawButtonPress && raw->detail > 0 && raw->detail <= 32)
+      pointer_buttons |= 1u << (raw->detail-1);
+   else if (evtype == XI_RawButtonRelease && raw->detail > 0
+         && raw->detail <= 32)
+      pointer_buttons &= ~(1u << (raw->detail-1));
+   else if (evtype == XI_RawMotion && pointer_known) {
+      /* The values are packed, one for each axis in the mask */
+      for (axis=i=0; axis<2 && axis < raw->valuators.mask_len*8; axis++) {
+         if (!XIMaskIsSet(raw->valuators.mask, axis)) continue;
+         value = raw->valuators.values[i++];
+         p = axis ? &pointer_y : &pointer_x;
+         size = axis ? display_height : display_width;
+         if (d->absolute[axis])
+            *p = (value - d->min[axis])*size/(d->max[axis] - d->min[axis]);
+         else
+            *p += value;
+         if (*p < 0) *p = 0;
+         if (*p > size-1) *p = size-1;
+      }
+   }
+   return;
+}
+#endif
 
-   return display;
+/* Xlib backend: find the monitors with XRandR, one per active CRTC */
+void _ToonXLocateMonitors()
+{
+#ifdef HAVE_XRANDR
+   XRRScreenResources *resources;
+   XRRCrtcInfo *info;
+   XRectangle *rects;
+   int i, n = 0;
+
+   if (xrandr_event_base >= 0
+         && (resources = XRRGetScreenResourcesCurrent(display, root))) {
+      xlib_round_trips++;
+      if ((rects = malloc((resources->ncrtc+1)*sizeof(XRectangle)))) {
+         for (i=0; i<resources->ncrtc; i++) {
+            info = XRRGetCrtcInfo(display, resources, resources->crtcs[i]);
+            xlib_round_trips++;
+            if (info == NULL) continue;
+            if (info->mode != None && info->noutput > 0) {
+               rects[n].x = info->x;
+               rects[n].y = info->y;
+               rects[n].width = info->width;
+               rects[n].height = info->height;
+               n++;
+            }
+            XRRFreeCrtcInfo(info);
+         }
+         _ToonSetMonitors(rects, n);
+         free(rects);
+      }
+      XRRFreeScreenResources(resources);
+      if (n > 0) return;
+   }
+#endif
+   _ToonSetMonitors(NULL, 0);
+   return;
 }
 
 /* Configure signal handling and the way the toons behave via a bitmask */
-/* Currently always returns 0 */
+/* Returns 0, or 1 if something asked for can't be done on this display
+   (see ToonErrorMessage()); the rest is done anyway */
 int ToonConfigure(unsigned long int code)
 {
+   int result = 0;
    if (code & TOON_EDGEBLOCK)
       edge_block=1;
    else if (code & TOON_SIDEBOTTOMBLOCK)
@@ -158,96 +593,686 @@ int ToonConfigure(unsigned long int code)
       shaped_windows=1;
    else if (code & TOON_NOSHAPEDWINDOWS)
       shaped_windows=0;
+   if (code & TOON_SHAREDPIXMAPS)
+      share_pixmaps=1;
+   else if (code & TOON_NOSHAREDPIXMAPS)
+      share_pixmaps=0;
+   if (code & TOON_GAPWALLS)
+      gap_walls=1;
+   else if (code & TOON_GAPVOIDS)
+      gap_walls=0;
+   if (code & TOON_VSYNC) {
+      if (present_opcode < 0 || toon_backend != &toon_xlib_backend) {
+         strncpy(toon_error_message, "Can't follow vertical blank "
+               "without the Present extension", TOON_MESSAGE_LENGTH);
+         result = 1;
+      }
+      else
+         vsync=1;
+   }
+   else if (code & TOON_NOVSYNC)
+      vsync=0;
    if (code & TOON_CATCHSIGNALS) {
       signal(SIGINT, _ToonSignalHandler);
       signal(SIGTERM, _ToonSignalHandler);
       signal(SIGHUP, _ToonSignalHandler);
    }
    else if (code & TOON_EXITGRACEFULLY) {
-      signal(SIGINT, _ToonExitGracefully);
-      signal(SIGTERM, _ToonExitGracefully);
-      signal(SIGHUP, _ToonExitGracefully);
+      signal(SIGINT, _ToonExitSignalHandler);
+      signal(SIGTERM, _ToonExitSignalHandler);
+      signal(SIGHUP, _ToonExitSignalHandler);
    }
    else if (code & TOON_NOCATCHSIGNALS) {
       signal(SIGINT, SIG_DFL);
       signal(SIGTERM, SIG_DFL);
       signal(SIGHUP, SIG_DFL);
    }
-   return 0;
+   return result;
 }
 
-/* Store the pixmaps to the server */
-/* Returns 0 on success, otherwise the return value from the Xpm function */
+/* Register the toon images; each type is only sent to the server when it
+   is first needed (see _ToonInstallType()), and the rest follow one per
+   frame once the first frame is out. Any images already installed are
+   released first. The table is copied, pixmaps and all, so the same one
+   may be installed on several displays; the images themselves are shared.
+   At a scale other than 1 (see ToonSetScale()) it is the scaled copy of
+   the table that is installed */
+/* Returns 0 on success, XpmNoMemory if out of memory (see
+   ToonErrorMessage()), in which case nothing is installed */
 int ToonInstallData(ToonData *data, int n)
 {
-   int i, status;
-   XpmAttributes attributes;
-   for (i=0;i<n;i++) {
-      attributes.valuemask |= (XpmReturnPixels
-                | XpmReturnExtensions | XpmExactColors | XpmCloseness);
-      attributes.exactColors=False;
-      attributes.closeness=40000;
-      if ((status = XpmCreatePixmapFromData(display, root, (data+i)->image,
-            &((data+i)->pixmap), &((data+i)->mask), &attributes))) {
-         return status;
-      }      
+   double scale = _ToonScaleFor();
+
+   _ToonReleaseData();
+   if ((scale != 1.0
+         && (data = _ToonScaleData(data, n, scale, scale_filter)) == NULL)
+         || (toon_installed = calloc(n, sizeof(char))) == NULL) {
+      strncpy(toon_error_message, "Out of memory", TOON_MESSAGE_LENGTH);
+      return XpmNoMemory;
+   }
+   toon_scale = scale;
+   if ((toon_data = malloc(n*sizeof(ToonData))) == NULL) {
+      free(toon_installed);
+      toon_installed = NULL;
+      strncpy(toon_error_message, "Out of memory", TOON_MESSAGE_LENGTH);
+      return XpmNoMemory;
+   }
+   memcpy(toon_data, data, n*sizeof(ToonData));
+   toon_ntypes = toon_npending = n;
+   return 0;
+}
+
+/* Send the image of one type to the server. A type that cannot be
+   installed is reported once and then never drawn */
+/* Returns 0 if the type is ready to draw, otherwise the backend status */
+int _ToonInstallType(int type)
+{
+   int status;
+   unsigned long req, rt;
+
+   if (toon_installed[type] != TOON_TYPEPENDING)
+      return toon_installed[type] == TOON_TYPEFAILED;
+   toon_backend->count_requests(&req, &rt);
+   status = toon_backend->install_data(toon_data, toon_ntypes, type);
+   _ToonAccount(TOON_CALL_INSTALL, req, rt);
+   toon_npending--;
+   if (status) {
+      toon_installed[type] = TOON_TYPEFAILED;
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't install image of type %d (status %d)", type, status);
+      fprintf(stderr, "Warning: %s\n", toon_error_message);
+      return status;
+   }
+   toon_installed[type] = TOON_TYPEINSTALLED;
+   return 0;
+}
+
+/* Free whatever the backend holds for the installed types */
+void _ToonReleaseData()
+{
+   int i;
+   if (toon_installed == NULL) return;
+   for (i=0; i<toon_ntypes; i++)
+      if (toon_installed[i] == TOON_TYPEINSTALLED)
+         toon_backend->free_data(toon_data, toon_ntypes, i);
+   /* Shared images are held as a set, whichever types were drawn */
+   if (toon_backend == &toon_xlib_backend)
+      _ToonXShareRelease();
+   free(toon_installed);
+   free(toon_data);
+   toon_installed = NULL;
+   toon_data = NULL;
+   toon_ntypes = toon_npending = 0;
+   _ToonGraphForget();
+   return;
+}
+
+/* Scale an 8-bit channel into the bits of a visual's colour mask */
+unsigned long _ToonXChannel(unsigned int value, unsigned long mask)
+{
+   int shift = 0;
+   if (mask == 0) return 0;
+   while (!(mask & 1)) {
+      mask >>= 1;
+      shift++;
+   }
+   return ((value*mask + 127)/255) << shift;
+}
+
+/* The pixel of a colour given as 0xRRGGBB; without a TrueColor visual
+   only black or white, whichever is nearer */
+unsigned long _ToonXPixel(Display *d, unsigned int colour)
+{
+   /* Not `screen': the render thread of the async backend calls this */
+   Visual *visual = DefaultVisual(d, DefaultScreen(d));
+   if (visual->class != TrueColor)
+      return ((colour>>16) & 0xff) + ((colour>>8) & 0xff) + (colour & 0xff)
+            > 3*127 ? WhitePixel(d, DefaultScreen(d))
+            : BlackPixel(d, DefaultScreen(d));
+   return _ToonXChannel((colour>>16) & 0xff, visual->red_mask)
+         | _ToonXChannel((colour>>8) & 0xff, visual->green_mask)
+         | _ToonXChannel(colour & 0xff, visual->blue_mask);
+}
+
+/* Xlib backend: upload already decoded pixels (from a theme) with
+   XPutImage, which needs a TrueColor visual */
+/* Returns 0 on success, otherwise an Xpm error code */
+int _ToonXPutPixels(Display *d, GC gc, ToonData *data)
+{
+   Visual *visual = DefaultVisual(d, screen);
+   int depth = DefaultDepth(d, screen);
+   int width = data->image_width, height = data->image_height;
+   int x, y;
+   unsigned int one = 1, p;
+   XImage *ximage;
+
+   if (visual->class != TrueColor)
+      return XpmColorFailed;
+   if ((ximage = XCreateImage(d, visual, depth, ZPixmap, 0, NULL,
+         width, height, 32, 0)) == NULL)
+      return XpmNoMemory;
+   if (ximage->bits_per_pixel == 32 && visual->red_mask == 0xff0000
+         && visual->green_mask == 0xff00 && visual->blue_mask == 0xff) {
+      /* The usual case: the pixels go as they are, in our byte order */
+      ximage->data = (char *) data->pixels;
+      ximage->byte_order = *((char *) &one) ? LSBFirst : MSBFirst;
    }
+   else {
+      if ((ximage->data = malloc(ximage->bytes_per_line*height)) == NULL) {
+         XDestroyImage(ximage);
+         return XpmNoMemory;
+      }
+      for (y=0; y<height; y++) {
+         for (x=0; x<width; x++) {
+            p = data->pixels[y*width+x];
+            XPutPixel(ximage, x, y,
+                  _ToonXChannel((p>>16) & 0xff, visual->red_mask)
+                  | _ToonXChannel((p>>8) & 0xff, visual->green_mask)
+                  | _ToonXChannel(p & 0xff, visual->blue_mask));
+         }
+      }
+   }
+   data->pixmap = XCreatePixmap(d, RootWindow(d, screen), width, height,
+         depth);
+   XPutImage(d, data->pixmap, gc, ximage, 0, 0, 0, 0, width, height);
+   if (ximage->data == (char *) data->pixels)
+      ximage->data = NULL;
+   XDestroyImage(ximage);
+   data->mask = XCreateBitmapFromData(d, RootWindow(d, screen),
+         (char *) data->mask_bits, width, height);
+   return 0;
+}
 
-   toon_data=data;
+/* Decoded pixels are only any use on a TrueColor visual */
+#define _ToonXUsePixels(data) ((data)->pixels && ((data)->image == NULL \
+      || DefaultVisual(display, screen)->class == TrueColor))
+
+/* Xlib backend: convert the image of one type to a pixmap on the server
+   through connection d, keeping a note of the colours allocated for it */
+int _ToonXUpload(Display *d, GC gc, ToonData *data)
+{
+   int status;
+   XpmAttributes attributes;
+   data->colors = NULL;
+   data->ncolors = 0;
+   if (_ToonXUsePixels(data))
+      return _ToonXPutPixels(d, gc, data);
+
+   attributes.valuemask = XpmReturnPixels | XpmExactColors | XpmCloseness;
+   attributes.exactColors=False;
+   attributes.closeness=40000;
+   if ((status = XpmCreatePixmapFromData(d, RootWindow(d, screen),
+         data->image, &(data->pixmap), &(data->mask), &attributes))) {
+      return status;
+   }
+   /* Each colour allocated waited for a reply */
+   if (d == display)
+      xlib_round_trips += attributes.npixels;
+   if (attributes.npixels
+         && (data->colors = malloc(attributes.npixels*sizeof(Pixel)))) {
+      memcpy(data->colors, attributes.pixels, attributes.npixels*sizeof(Pixel));
+      data->ncolors = attributes.npixels;
+   }
+   XpmFreeAttributes(&attributes);
    return 0;
 }
 
+/* SHARING PIXMAPS BETWEEN INSTANCES
+ *
+ * With TOON_SHAREDPIXMAPS the images of all the types installed together
+ * are published in one root window property named after a hash of them.
+ * It holds a pixmap of the connection that made them, the number of
+ * types, the pixmap and mask of each, and then the holders: one unmapped
+ * window per instance using them, which the server destroys when that
+ * instance goes, however it goes. The images are made on a connection of
+ * their own that is closed in RetainPermanent mode, so they outlive the
+ * instance that made them; whoever finds no holder left but itself
+ * kills them with XKillClient(). The property is only read and written
+ * with the server grabbed. */
+
+/* The property naming a set of images */
+Atom _ToonXShareAtom(ToonData *data, int n)
+{
+   char name[64];
+   unsigned long long hash = TOON_HASHINIT;
+   int i, t, depth = DefaultDepth(display, screen);
+   int width, height, ncolors, cpp;
+
+   hash = _ToonHash(hash, &depth, sizeof(depth));
+   hash = _ToonHash(hash, &n, sizeof(n));
+   for (t=0; t<n; t++) {
+      if (_ToonXUsePixels(data+t)) {
+         hash = _ToonHash(hash, &(data[t].image_width), sizeof(int));
+         hash = _ToonHash(hash, &(data[t].image_height), sizeof(int));
+         hash = _ToonHash(hash, data[t].pixels,
+               data[t].image_width*data[t].image_height*sizeof(unsigned int));
+      }
+      else if (sscanf(data[t].image[0], "%d %d %d %d", &width, &height,
+            &ncolors, &cpp) == 4) {
+         for (i=0; i<1+ncolors+height; i++)
+            hash = _ToonHash(hash, data[t].image[i],
+                  strlen(data[t].image[i])+1);
+      }
+   }
+   snprintf(name, sizeof(name), "_XTOON_SPRITES_%016llx", hash);
+   xlib_round_trips++;
+   return XInternAtom(display, name, False);
+}
+
+/* With the server grabbed, whether a pixmap or holder window still
+   exists */
+/* Returns 1 if it does, 0 if not */
+int _ToonXShareAlive(XID resource)
+{
+   Window dummy;
+   int x, y;
+   unsigned int width, height, border, depth;
+   int alive;
+
+   if (resource == None) return 0;
+   if (resource == xlib_holder) return 1;
+   catch_errors = 1;
+   alive = XGetGeometry(display, resource, &dummy, &x, &y, &width, &height,
+         &border, &depth);
+   catch_errors = 0;
+   xlib_round_trips++;
+   return alive != 0;
+}
+
+/* With the server grabbed, read the set published under atom, dropping
+   the holders that have gone and adding ourselves. A set whose images
+   have gone is unpublished */
+/* Returns 1 if there was a set of n types, 0 if not */
+int _ToonXShareLookup(Atom atom, ToonData *data, int n)
+{
+   Atom type;
+   int format, t;
+   unsigned long i, nitems, after, *value = NULL;
+   long *entry;
+   int nentry;
+
+   xlib_round_trips++;
+   if (XGetWindowProperty(display, root, atom, 0, TOON_SHAREMAXLENGTH,
+         False, XA_CARDINAL, &type, &format, &nitems, &after,
+         (unsigned char **) &value) != Success || type != XA_CARDINAL
+         || format != 32 || nitems < 2 || value[1] != (unsigned long) n
+         || nitems < 2+2*(unsigned long) n) {
+      if (value) XFree(value);
+      return 0;
+   }
+   if (!_ToonXShareAlive(value[0])) {
+      XDeleteProperty(display, root, atom);
+      XFree(value);
+      return 0;
+   }
+   if ((entry = malloc((nitems+1)*sizeof(long))) == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      _ToonExitGracefully(1);
+   }
+   for (nentry=0; nentry<2+2*n; nentry++)
+      entry[nentry] = value[nentry];
+   for (i=2+2*n; i<nitems; i++)
+      if (value[i] != xlib_holder && _ToonXShareAlive(value[i]))
+         entry[nentry++] = value[i];
+   entry[nentry++] = xlib_holder;
+   XChangeProperty(display, root, atom, XA_CARDINAL, 32, PropModeReplace,
+         (unsigned char *) entry, nentry);
+   for (t=0; t<n; t++) {
+      data[t].pixmap = entry[2+2*t];
+      data[t].mask = entry[3+2*t];
+   }
+   xlib_sharekey = entry[0];
+   free(entry);
+   XFree(value);
+   return 1;
+}
+
+/* Use the published copy of the images of all the types, or make them
+   on one connection and publish them */
+/* Returns 1 if they are shared, 0 if each type is to be uploaded as
+   usual */
+int _ToonXShareData(ToonData *data, int n)
+{
+   Display *maker;
+   Atom atom;
+   Pixmap key = None;
+   long *entry;
+   int t, found;
+
+   for (t=0; t<n; t++) {
+      data[t].pixmap = data[t].mask = None;
+      data[t].colors = NULL;
+      data[t].ncolors = 0;
+   }
+   if (xlib_holder == None)
+      xlib_holder = XCreateWindow(display, root, -1, -1, 1, 1, 0,
+            CopyFromParent, InputOnly, CopyFromParent, 0, NULL);
+   atom = _ToonXShareAtom(data, n);
+   XGrabServer(display);
+   found = _ToonXShareLookup(atom, data, n);
+   XUngrabServer(display);
+   if (found) {
+      xlib_share = atom;
+      return 1;
+   }
+
+   /* The grab has to end first, since nobody else can connect while the
+      server is grabbed; so the lookup is made again under a second grab
+      before ours are published */
+   if ((maker = XOpenDisplay(DisplayString(display))) == NULL)
+      return 0;
+   for (t=0; t<n; t++) {
+      if (_ToonXUpload(maker, DefaultGC(maker, screen), data+t))
+         data[t].pixmap = data[t].mask = None;
+      else if (key == None)
+         key = data[t].pixmap;
+      /* The colours now belong to the maker, and go when it is killed */
+      if (data[t].colors) free(data[t].colors);
+      data[t].colors = NULL;
+      data[t].ncolors = 0;
+   }
+   XSetCloseDownMode(maker, key ? RetainPermanent : DestroyAll);
+   XCloseDisplay(maker);
+   if (key == None)
+      return 0;
+
+   if ((entry = malloc((3+2*n)*sizeof(long))) == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      _ToonExitGracefully(1);
+   }
+   XGrabServer(display);
+   if (_ToonXShareLookup(atom, data, n)) {
+      /* Somebody else was quicker; ours are not wanted */
+      XKillClient(display, key);
+   }
+   else {
+      entry[0] = key;
+      entry[1] = n;
+      for (t=0; t<n; t++) {
+         entry[2+2*t] = data[t].pixmap;
+         entry[3+2*t] = data[t].mask;
+      }
+      entry[2+2*n] = xlib_holder;
+      XChangeProperty(display, root, atom, XA_CARDINAL, 32,
+            PropModeReplace, (unsigned char *) entry, 3+2*n);
+      xlib_sharekey = key;
+   }
+   XUngrabServer(display);
+   free(entry);
+   xlib_share = atom;
+   return 1;
+}
+
+/* Stop holding the published set, freeing it if nobody else still holds
+   it, and forget whether the next set can be shared */
+void _ToonXShareRelease()
+{
+   Atom type;
+   int format;
+   unsigned long i, nitems, after, *value = NULL;
+   long *entry = NULL;
+   int nentry = 0;
+
+   xlib_sharing = 0;
+   if (xlib_share == None) return;
+   XGrabServer(display);
+   xlib_round_trips++;
+   if (XGetWindowProperty(display, root, xlib_share, 0, TOON_SHAREMAXLENGTH,
+         False, XA_CARDINAL, &type, &format, &nitems, &after,
+         (unsigned char **) &value) == Success && type == XA_CARDINAL
+         && format == 32 && nitems >= 2 && value[0] == xlib_sharekey
+         && nitems >= 2+2*value[1]) {
+      if ((entry = malloc(nitems*sizeof(long))) == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         _ToonExitGracefully(1);
+      }
+      for (nentry=0; nentry<2+2*value[1]; nentry++)
+         entry[nentry] = value[nentry];
+      for (i=2+2*value[1]; i<nitems; i++)
+         if (value[i] != xlib_holder && _ToonXShareAlive(value[i]))
+            entry[nentry++] = value[i];
+      if (nentry == 2+2*value[1]) {
+         XDeleteProperty(display, root, xlib_share);
+         /* The key was seen under this grab, but a failure is only
+            reported later */
+         catch_errors = 1;
+         XKillClient(display, xlib_sharekey);
+         XSync(display, False);
+         catch_errors = 0;
+         xlib_round_trips++;
+      }
+      else
+         XChangeProperty(display, root, xlib_share, XA_CARDINAL, 32,
+               PropModeReplace, (unsigned char *) entry, nentry);
+      free(entry);
+   }
+   if (value) XFree(value);
+   XUngrabServer(display);
+   xlib_share = None;
+   xlib_sharekey = None;
+   return;
+}
+
+/* Xlib backend: convert the image of one type to a pixmap on the server,
+   or find it already there. When sharing, the first type asked for
+   brings all of them */
+int _ToonXInstallData(ToonData *data, int n, int type)
+{
+   if (n > xlib_nshared) {
+      if ((xlib_shared = realloc(xlib_shared, n)) == NULL) {
+         xlib_nshared = 0;
+         return XpmNoMemory;
+      }
+      memset(xlib_shared+xlib_nshared, 0, n-xlib_nshared);
+      xlib_nshared = n;
+   }
+   xlib_shared[type] = 0;
+   if (share_pixmaps && !xlib_sharing)
+      xlib_sharing = _ToonXShareData(data, n) ? 1 : -1;
+   /* A type the maker could not make is tried on our own connection */
+   if (xlib_sharing > 0 && data[type].pixmap) {
+      xlib_shared[type] = 1;
+      return 0;
+   }
+   return _ToonXUpload(display, draw_toonGC, data+type);
+}
+
+/* Xlib backend: free the pixmaps and colours of one type */
+void _ToonXFreeData(ToonData *data, int n, int type)
+{
+   data += type;
+   /* A shared type is let go of by _ToonXShareRelease(), all at once */
+   if (type < xlib_nshared && xlib_shared[type]) {
+      xlib_shared[type] = 0;
+      data->pixmap = data->mask = None;
+      return;
+   }
+   if (data->pixmap) XFreePixmap(display, data->pixmap);
+   if (data->mask) XFreePixmap(display, data->mask);
+   data->pixmap = data->mask = None;
+   if (data->colors) {
+      XFreeColors(display, DefaultColormap(display, screen), data->colors,
+            data->ncolors, 0);
+      free(data->colors);
+   }
+   data->colors = NULL;
+   data->ncolors = 0;
+   return;
+}
+
 
 /* DRAWING FUNCTIONS */
 
+/* A toon that is hidden and has not changed since it was last drawn
+   is left as it is by ToonErase() and ToonDraw(): nobody would see the
+   difference, and it is drawn again once it changes or is uncovered
+   (see ToonRepair()). Not so with the async backend, whose render thread
+   clears everything each frame and paints only what it is given */
+static int _ToonDrawSkipped(Toon *t)
+{
+   if (toon_backend == &toon_async_backend)
+      return 0;
+   return t->detail != TOON_DETAILFULL && t->x == t->x_map
+         && t->y == t->y_map && t->type == t->type_map
+         && t->frame == t->frame_map && t->direction == t->direction_map;
+}
+
 /* Draw the toons from toon[0] to toon[n-1] */
 /* Currently always returns 0 */
 int ToonDraw(Toon *toon, int n)
 {
-   int width,height,i;
+   int i;
    Toon *t;
+   unsigned long req, rt;
+   /* Upload any types not yet seen, charged to the install */
+   for (i=0;i<n;i++)
+      if (toon[i].active && toon_installed[toon[i].type] == TOON_TYPEPENDING)
+         _ToonInstallType(toon[i].type);
+   toon_backend->count_requests(&req, &rt);
+   /* Remember where they went, for ToonCloseDisplay() to clear */
+   if (n > toons_drawn_size) {
+      toons_drawn_size = n;
+      if ((toons_drawn = realloc(toons_drawn, n*sizeof(XRectangle))) == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         _ToonExitGracefully(1);
+      }
+   }
+   ntoons_drawn = 0;
    for (i=0;i<n;i++) {
       t=toon+i;
       if (t->active) {
-      width=toon_data[t->type].width;
-      height=toon_data[t->type].height;
-
-      XSetClipOrigin(display, draw_toonGC,
-         t->x-width*t->frame, t->y-height*t->direction); 
-      XSetClipMask(display, draw_toonGC, 
-         toon_data[t->type].mask);   
-      XCopyArea(display,
-         toon_data[t->type].pixmap,
-         root,draw_toonGC,width*t->frame,height*t->direction,
-         width,height,t->x,t->y);
-      XSetClipMask(display, draw_toonGC, None);
+      if (toon_installed[t->type] == TOON_TYPEINSTALLED) {
+         if (!_ToonDrawSkipped(t))
+            toon_backend->draw(t);
+         toons_drawn[ntoons_drawn].x = t->x;
+         toons_drawn[ntoons_drawn].y = t->y;
+         toons_drawn[ntoons_drawn].width = toon_data[t->type].width;
+         toons_drawn[ntoons_drawn].height = toon_data[t->type].height;
+         ntoons_drawn++;
+      }
       t->x_map = t->x;
       t->y_map = t->y;
-      t->width_map = width;
-      t->height_map = height;
+      t->width_map = toon_data[t->type].width;
+      t->height_map = toon_data[t->type].height;
+      t->type_map = t->type;
+      t->frame_map = t->frame;
+      t->direction_map = t->direction;
       }
    }
+   _ToonAccount(TOON_CALL_DRAW, req, rt);
     return 0;
 }
 
+/* Xlib backend: copy one frame of a toon to the root window */
+void _ToonXDraw(Toon *t)
+{
+   int width=toon_data[t->type].width;
+   int height=toon_data[t->type].height;
+
+   XSetClipOrigin(display, draw_toonGC,
+      t->x-width*t->frame, t->y-height*t->direction); 
+   XSetClipMask(display, draw_toonGC, 
+      toon_data[t->type].mask);   
+   XCopyArea(display,
+      toon_data[t->type].pixmap,
+      root,draw_toonGC,width*t->frame,height*t->direction,
+      width,height,t->x,t->y);
+   XSetClipMask(display, draw_toonGC, None);
+   return;
+}
+
 /* Erase toons toon[0] to toon[n-1] */
 /* Currently always returns 0 */
 int ToonErase(Toon *toon,int n)
 {
    int i;
    Toon *t;
+   unsigned long req, rt;
+   toon_backend->count_requests(&req, &rt);
    for (i=0;i<n;i++) {
       t=toon+i;
-      XClearArea(display, root, t->x_map, t->y_map,
-            t->width_map, t->height_map, False);
+      /* Not drawn yet: a zero size would clear to the edge of the window */
+      if (t->width_map <= 0 || t->height_map <= 0) continue;
+      if (t->active && _ToonDrawSkipped(t)) continue;
+      toon_backend->erase(t->x_map, t->y_map, t->width_map, t->height_map);
    }
+   _ToonAccount(TOON_CALL_ERASE, req, rt);
    return 0;
 }
 
-/* Send any buffered X calls immediately */
+/* Draw again those of the toons that were on the parts of the root window
+   that have been uncovered since the last call (see ToonWindowsMoved()),
+   as they were drawn then; for use between frames */
+/* Returns the number of toons drawn */
+int ToonRepair(Toon *toon, int n)
+{
+   int i, count = 0;
+   Toon t;
+   unsigned long req, rt;
+
+   if (XEmptyRegion(exposed))
+      return 0;
+   toon_backend->count_requests(&req, &rt);
+   for (i=0;i<n;i++) {
+      if (!toon[i].active || toon[i].width_map <= 0
+            || XRectInRegion(exposed, toon[i].x_map, toon[i].y_map,
+            toon[i].width_map, toon[i].height_map) == RectangleOut
+            || toon_installed[toon[i].type_map] != TOON_TYPEINSTALLED)
+         continue;
+      t = toon[i];
+      t.x = t.x_map;
+      t.y = t.y_map;
+      t.type = t.type_map;
+      t.frame = t.frame_map;
+      t.direction = t.direction_map;
+      toon_backend->repair(&t);
+      count++;
+   }
+   if (count) toon_backend->flush();
+   XDestroyRegion(exposed);
+   exposed = XCreateRegion();
+   _ToonAccount(TOON_CALL_DRAW, req, rt);
+   return count;
+}
+
+/* Xlib backend: restore the root window background */
+void _ToonXErase(int x, int y, int width, int height)
+{
+   XClearArea(display, root, x, y, width, height, False);
+   return;
+}
+
+/* Xlib backend: fill rectangles of the root window in one colour */
+void _ToonXFill(XRectangle *rects, int n, unsigned int colour)
+{
+   XSetForeground(display, fill_gc, _ToonXPixel(display, colour));
+   XFillRectangles(display, root, fill_gc, rects, n);
+   return;
+}
+
+/* Send any buffered X calls immediately; then, with the frame on its way,
+   upload the next of the types that have not been needed yet */
 void ToonFlush()
+{
+   int i;
+   unsigned long req, rt;
+   toon_backend->count_requests(&req, &rt);
+   toon_backend->flush();
+   _ToonAccount(TOON_CALL_FLUSH, req, rt);
+   if (toon_npending) {
+      for (i=0; toon_installed[i] != TOON_TYPEPENDING; i++);
+      _ToonInstallType(i);
+   }
+   _ToonExitIfAsked();
+   return;
+}
+
+void _ToonXFlush()
 {
    XFlush(display);
+   /* The frame reaches the screen at the next blank */
+   if (vsync && present_flushed == 0.0)
+      present_flushed = _ToonNow();
    return;
 }
 
@@ -330,18 +1355,449 @@ int ToonOffsetBlocked(Toon *toon, int xoffset, int yoffset)
          != RectangleOut);
 }
 
+/* Returns 1 if any part of the toon would be seen if drawn now, i.e. it
+   is on the screen and not entirely hidden behind windows */
+int ToonVisible(Toon *toon)
+{
+   int width = toon_data[toon->type].width;
+   int height = toon_data[toon->type].height;
+   if (toon->x >= display_width || toon->y >= display_height
+         || toon->x + width <= 0 || toon->y + height <= 0)
+      return 0;
+   return XRectInRegion(covered, toon->x, toon->y, width, height)
+         != RectangleIn;
+}
+
+/* Returns 1 if drawing the toon now would change any pixels on the screen,
+   0 if it is unchanged since it was last drawn or cannot be seen either
+   where it was or where it is now */
+int ToonChanged(Toon *toon)
+{
+   if (!toon->active)
+      return toon->width_map > 0 && XRectInRegion(covered, toon->x_map,
+            toon->y_map, toon->width_map, toon->height_map) != RectangleIn;
+   if (toon->x == toon->x_map && toon->y == toon->y_map
+         && toon->type == toon->type_map && toon->frame == toon->frame_map
+         && toon->direction == toon->direction_map)
+      return 0;
+   return ToonVisible(toon) || XRectInRegion(covered, toon->x_map,
+         toon->y_map, toon->width_map, toon->height_map) != RectangleIn;
+}
+
+/* Returns 1 if windows hide the whole of the root window, as with a
+   fullscreen application or a screen locker */
+int ToonScreenCovered()
+{
+   return XRectInRegion(covered, 0, 0, display_width, display_height)
+         == RectangleIn;
+}
+
+/* MONITORS */
+
+/* Take a new monitor layout, or one monitor filling the screen if n is 0.
+   A monitor that is still where it was keeps its number, so that toons
+   on it need not be partitioned again */
+/* Returns 1 if the layout changed */
+int _ToonSetMonitors(XRectangle *rects, int n)
+{
+   XRectangle whole, *new;
+   Region shown;
+   char *placed;
+   int i, j, changed;
+
+   whole.x = whole.y = 0;
+   whole.width = display_width;
+   whole.height = display_height;
+   if (n == 0) {
+      rects = &whole;
+      n = 1;
+   }
+   changed = n != nmonitors
+         || memcmp(rects, monitors, n*sizeof(XRectangle)) != 0;
+   if ((new = malloc(n*sizeof(XRectangle))) == NULL
+         || (placed = calloc(n, 1)) == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      _ToonExitGracefully(1);
+   }
+   for (i=0; i<n; i++)
+      new[i].width = 0;
+   for (j=0; j<n; j++) {
+      for (i=0; i<nmonitors && i<n; i++) {
+         if (new[i].width == 0 && memcmp(rects+j, monitors+i,
+               sizeof(XRectangle)) == 0) {
+            new[i] = rects[j];
+            placed[j] = 1;
+            break;
+         }
+      }
+   }
+   for (j=0, i=0; j<n; j++) {
+      if (placed[j]) continue;
+      while (new[i].width) i++;
+      new[i] = rects[j];
+   }
+   free(placed);
+   if (monitors) free(monitors);
+   monitors = new;
+   nmonitors = n;
+
+   /* The gaps are whatever of the screen no monitor covers */
+   if (gaps) {
+      shown = XCreateRegion();
+      for (i=0; i<n; i++)
+         XUnionRectWithRegion(monitors+i, shown, shown);
+      XDestroyRegion(gaps);
+      gaps = XCreateRegion();
+      XUnionRectWithRegion(&whole, gaps, gaps);
+      XSubtractRegion(gaps, shown, gaps);
+      XDestroyRegion(shown);
+      _ToonGraphForget();
+   }
+   return changed;
+}
+
+/* Return the number of monitors */
+int ToonMonitors()
+{
+   return nmonitors;
+}
+
+/* Get the position and size of a monitor */
+/* Returns 0 on success, 1 if there is no such monitor */
+int ToonMonitorGeometry(int monitor, int *x, int *y, int *width, int *height)
+{
+   if (monitor < 0 || monitor >= nmonitors)
+      return 1;
+   *x = monitors[monitor].x;
+   *y = monitors[monitor].y;
+   *width = monitors[monitor].width;
+   *height = monitors[monitor].height;
+   return 0;
+}
+
+/* Note which monitor each toon is on, going by its middle, or -1 if it
+   is between monitors or off the screen. Only toons that have left the
+   monitor they were on are looked for again */
+/* Returns the number of toons that changed monitor */
+int ToonPartition(Toon *toon, int n)
+{
+   int i, m, x, y, changed = 0;
+   XRectangle *r;
+   for (i=0; i<n; i++) {
+      x = toon[i].x + toon_data[toon[i].type].width/2;
+      y = toon[i].y + toon_data[toon[i].type].height/2;
+      m = toon[i].monitor;
+      if (m >= 0 && m < nmonitors) {
+         r = monitors+m;
+         if (x >= r->x && x < r->x + r->width
+               && y >= r->y && y < r->y + r->height)
+            continue;
+      }
+      for (m=0, r=monitors; m<nmonitors; m++, r++) {
+         if (x >= r->x && x < r->x + r->width
+               && y >= r->y && y < r->y + r->height)
+            break;
+      }
+      if (m == nmonitors) m = -1;
+      if (m != toon[i].monitor) {
+         toon[i].monitor = m;
+         changed++;
+      }
+   }
+   return changed;
+}
+
+/* The furthest a toon's velocity could take it in a frame, in pixels */
+static int _ToonFrameDistance(Toon *toon)
+{
+   int distance = abs(toon->u) + abs(toon->v);
+   if (time_step > 0.0)
+      return (int) ceil(distance * time_step / TOON_SUBPIXELS);
+   return distance;
+}
+
+/* The level of detail a toon deserves: anything that could come into
+   view within one of its coarse updates is kept at full detail, so no
+   toon is seen to jump when it changes level */
+static int _ToonDetailOf(Toon *toon)
+{
+   int margin, x, y, width, height;
+   margin = TOON_DETAILMARGIN + _ToonFrameDistance(toon)
+         * (detail_step[TOON_DETAILHIDDEN] > detail_step[TOON_DETAILOFFSCREEN]
+         ? detail_step[TOON_DETAILHIDDEN] : detail_step[TOON_DETAILOFFSCREEN]);
+   x = toon->x - margin;
+   y = toon->y - margin;
+   width = toon_data[toon->type].width + 2*margin;
+   height = toon_data[toon->type].height + 2*margin;
+   if (x >= display_width || y >= display_height
+         || x + width <= 0 || y + height <= 0)
+      return TOON_DETAILOFFSCREEN;
+   if (XRectInRegion(covered, x, y, width, height) == RectangleIn)
+      return TOON_DETAILHIDDEN;
+   return TOON_DETAILFULL;
+}
+
+/* Sort the toons into levels of detail, once a frame before they are
+   moved. Toons that cannot be seen are updated only every few frames (see
+   ToonSetDetail()), with coarser collision detection, and should be
+   skipped in the frames between: see ToonDue() */
+/* Returns the number of toons due an update this frame */
+int ToonDetail(Toon *toon, int n)
+{
+   int i, detail, due = 0;
+   Toon *t;
+   for (i=0; i<n; i++) {
+      t = toon+i;
+      detail = t->active ? _ToonDetailOf(t) : TOON_DETAILFULL;
+      if (detail_step[detail] <= 1)
+         detail = TOON_DETAILFULL;
+      if (detail == TOON_DETAILFULL)
+         t->detail_wait = 0;
+      else if (t->detail != detail)
+         /* Spread the updates of a crowd over the frames between */
+         t->detail_wait = i % detail_step[detail];
+      else if (t->detail_wait > 0)
+         t->detail_wait--;
+      else
+         t->detail_wait = detail_step[detail] - 1;
+      t->detail = detail;
+      if (t->detail_wait == 0) due++;
+   }
+   return due;
+}
+
+/* Returns 1 if the toon is to be updated this frame */
+int ToonDue(Toon *toon)
+{
+   return toon->detail_wait == 0;
+}
+
+/* Grid cell of a point, off-screen points going to the nearest edge */
+static int _ToonGridCell(int x, int y)
+{
+   x = x < 0 ? 0 : x/grid_cell;
+   y = y < 0 ? 0 : y/grid_cell;
+   if (x >= grid_columns) x = grid_columns-1;
+   if (y >= grid_rows) y = grid_rows-1;
+   return y*grid_columns + x;
+}
+
+/* Sort the active toons into a grid of cells as big as the largest toon,
+   for ToonNeighbours() to search; called once a frame, before the toons
+   are moved */
+/* Returns the number of toons indexed */
+int ToonIndexNeighbours(Toon *toon, int n)
+{
+   int i, c, ncells, nindexed = 0;
+
+   grid_cell = 1;
+   for (i=0; i<toon_ntypes; i++) {
+      if (toon_data[i].width > grid_cell) grid_cell = toon_data[i].width;
+      if (toon_data[i].height > grid_cell) grid_cell = toon_data[i].height;
+   }
+   grid_columns = display_width/grid_cell + 1;
+   grid_rows = display_height/grid_cell + 1;
+   ncells = grid_columns*grid_rows;
+   if (ncells+1 > grid_ncells_size) {
+      grid_ncells_size = ncells+1;
+      if ((grid_start = realloc(grid_start, grid_ncells_size*sizeof(int)))
+            == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         _ToonExitGracefully(1);
+      }
+   }
+   if (n > grid_entries_size) {
+      grid_entries_size = n;
+      if ((grid_entries = realloc(grid_entries, n*sizeof(int))) == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         _ToonExitGracefully(1);
+      }
+   }
+   grid_toon = toon;
+
+   /* Counting sort: count each cell, turn the counts into the ends of
+      the cells, then fill each cell from its end */
+   memset(grid_start, 0, (ncells+1)*sizeof(int));
+   for (i=0; i<n; i++)
+      if (toon[i].active)
+         grid_start[_ToonGridCell(toon[i].x, toon[i].y)]++;
+   for (c=0; c<ncells; c++)
+      grid_start[c+1] += grid_start[c];
+   for (i=n-1; i>=0; i--) {
+      if (!toon[i].active) continue;
+      grid_entries[--grid_start[_ToonGridCell(toon[i].x, toon[i].y)]] = i;
+      nindexed++;
+   }
+   return nindexed;
+}
+
+/* The toons indexed by the last ToonIndexNeighbours() that overlap the
+   box from x0,y0 to x1,y1, other than `self', into near[] */
+/* Returns the number found, up to max */
+static int _ToonInBox(Toon *self, int x0, int y0, int x1, int y1, int *near,
+      int max)
+{
+   int c0, c1, c, cx, cy, e, count = 0;
+   Toon *t;
+
+   /* No toon is bigger than a cell, so any that overlap have their
+      corner in the cells from one up and left of x0,y0 to x1,y1 */
+   c0 = _ToonGridCell(x0 - grid_cell, y0 - grid_cell);
+   c1 = _ToonGridCell(x1, y1);
+   for (cy = c0/grid_columns; cy <= c1/grid_columns; cy++) {
+      for (cx = c0%grid_columns; cx <= c1%grid_columns; cx++) {
+         c = cy*grid_columns + cx;
+         for (e = grid_start[c]; e < grid_start[c+1]; e++) {
+            t = grid_toon + grid_entries[e];
+            if (t == self || !t->active
+                  || t->x >= x1 || t->x + toon_data[t->type].width <= x0
+                  || t->y >= y1 || t->y + toon_data[t->type].height <= y0)
+               continue;
+            if (count == max) return count;
+            near[count++] = grid_entries[e];
+         }
+      }
+   }
+   return count;
+}
+
+/* Find the other toons within `distance' pixels of this one, from those
+   indexed by the last ToonIndexNeighbours(). Their indices in the array
+   given to it go in near[], up to `max' of them. Toons are looked for
+   where they were indexed, so any that have since moved are only found
+   near where they were */
+/* Returns the number of neighbours put in near[] */
+int ToonNeighbours(Toon *toon, int distance, int *near, int max)
+{
+   if (grid_toon == NULL) return 0;
+   return _ToonInBox(toon, toon->x - distance, toon->y - distance,
+         toon->x + toon_data[toon->type].width + distance,
+         toon->y + toon_data[toon->type].height + distance, near, max);
+}
+
+/* Find where the pointer is and which of its buttons are held down, bit
+   n-1 for button n, as last heard of by ToonWindowsMoved(). No request
+   is made: with the Xlib backends the pointer is followed by XInput2
+   events (see HAVE_XINPUT2 in the Makefile) */
+/* Returns 1 if known, 0 if not, and then nothing is set */
+int ToonPointer(int *x, int *y, unsigned int *buttons)
+{
+   if (!pointer_known) return 0;
+   if (x) *x = (int) pointer_x;
+   if (y) *y = (int) pointer_y;
+   if (buttons) *buttons = pointer_buttons;
+   return 1;
+}
+
+/* Find the toons within `distance' pixels of the pointer, as
+   ToonNeighbours() does for a toon */
+/* Returns the number put in near[], 0 if the pointer is not known */
+int ToonNearPointer(int distance, int *near, int max)
+{
+   int x = (int) pointer_x, y = (int) pointer_y;
+   if (grid_toon == NULL || !pointer_known) return 0;
+   return _ToonInBox(NULL, x - distance, y - distance, x + distance + 1,
+         y + distance + 1, near, max);
+}
+
 /* Returns 1 if any change to the top-level window configuration has occurred,
    0 otherwise */
 int ToonWindowsMoved()
+{
+   int moved;
+   unsigned long req, rt;
+   toon_backend->count_requests(&req, &rt);
+   moved = toon_backend->windows_moved();
+   _ToonAccount(TOON_CALL_EVENTS, req, rt);
+   return moved;
+}
+
+/* Xlib backend: whether the main loop need hear of an event, as it must
+   of exposures and of windows or the screen changing, but not of the
+   pointer or the blanks, which are looked after while waiting */
+int _ToonXWakes(XEvent *event)
+{
+   if (event->type == Expose || event->type == ConfigureNotify
+         || event->type == MapNotify || event->type == UnmapNotify)
+      return 1;
+#ifdef HAVE_XRANDR
+   if (xrandr_event_base >= 0
+         && (event->type == xrandr_event_base + RRScreenChangeNotify
+         || event->type == xrandr_event_base + RRNotify))
+      return 1;
+#endif
+   return 0;
+}
+
+/* Xlib backend: deal with an event the main loop need not hear of */
+void _ToonXQuietEvent(XEvent *event)
+{
+   if (event->type != GenericEvent
+         || !XGetEventData(display, &event->xcookie))
+      return;
+#ifdef HAVE_XPRESENT
+   if (event->xcookie.extension == present_opcode) {
+      XPresentCompleteNotifyEvent *complete = event->xcookie.data;
+      if (event->xcookie.evtype == PresentCompleteNotify
+            && complete->window == root)
+         _ToonXBlank(complete->serial_number, complete->msc,
+               complete->ust*1e3);
+   }
+#endif
+#ifdef HAVE_XINPUT2
+   if (event->xcookie.extension == xinput_opcode)
+      _ToonXInputEvent(event->xcookie.evtype, event->xcookie.data);
+#endif
+   XFreeEventData(display, &event->xcookie);
+   return;
+}
+
+/* Xlib backend: drain the event queue */
+int _ToonXWindowsMoved()
 {
    XEvent event;
-   int windows_moved=0;
+   XRectangle rect;
+   int windows_moved=0, layout_changed=0;
    while (XPending(display)) {
       XNextEvent(display, &event);
-      if (event.type == ConfigureNotify || event.type == MapNotify
+      if (event.type == Expose) {
+         /* Kept for ToonRepair() */
+         rect.x = event.xexpose.x;
+         rect.y = event.xexpose.y;
+         rect.width = event.xexpose.width;
+         rect.height = event.xexpose.height;
+         XUnionRectWithRegion(&rect, exposed, exposed);
+      }
+      else if (event.type == ConfigureNotify
+            && event.xconfigure.window == root) {
+         /* The screen itself has changed size */
+         display_width = event.xconfigure.width;
+         display_height = event.xconfigure.height;
+         layout_changed=1;
+      }
+      else if (event.type == ConfigureNotify || event.type == MapNotify
             || event.type == UnmapNotify) {
          windows_moved=1;
       }
+#ifdef HAVE_XRANDR
+      else if (xrandr_event_base >= 0
+            && (event.type == xrandr_event_base + RRScreenChangeNotify
+            || event.type == xrandr_event_base + RRNotify)) {
+         XRRUpdateConfiguration(&event);
+         display_width = DisplayWidth(display, screen);
+         display_height = DisplayHeight(display, screen);
+         layout_changed=1;
+      }
+#endif
+      else if (event.type == GenericEvent) {
+         _ToonXQuietEvent(&event);
+      }
+   }
+   /* The windows are looked for again after a new layout, which brings
+      its gaps with it */
+   if (layout_changed) {
+      _ToonXLocateMonitors();
+      windows_moved=1;
    }
    return windows_moved;
 }
@@ -361,6 +1817,7 @@ void ToonSetPosition(Toon *toon, int x, int y)
 {
    toon->x=x;
    toon->y=y;
+   toon->x_sub = toon->y_sub = 0;
    return;
 }
 
@@ -392,7 +1849,10 @@ void ToonSetType(Toon *toon, int type, int direction, int gravity)
    toon->type = type;
    toon->direction = direction;
    toon->frame = 0;
+   toon->frame_sub = 0;
    toon->active = 1;
+   if (toon_installed && toon_installed[type] == TOON_TYPEPENDING)
+      _ToonInstallType(type);
    return;
 }
 
@@ -406,14 +1866,14 @@ void ToonSetVelocity(Toon *toon, int u, int v)
 
 /* CORE FUNCTIONS */
 
-/* Attempt to move a toon based on its velocity */
-/* `mode' can be TOON_MOVE (move unless blocked), TOON_FORCE (move
-   regardless) or TOON_STILL (test the move but don't actually do it) */
-/* Returns TOON_BLOCKED if blocked, TOON_OK if unblocked, or 
-   TOON_PARTIALMOVE if limited movement is possible */
-int ToonAdvance(Toon *toon, int mode)
+/* Move a toon towards newx,newy, as far as the edges of the screen and
+   the windows allow; what ToonAdvance() and ToonAdvanceBy() share. A
+   `coarse' move is simply blocked where it would only partly fit */
+/* Returns as ToonAdvance(), setting *moved if the toon was moved (so
+   never for TOON_STILL) */
+static int _ToonMoveTowards(Toon *toon, int newx, int newy, int mode,
+      int coarse, int *moved)
 {
-   int newx, newy;
    int new_zone;
    unsigned int width, height;
    int move_ahead = 1;
@@ -421,12 +1881,18 @@ int ToonAdvance(Toon *toon, int mode)
 
    if (mode == TOON_STILL) move_ahead = 0;
 
+   /* Along the segment of the graph it is on, nothing can be in the way */
+   if (mode == TOON_MOVE && (newx != toon->x || newy != toon->y)
+         && _ToonAlongGraph(toon, newx, newy)) {
+      toon->x = newx;
+      toon->y = newy;
+      *moved = 1;
+      return TOON_OK;
+   }
+
    width=toon_data[toon->type].width;
    height=toon_data[toon->type].height;
 
-   newx = toon->x + toon->u;
-   newy = toon->y + toon->v;
-
    if (edge_block) {
       if (newx < 0) {
          newx = 0;
@@ -444,14 +1910,22 @@ int ToonAdvance(Toon *toon, int mode)
          newy=display_height-toon_data[toon->type].height;
          result=TOON_PARTIALMOVE;
       }
-      if (newx == toon->x && newy == toon->y) {
+      /* With a time step a toon may well not move a whole pixel; only
+         without one is standing still being blocked */
+      if (newx == toon->x && newy == toon->y
+            && (result == TOON_PARTIALMOVE || time_step == 0.0)) {
          result=TOON_BLOCKED;
       }
    }
 
    /* Is new toon location fully/partially filled with windows? */
    new_zone = XRectInRegion(windows,newx,newy,width,height);
-   if (new_zone != RectangleOut && mode == TOON_MOVE 
+   if (new_zone != RectangleOut && mode == TOON_MOVE
+         && (coarse || (newx == toon->x && newy == toon->y))) {
+      result=TOON_BLOCKED;
+      move_ahead=0;
+   }
+   else if (new_zone != RectangleOut && mode == TOON_MOVE 
          && result != TOON_BLOCKED) {
       int tryx, tryy, step=1, u=newx-toon->x, v=newy-toon->y;
       result=TOON_BLOCKED;
@@ -484,27 +1958,116 @@ int ToonAdvance(Toon *toon, int mode)
          }
       }
    }
+   if (result == TOON_PARTIALMOVE)
+      ToonStatsCount(TOON_STAT_PARTIALMOVES, 1);
    if (move_ahead) {
       toon->x=newx;
       toon->y=newy;
-      if ( (++(toon->frame)) >= toon_data[toon->type].nframes) {
-         toon->frame = 0;
-         if ( (toon_data[toon->type].conf) & TOON_NOCYCLE) 
+   }
+   *moved = move_ahead;
+   return result;
+}
+
+/* Attempt to move a toon based on its velocity */
+/* `mode' can be TOON_MOVE (move unless blocked), TOON_FORCE (move
+   regardless) or TOON_STILL (test the move but don't actually do it) */
+/* With a time step (see ToonSetTimeStep()) the velocity is in
+   1/TOON_SUBPIXELS pixels a second, and the toon keeps the fraction of a
+   pixel it has moved beyond x,y for next time; without one it is in
+   pixels a frame */
+/* A toon below full detail (see ToonDetail()) makes the moves of all
+   the frames since its last update at once, and is simply blocked where
+   it would only partly fit */
+/* Returns TOON_BLOCKED if blocked, TOON_OK if unblocked, or 
+   TOON_PARTIALMOVE if limited movement is possible */
+int ToonAdvance(Toon *toon, int mode)
+{
+   int newx, newy, xsub = 0, ysub = 0, frames = 1, frame_sub = 0;
+   int moved, result;
+   int steps = detail_step[toon->detail];
+
+   if (time_step > 0.0) {
+      xsub = toon->x_sub + (int) lround(toon->u * time_step * steps);
+      ysub = toon->y_sub + (int) lround(toon->v * time_step * steps);
+      newx = toon->x + (xsub >> TOON_SUBPIXELBITS);
+      newy = toon->y + (ysub >> TOON_SUBPIXELBITS);
+      xsub &= TOON_SUBPIXELS-1;
+      ysub &= TOON_SUBPIXELS-1;
+      frames = toon->frame_sub + (int) lround(frame_rate * TOON_SUBPIXELS
+            * time_step * steps);
+      frame_sub = frames & (TOON_SUBPIXELS-1);
+      frames >>= TOON_SUBPIXELBITS;
+   }
+   else {
+      newx = toon->x + toon->u*steps;
+      newy = toon->y + toon->v*steps;
+      frames = steps;
+   }
+
+   result = _ToonMoveTowards(toon, newx, newy, mode, steps > 1, &moved);
+   if (mode != TOON_STILL) {
+      /* Anything that stopped the toon short takes its fractions too */
+      toon->x_sub = result == TOON_OK ? xsub : 0;
+      toon->y_sub = result == TOON_OK ? ysub : 0;
+      if (time_step > 0.0) toon->frame_sub = frame_sub;
+   }
+   if (moved && frames > 0) {
+      if ( (toon->frame += frames) >= toon_data[toon->type].nframes) {
+         if ( (toon_data[toon->type].conf) & TOON_NOCYCLE) {
+            toon->frame = 0;
             toon->active = 0;
+         }
+         else
+            toon->frame %= toon_data[toon->type].nframes;
       }
    }
    return result;
 }
 
+/* Move a toon by so many pixels as ToonAdvance() would if that were its
+   velocity, without moving on its animation or minding the time step:
+   for small steps such as up a ledge */
+/* Returns as ToonAdvance() */
+int ToonAdvanceBy(Toon *toon, int xoffset, int yoffset, int mode)
+{
+   int moved, result;
+   result = _ToonMoveTowards(toon, toon->x + xoffset, toon->y + yoffset,
+         mode, 0, &moved);
+   if (moved && mode != TOON_STILL)
+      toon->x_sub = toon->y_sub = 0;
+   return result;
+}
+
 /* Build up an X-region corresponding to the location of the windows 
    that we don't want our toons to enter */
 /* Returns 0 on success, 1 if windows moved again during the execution
    of this function */
 int ToonLocateWindows() {
+   int status;
+   unsigned long req, rt;
+   /* Rebuild window region */
+   XDestroyRegion(windows);
+   windows = XCreateRegion();
+   XDestroyRegion(covered);
+   covered = XCreateRegion();
+   ToonStatsCount(TOON_STAT_RESCANS, 1);
+   toon_backend->count_requests(&req, &rt);
+   status = toon_backend->locate_windows();
+   _ToonAccount(TOON_CALL_LOCATE, req, rt);
+   /* Nobody sees the gaps between monitors, and they may be walls */
+   XUnionRegion(covered, gaps, covered);
+   if (gap_walls)
+      XUnionRegion(windows, gaps, windows);
+   _ToonGraphUpdate();
+   return status;
+}
+
+/* Xlib backend: query the server for the top-level windows */
+int _ToonXLocateWindows() {
    Window dummy;
    XWindowAttributes attributes;
    int wx;
-   XRectangle *window_rect;
+   XRectangle *window_rect, cover;
    int x, y;
    unsigned int height, width;
    unsigned int oldnwindows;
@@ -512,15 +2075,12 @@ int ToonLocateWindows() {
    XRectangle *rects = NULL;
    int nrects, rectord, irect;
 
-   XSetErrorHandler(_ToonXErrorHandler);
-
-   /* Rebuild window region */
-   XDestroyRegion(windows);
-   windows = XCreateRegion();
+   catch_errors = 1;
 
    /* Get children of root */
    oldnwindows=nwindows;
    XQueryTree(display, root, &dummy, &dummy, &children, &nwindows);
+   xlib_round_trips++;
    if (nwindows>oldnwindows) {
       if (windata) free(windata);
       if ((windata=calloc(nwindows, sizeof(_ToonWindowData))) == NULL) {
@@ -535,10 +2095,24 @@ int ToonLocateWindows() {
 
       windata[wx].wid = children[wx];
       windata[wx].solid = 0;
+      windata[wx].shaped = 0;
 
+      /* GetWindowAttributes and GetGeometry */
       XGetWindowAttributes(display, children[wx], &attributes);
+      xlib_round_trips += 2;
       if (error_value) continue;
 
+      /* Anything mapped hides the root window, even popups and windows
+         that are not solid because they reach the top of the screen */
+      if (attributes.map_state == IsViewable
+            && attributes.class == InputOutput) {
+         cover.x = attributes.x;
+         cover.y = attributes.y;
+         cover.width = attributes.width + 2*attributes.border_width;
+         cover.height = attributes.height + 2*attributes.border_width;
+         XUnionRectWithRegion(&cover, covered, covered);
+      }
+
       /* Popup? */
       if (!solid_popups && attributes.save_under) continue;
 
@@ -569,10 +2143,12 @@ int ToonLocateWindows() {
          else {
             rects = XShapeGetRectangles(display, children[wx], ShapeBounding,
                   &nrects, &rectord);
+            xlib_round_trips++;
             if (nrects <= 1) {
                XUnionRectWithRegion(window_rect, windows, windows);
             }
             else {
+               windata[wx].shaped = 1;
                for (irect=0;irect<nrects;irect++) {
                   rects[irect].x += x;
                   rects[irect].y += y;
@@ -586,7 +2162,7 @@ int ToonLocateWindows() {
       }
    }
    XFree(children);
-   XSetErrorHandler((ErrorHandler *) NULL);
+   catch_errors = 0;
    return 0;
 }
 
@@ -596,25 +2172,232 @@ int ToonSleep(unsigned long usecs) {
    t.tv_usec = usecs%(unsigned long)1000000;
    t.tv_sec = usecs/(unsigned long)1000000;
    select(0, (void *)0, (void *)0, (void *)0, &t);
+   _ToonExitIfAsked();
+   return 0;
+}
+
+/* Wait until the next frame is due, frames being every usecs microseconds.
+   Deadlines are absolute, so the time spent drawing a frame does not add
+   to the period; if we are more than a whole period late the missed frames
+   are skipped rather than run back-to-back */
+/* Returns TOON_FRAMEDUE when it is time for the next frame (or a signal
+   has been caught), TOON_WINDOWEVENT as soon as an event arrives about
+   the windows or the screen (but not the pointer), in which case
+   ToonWindowsMoved() should be called and ToonWaitFrame() again */
+int ToonWaitFrame(unsigned long usecs)
+{
+   double period = usecs*1e3, now = _ToonNow();
+   long skipped;
+
+   if (vsync)
+      return _ToonXWaitBlank(period);
+   if (frame_deadline == 0.0)
+      frame_deadline = now + period;
+   while (now < frame_deadline && toon_signals_seen == toon_signals) {
+      if (toon_backend->wait(frame_deadline - now))
+         return TOON_WINDOWEVENT;
+      now = _ToonNow();
+   }
+   if (period > 0.0) {
+      skipped = (long) ((now - frame_deadline)/period);
+      if (skipped > 0)
+         ToonStatsCount(TOON_STAT_SKIPPED, skipped);
+      frame_deadline += (skipped+1)*period;
+   }
+   else {
+      frame_deadline = now;
+   }
+   return TOON_FRAMEDUE;
+}
+
+/* Xlib backend: the vertical blank numbered msc happened at ust (ns), as
+   asked for by ToonWaitFrame() with the given serial number */
+void _ToonXBlank(unsigned int serial, unsigned long long msc, double ust)
+{
+   double blank;
+   if (present_msc && msc > present_msc)
+      present_interval = (ust - present_ust)/(msc - present_msc);
+   /* How long the last frame drawn took to be seen: until the first
+      blank after it was flushed */
+   if (present_flushed > 0.0 && present_flushed <= ust) {
+      blank = ust;
+      if (present_interval > 0.0)
+         blank -= present_interval
+               * (long) ((ust - present_flushed)/present_interval);
+      _ToonStatsSample(TOON_PHASE_PRESENT, blank - present_flushed);
+      present_flushed = 0.0;
+   }
+   present_msc = msc;
+   present_ust = ust;
+   if (present_pending && serial == present_serial) {
+      present_pending = 0;
+      present_arrived = 1;
+      if (msc > present_target) {
+         /* Too late for the blank we wanted: count those missed */
+         ToonStatsCount(TOON_STAT_SKIPPED,
+               (msc - present_target + present_blanks - 1)/present_blanks);
+      }
+   }
+   return;
+}
+
+/* Xlib backend: start the next frame on a vertical blank, the first that
+   is at least `period' ns after the last, and drop any that are missed */
+/* Returns as ToonWaitFrame() */
+int _ToonXWaitBlank(double period)
+{
+   double now;
+
+   if (!present_pending && !present_arrived) {
+      present_blanks = 1;
+      if (present_interval > 0.0 && period > present_interval)
+         present_blanks = (unsigned long long) (period/present_interval + 0.5);
+      /* A target already past is answered at once, so a late frame
+         starts straight away rather than waiting for a whole period */
+      present_target = present_msc + present_blanks;
+#ifdef HAVE_XPRESENT
+      XPresentNotifyMSC(display, root, ++present_serial, present_target, 0, 0);
+#endif
+      present_pending = 1;
+      present_deadline = _ToonNow() + period + TOON_MAXPAUSE/10;
+   }
+   /* The blank is taken off the queue while waiting, or by
+      ToonWindowsMoved() if it was behind some other event; should it
+      never come, fall back on the clock */
+   while (toon_signals_seen == toon_signals) {
+      if (present_arrived) {
+         present_arrived = 0;
+         return TOON_FRAMEDUE;
+      }
+      now = _ToonNow();
+      if (now >= present_deadline) {
+         present_pending = 0;
+         return TOON_FRAMEDUE;
+      }
+      if (toon_backend->wait(present_deadline - now))
+         return TOON_WINDOWEVENT;
+   }
+   return TOON_FRAMEDUE;
+}
+
+/* Wait up to usecs microseconds for X events to arrive, for when there is
+   nothing worth drawing until the windows change */
+/* Returns TOON_WINDOWEVENT, or TOON_FRAMEDUE if the time ran out or a
+   signal was caught */
+int ToonWaitEvent(unsigned long usecs)
+{
+   double now = _ToonNow(), end = now + usecs*1e3;
+   /* frames start afresh afterwards rather than counting as skipped */
+   frame_deadline = 0.0;
+   while (now < end && toon_signals_seen == toon_signals) {
+      if (toon_backend->wait(end - now < TOON_MAXPAUSE ? end - now
+            : TOON_MAXPAUSE))
+         return TOON_WINDOWEVENT;
+      now = _ToonNow();
+   }
+   return TOON_FRAMEDUE;
+}
+
+/* Xlib backend: take the events the main loop need not hear of off the
+   front of the queue, dealing with them as they go */
+/* Returns 1 if an event it must hear of is left at the front, else 0 */
+int _ToonXDrainQuiet()
+{
+   XEvent event;
+   while (XEventsQueued(display, QueuedAlready)) {
+      XPeekEvent(display, &event);
+      if (_ToonXWakes(&event))
+         return 1;
+      XNextEvent(display, &event);
+      _ToonXQuietEvent(&event);
+   }
+   return 0;
+}
+
+/* Xlib backend: sleep on the connection so that events wake us up; those
+   of the pointer and the blanks are dealt with here, and may cut the
+   sleep short without waking anybody */
+int _ToonXWait(double timeout)
+{
+   fd_set fds;
+   struct timeval t;
+   int fd = ConnectionNumber(display);
+
+   if (XEventsQueued(display, QueuedAfterFlush) && _ToonXDrainQuiet())
+      return 1;
+   FD_ZERO(&fds);
+   FD_SET(fd, &fds);
+   t.tv_sec = (long) (timeout/1e9);
+   t.tv_usec = (long) ((timeout - t.tv_sec*1e9)/1e3);
+   if (select(fd+1, &fds, NULL, NULL, &t) > 0
+         && XEventsQueued(display, QueuedAfterReading))
+      return _ToonXDrainQuiet();
    return 0;
 }
 
 
 /* FINISHING UP */
 
-/* Close link to X server and free client-side window information */
+/* Clear whatever toons and particles were drawn last, close link to X
+   server and free client-side window information */
 int ToonCloseDisplay()
 {
+   int i;
+   _ToonParticlesClose();
+   for (i=0; i<ntoons_drawn; i++)
+      toon_backend->erase(toons_drawn[i].x, toons_drawn[i].y,
+            toons_drawn[i].width, toons_drawn[i].height);
+   if (toons_drawn) free(toons_drawn);
+   toons_drawn = NULL;
+   ntoons_drawn = toons_drawn_size = 0;
+   vsync = present_pending = present_arrived = 0;
+   present_opcode = -1;
+   pointer_known = 0;
+   xinput_opcode = -1;
+#ifdef HAVE_XINPUT2
+   if (pointer_devices) free(pointer_devices);
+   pointer_devices = NULL;
+   npointer_devices = 0;
+#endif
+   present_msc = 0;
+   present_interval = present_flushed = 0.0;
+   if (grid_start) free(grid_start);
+   if (grid_entries) free(grid_entries);
+   grid_start = grid_entries = NULL;
+   grid_toon = NULL;
+   grid_ncells_size = grid_entries_size = 0;
    XDestroyRegion(windows);
-   XClearWindow(display,root);
-   XCloseDisplay(display);
+   XDestroyRegion(covered);
+   XDestroyRegion(gaps);
+   XDestroyRegion(exposed);
+   windows = covered = gaps = exposed = NULL;
+   _ToonReleaseData();
+   toon_backend->close_display();
+   if (monitors) free(monitors);
+   monitors = NULL;
+   nmonitors = 0;
    if (windata) {
       free(windata);
       windata=NULL;
    }
+   nwindows=0;
    return 0;
 }
 
+/* Xlib backend: close display; only the toons need clearing, and
+   ToonCloseDisplay() has done that */
+void _ToonXCloseDisplay()
+{
+   _ToonXShareRelease();
+   XCloseDisplay(display);
+   xlib_holder = None;
+   display = NULL;
+   if (xlib_shared) free(xlib_shared);
+   xlib_shared = NULL;
+   xlib_nshared = 0;
+   return;
+}
+
 /* Clear root window, close display and exit  */
 void _ToonExitGracefully(int sig)
 {
@@ -623,6 +2406,17 @@ void _ToonExitGracefully(int sig)
    exit(0);
 }
 
+/* After a signal caught with TOON_EXITGRACEFULLY, clear this thread's
+   display and close it, and end the thread; the program ends with the
+   last of them */
+void _ToonExitIfAsked()
+{
+   if (!toon_exit) return;
+   ToonConfigure(TOON_NOCATCHSIGNALS);
+   ToonCloseDisplay();
+   pthread_exit(NULL);
+}
+
 
 /* HANDLING TOON ASSOCIATIONS WITH MOVING WINDOWS */
 
@@ -643,6 +2437,25 @@ void ToonSetMaximumRelocate(int up, int down, int left, int right) {
    return;
 }
 
+/* Give velocities in 1/TOON_SUBPIXELS pixels a second rather than pixels
+   a frame, for frames `seconds' long, and animate the toons at
+   `frames_per_second' whatever the frame rate; a step of 0 (the default)
+   goes back to pixels a frame and an animation frame every frame */
+void ToonSetTimeStep(double seconds, double frames_per_second) {
+   time_step = seconds > 0.0 ? seconds : 0.0;
+   frame_rate = frames_per_second;
+   return;
+}
+
+/* How many frames go by between updates of the toons that are hidden
+   behind windows, and of those well off the screen; 1 (the default)
+   keeps them at full detail */
+void ToonSetDetail(int hidden_step, int offscreen_step) {
+   detail_step[TOON_DETAILHIDDEN] = hidden_step > 1 ? hidden_step : 1;
+   detail_step[TOON_DETAILOFFSCREEN] = offscreen_step > 1 ? offscreen_step : 1;
+   return;
+}
+
 /* The first thing to be done when the windows move is to work out 
    which windows the associated toons were associated with just before
    the windows moved */
@@ -722,6 +2535,7 @@ int ToonRelocateAssociated(Toon *toon, int n)
                   if (!ToonOffsetBlocked(toon+i, dx, dy)) {
                      toon[i].x += dx;
                      toon[i].y += dy;
+                     ToonStatsCount(TOON_STAT_RELOCATIONS, 1);
                   }
                }
                break;
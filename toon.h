@@ -16,6 +16,9 @@
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#ifndef _TOON_H_
+#define _TOON_H_
+
 #include <X11/Intrinsic.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -34,6 +37,23 @@
 #define TOON_MOVE 0
 #define TOON_STILL -1
 
+/* Levels of detail, from ToonDetail() */
+#define TOON_DETAILFULL 0 /* can be seen, or could be by its next update */
+#define TOON_DETAILHIDDEN 1 /* on the screen but behind windows */
+#define TOON_DETAILOFFSCREEN 2 /* nowhere near the screen */
+#define TOON_DETAILS 3
+#define TOON_DETAILMARGIN 16 /* pixels, beyond a coarse update's move */
+
+/* How ToonSetScale() enlarges the images */
+#define TOON_SCALENEAREST 0 /* by a whole number, repeating pixels */
+#define TOON_SCALEFILTERED 1 /* by any amount, interpolating */
+#define TOON_SCALEAUTO 0.0 /* to suit the display's resolution */
+#define TOON_DPI 96 /* the resolution the images were drawn for */
+
+/* Fixed-point positions and velocities, with ToonSetTimeStep() */
+#define TOON_SUBPIXELBITS 8
+#define TOON_SUBPIXELS (1<<TOON_SUBPIXELBITS)
+
 #define TOON_OK 1
 #define TOON_PARTIALMOVE 0
 #define TOON_BLOCKED -1
@@ -50,10 +70,70 @@
 
 #define TOON_NOCYCLE (1L<<8)
 
+#define TOON_NOSHAREDPIXMAPS (1L<<10)
+#define TOON_SHAREDPIXMAPS (1L<<11)
+
+/* Are the parts of the screen between monitors walls (the default), or
+ * voids that toons can fall into? */
+#define TOON_GAPWALLS (1L<<12)
+#define TOON_GAPVOIDS (1L<<13)
+
+/* Start frames on vertical blanks, with the Present extension */
+#define TOON_VSYNC (1L<<14)
+#define TOON_NOVSYNC (1L<<15)
+
 #define TOON_NOCATCHSIGNALS (1L<<16)
 #define TOON_CATCHSIGNALS (1L<<17)
 #define TOON_EXITGRACEFULLY (1L<<18)
 
+/* Phases of the main loop timed by ToonStatsBegin/End() */
+#define TOON_PHASE_RESCAN 0
+#define TOON_PHASE_BEHAVIOUR 1
+#define TOON_PHASE_ERASE 2
+#define TOON_PHASE_DRAW 3
+#define TOON_PHASE_FLUSH 4
+#define TOON_PHASE_FRAME 5
+#define TOON_PHASE_PRESENT 6 /* from flush to the blank that shows it */
+#define TOON_PHASES 7
+
+/* Counters kept by ToonStatsCount() */
+#define TOON_STAT_FRAMES 0
+#define TOON_STAT_RESCANS 1
+#define TOON_STAT_RELOCATIONS 2
+#define TOON_STAT_PARTIALMOVES 3
+#define TOON_STAT_EXPLOSIONS 4
+#define TOON_STAT_SKIPPED 5
+#define TOON_STAT_DROPPED 6
+#define TOON_COUNTERS 7
+
+/* Calls whose X requests and round trips are accounted separately */
+#define TOON_CALL_INSTALL 0
+#define TOON_CALL_LOCATE 1
+#define TOON_CALL_EVENTS 2
+#define TOON_CALL_ERASE 3
+#define TOON_CALL_DRAW 4
+#define TOON_CALL_FLUSH 5
+#define TOON_CALLS 6
+
+/* Return values of ToonControlPoll() */
+#define TOON_CONTROL_NONE 0
+#define TOON_CONTROL_COMMAND 1
+#define TOON_CONTROL_CHANGED 2
+
+/* Return values of ToonWaitFrame() */
+#define TOON_FRAMEDUE 0
+#define TOON_WINDOWEVENT 1
+
+/* Formats of ToonNullWriteFrame() */
+#define TOON_FRAME_PPM 0
+#define TOON_FRAME_Y4M 1
+
+/* Links between the segments of ToonSegments() */
+#define TOON_LINKNONE 0
+#define TOON_LINKSTEP 1 /* walk on to a surface up or down a little */
+#define TOON_LINKCLIMB 2 /* between a surface and a wall */
+#define TOON_DEFAULTSTEP 8 /* pixels, see ToonSetStepHeight() */
+
 #define TOON_MESSAGE_LENGTH 64
 #define TOON_DEFAULTMAXRELOCATE 8
 
@@ -69,20 +149,88 @@ typedef struct {
       conf; /* bitmask of toon properties such as cycling etc. */
    Pixmap
       pixmap, mask; /* pointers to X structures */
+   Pixel
+      *colors; /* colours allocated for the pixmap, to be freed with it */
+   int
+      ncolors;
+   /* Filled in by ToonLoadTheme() in place of `image': premultiplied
+      0xAARRGGBB pixels and an XBM-style mask of the whole image */
+   unsigned int
+      *pixels;
+   unsigned char
+      *mask_bits;
+   int
+      image_width, image_height;
+   unsigned short
+      *spans; /* opaque runs of each row, as made by spritec */
 } ToonData;
 
+/* An image compiled by spritec, matched to a ToonData by its XPM array */
+typedef struct {
+   char **image;
+   unsigned int *pixels;
+   unsigned char *mask_bits;
+   unsigned short *spans;
+   int image_width, image_height;
+} ToonRawImage;
+
 
 typedef struct {
    int
       x,y,u,v, /* new position and velocity */
       active,type,frame,direction,
       x_map,y_map,width_map,height_map,
+      type_map,frame_map,direction_map,
             /* properties of the image mapped on the screen */
       associate, /* toon is associated with a window */
       xoffset, yoffset; /* location relative to window origin */
    unsigned int wid; /* window associated with */   
+   int monitor; /* as found by ToonPartition(), -1 if between monitors */
+   int detail, /* level of detail, as found by ToonDetail() */
+      detail_wait; /* frames until the next update at that level */
+   int x_sub, y_sub, frame_sub; /* fractions of a pixel and of a frame
+      beyond x, y and frame, in 1/TOON_SUBPIXELS */
+   int segment; /* as last found by ToonOnGraph()... */
+   unsigned int segment_graph; /* ...and in which graph */
 } Toon;
 
+/* A stretch that toons can walk along or climb, from ToonSegments(): a
+ * surface to stand on (wall TOON_DOWN) from x to x+length at height y,
+ * or a wall to climb on the toon's TOON_LEFT or TOON_RIGHT from y to
+ * y+length at x. A toon of any type can be anywhere along it without
+ * touching a window */
+typedef struct {
+   int x, y, length;
+   int wall;
+   unsigned int wid; /* window it belongs to, 0 for the screen's edges */
+   int link[2], next[2]; /* the kind of link at the left or top end and
+      the right or bottom end, and the segment each leads to */
+} ToonSegment;
+
+/* A display backend: every call that touches the display goes through
+ * one of these, so the simulation can run without an X server */
+typedef struct {
+   char *name;
+   int (*open_display)(char *display_name);
+   /* send the image of data[type], one of n, to the display */
+   int (*install_data)(ToonData *data, int n, int type);
+   void (*free_data)(ToonData *data, int n, int type);
+   void (*draw)(Toon *toon);
+   void (*erase)(int x, int y, int width, int height);
+   /* fill n rectangles in one colour, given as 0xRRGGBB */
+   void (*fill)(XRectangle *rects, int n, unsigned int colour);
+   /* draw a toon again where it already is, between frames */
+   void (*repair)(Toon *toon);
+   void (*flush)();
+   int (*locate_windows)();
+   int (*windows_moved)();
+   void (*close_display)();
+   /* running totals of requests issued and round trips waited for */
+   void (*count_requests)(unsigned long *requests, unsigned long *round_trips);
+   /* wait up to timeout nanoseconds, returning 1 early if events arrive */
+   int (*wait)(double timeout);
+} ToonBackend;
+
 /*** FUNCTION PROTOTYPES ***/
 
 /* SIGNAL AND ERROR HANDLING FUNCTIONS */
@@ -90,21 +238,46 @@ int ToonSignal();
 char *ToonErrorMessage();
 
 /* STARTUP FUNCTIONS */
-Display *ToonOpenDisplay(char *display_name);
+int ToonSetBackend(char *name);
+int ToonOpenDisplay(char *display_name);
+int ToonScreenNames(char *display_name, char ***names);
 int ToonConfigure(unsigned long int code);
+void ToonSetDetail(int hidden_step, int offscreen_step);
+void ToonSetTimeStep(double seconds, double frames_per_second);
+void ToonSetScale(double scale, int filter);
+void ToonSetStepHeight(int pixels);
 int ToonInstallData(ToonData *toon_data, int n);
+ToonData *ToonLoadTheme(char *dir, int *ntypes);
+void ToonUseRaw(ToonData *data, int n, ToonRawImage *raw);
+void ToonFreeTheme(ToonData *data);
 
 /* DRAWING FUNCTIONS */
 int ToonDraw(Toon *toon,int n);
 int ToonErase(Toon *toon,int n);
+int ToonRepair(Toon *toon, int n);
 void ToonFlush();
 
 /* QUERY FUNCTIONS */
 int ToonDisplayWidth();
 int ToonDisplayHeight();
+double ToonScale();
 int ToonBlocked(Toon *toon, int direction);
 int ToonOffsetBlocked(Toon *toon, int xoffset, int yoffset);
 int ToonWindowsMoved();
+int ToonVisible(Toon *toon);
+int ToonChanged(Toon *toon);
+int ToonScreenCovered();
+int ToonMonitors();
+int ToonMonitorGeometry(int monitor, int *x, int *y, int *width, int *height);
+int ToonPartition(Toon *toon, int n);
+int ToonDetail(Toon *toon, int n);
+int ToonDue(Toon *toon);
+int ToonIndexNeighbours(Toon *toon, int n);
+int ToonNeighbours(Toon *toon, int distance, int *near, int max);
+int ToonPointer(int *x, int *y, unsigned int *buttons);
+int ToonNearPointer(int distance, int *near, int max);
+int ToonSegments(ToonSegment **segments);
+int ToonOnGraph(Toon *toon);
 
 /* ASSIGNMENT FUNCTIONS */
 void ToonMove(Toon *toon, int xoffset, int yoffset);
@@ -114,8 +287,12 @@ void ToonSetVelocity(Toon *toon, int u, int v);
 
 /* CORE FUNCTIONS */
 int ToonAdvance(Toon *toon, int mode);
+int ToonAdvanceBy(Toon *toon, int xoffset, int yoffset, int mode);
+int ToonTakeStep(Toon *toon, int direction);
 int ToonLocateWindows();
 int ToonSleep(unsigned long usecs);
+int ToonWaitFrame(unsigned long usecs);
+int ToonWaitEvent(unsigned long usecs);
 
 /* FINISHING UP */
 int ToonCloseDisplay();
@@ -126,3 +303,46 @@ void ToonSetMaximumRelocate(int up, int down, int left, int right);
 int ToonRelocateAssociated(Toon *toon, int n);
 int ToonCalculateAssociations(Toon *toon, int n);
 
+/* PARTICLES */
+void ToonSetParticleGravity(int gravity);
+int ToonBurst(int x, int y, int n, int speed, int life, unsigned int colour);
+int ToonAdvanceParticles();
+int ToonParticles();
+int ToonDrawParticles();
+int ToonEraseParticles();
+
+/* STATISTICS */
+int ToonStatsOpen(char *file, char *socket_path);
+void ToonStatsBegin(int phase);
+void ToonStatsEnd(int phase);
+void ToonStatsCount(int counter, long n);
+void ToonStatsFrame();
+void ToonStatsPoll();
+void ToonStatsDump(FILE *f);
+void ToonRequestCounts(int call, long *requests, long *round_trips);
+void ToonStatsClose();
+
+/* LIVE RECONFIGURATION */
+int ToonControlOpen(char *socket_path);
+int ToonControlWatch(char *path);
+void ToonControlUnwatch(int watch);
+int ToonControlPoll(char *line, int n, int *watch);
+void ToonControlReply(char *text);
+void ToonControlClose();
+
+/* WARM RESTARTS */
+int ToonSnapshotSave(char *file, Toon *toon, int n, void *state, size_t size);
+Toon *ToonSnapshotLoad(char *file, int *n, void **state, size_t *size);
+
+/* HEADLESS BACKEND */
+void ToonNullLayout(int width, int height, int nwindows, int shaped,
+      unsigned int seed);
+void ToonNullMoveWindows(int n);
+void ToonNullMonitors(XRectangle *rects, int n);
+unsigned int *ToonNullFramebuffer();
+int ToonNullWriteFrame(FILE *f, int format, unsigned long frame_usec);
+int ToonNullReadLayout(char *file);
+int ToonNullSaveLayout(char *file);
+void ToonNullPointer(int x, int y, unsigned int buttons);
+
+#endif
@@ -0,0 +1,139 @@
+/* toonP.h - private declarations shared between toon.c and its backends
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "toon.h"
+
+/*** STRUCTURES ***/
+
+typedef struct {
+   int solid;
+   int shaped; /* not just a rectangle, as far as is known */
+   unsigned int wid;
+   XRectangle pos;
+} _ToonWindowData;
+
+/* A decoded image: one 0xAARRGGBB word per pixel, alpha is 0 or 255 */
+typedef struct {
+   int width, height;
+   unsigned int *pixels;
+   int shared; /* pixels belong to somebody else, don't free them */
+} _ToonImage;
+
+/* Cells of a coarse grid over the screen that have been drawn in, for
+   _ToonCellsRuns() to turn into a few rectangles to clear */
+#define TOON_CELL 32
+typedef struct {
+   unsigned char *marks;
+   int columns, rows;
+   int top, bottom; /* the rows that may have marks */
+   XRectangle *runs;
+   int runs_size;
+} _ToonCells;
+
+/*** STATE SHARED WITH THE BACKENDS ***/
+
+/* Everything that belongs to one display connection is thread-local, so a
+   program can drive several displays by opening each from a thread of
+   its own. Only signals and the loaded themes are seen by every thread */
+#define TOON_LOCAL __thread
+
+extern TOON_LOCAL Display *display;
+extern TOON_LOCAL int screen;
+extern TOON_LOCAL Window root;
+extern TOON_LOCAL int display_width, display_height;
+extern TOON_LOCAL Region windows;
+extern TOON_LOCAL Region covered;
+extern TOON_LOCAL unsigned int nwindows;
+extern TOON_LOCAL _ToonWindowData *windata;
+extern TOON_LOCAL ToonData *toon_data;
+extern TOON_LOCAL int toon_ntypes;
+extern TOON_LOCAL char shaped_windows;
+extern TOON_LOCAL char solid_popups;
+extern TOON_LOCAL char toon_error_message[];
+extern TOON_LOCAL ToonBackend *toon_backend;
+extern TOON_LOCAL XRectangle *monitors;
+extern TOON_LOCAL int nmonitors;
+extern TOON_LOCAL char edge_block;
+extern TOON_LOCAL double time_step, frame_rate;
+extern TOON_LOCAL char pointer_known;
+extern TOON_LOCAL double pointer_x, pointer_y;
+extern TOON_LOCAL unsigned int pointer_buttons;
+
+/*** INTERNAL FUNCTION PROTOTYPES ***/
+
+void _ToonExitGracefully(int sig);
+void _ToonReleaseData();
+int _ToonSetMonitors(XRectangle *rects, int n);
+void _ToonAccount(int call, unsigned long requests, unsigned long round_trips);
+
+/* The Xlib backend, in toon.c, for others to build on */
+int _ToonXOpenDisplay(char *display_name);
+void _ToonXLocateMonitors();
+int _ToonXInstallData(ToonData *data, int n, int type);
+void _ToonXFreeData(ToonData *data, int n, int type);
+void _ToonXShareRelease();
+void _ToonXDraw(Toon *t);
+void _ToonXErase(int x, int y, int width, int height);
+void _ToonXFill(XRectangle *rects, int n, unsigned int colour);
+unsigned long _ToonXPixel(Display *d, unsigned int colour);
+void _ToonXFlush();
+int _ToonXLocateWindows();
+int _ToonXWindowsMoved();
+int _ToonXWakes(XEvent *event);
+void _ToonXQuietEvent(XEvent *event);
+int _ToonXDrainQuiet();
+void _ToonXCloseDisplay();
+void _ToonXCountRequests(unsigned long *requests, unsigned long *round_trips);
+int _ToonXWait(double timeout);
+void _ToonXBlank(unsigned int serial, unsigned long long msc, double ust);
+int _ToonXWaitBlank(double period);
+
+/* toon_stats.c */
+double _ToonNow();
+void _ToonStatsRequests(int call, long requests, long round_trips);
+void _ToonStatsSample(int phase, double ns);
+
+/* toon_theme.c */
+#define TOON_HASHINIT 0xcbf29ce484222325ULL
+unsigned long long _ToonHash(unsigned long long hash, void *p, size_t n);
+char *_ToonReadFile(char *path);
+int _ToonSplitXpm(char *text, char ***strings, char *name, int n);
+void _ToonPremultiply(_ToonImage *image, unsigned char *mask_bits);
+
+/* toon_scale.c */
+extern TOON_LOCAL double toon_scale;
+extern TOON_LOCAL int scale_filter;
+double _ToonScaleFor();
+ToonData *_ToonScaleData(ToonData *data, int n, double scale, int filter);
+void _ToonScaleForget(ToonData *data);
+
+/* toon_graph.c */
+void _ToonGraphUpdate();
+void _ToonGraphForget();
+int _ToonAlongGraph(Toon *toon, int x, int y);
+
+/* toon_particle.c */
+void _ToonCellsMark(_ToonCells *cells, int x, int y, int width, int height);
+int _ToonCellsRuns(_ToonCells *cells);
+void _ToonCellsFree(_ToonCells *cells);
+void _ToonParticlesClose();
+
+/* toon_image.c */
+int _ToonDecodeXpm(char **xpm, _ToonImage *image);
+void _ToonFreeImage(_ToonImage *image);
+int _ToonMakeSpans(_ToonImage *image, unsigned short **spans);
@@ -0,0 +1,475 @@
+/* toon_async.c - Xlib backend that draws from a separate render thread
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Window tracking stays on the main connection, as in the Xlib backend,
+ * but drawing is done by a thread with a display connection of its own,
+ * so the simulation never blocks on a slow X server.
+ *
+ * ToonDraw() only notes each toon's position, type, frame and direction
+ * in a draw list, and ToonFlush() publishes the list into a ring with one
+ * producer (the simulation) and one consumer (the render thread). The
+ * ring is lock-free: each side only ever writes its own counter. A draw
+ * list is the complete picture, so the render thread erases what it drew
+ * last itself and can jump straight to the newest list, dropping any it
+ * has fallen behind on. Each display has a ring and render thread of its
+ * own, so the ring lives in a structure that the render thread is handed
+ * when it starts. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+#include "toonP.h"
+
+#define ASYNC_RINGSIZE 4 /* frames the render thread may fall behind by */
+#define ASYNC_RETRY 1e6 /* ns between attempts to publish into a full ring */
+#define ASYNC_FILL 255 /* the type of a filled rectangle */
+
+typedef struct {
+   short x, y;
+   unsigned char type, frame, direction; /* for ASYNC_FILL, frame and
+      direction are the width and height... */
+   unsigned int colour; /* ...and this the colour */
+   unsigned short width, height; /* of a frame of the image... */
+   Pixmap pixmap, mask; /* ...as it was when the item was drawn */
+} _ToonDrawItem;
+
+typedef struct {
+   _ToonDrawItem *items;
+   int nitems, size;
+} _ToonDrawList;
+
+typedef struct {
+   /* Shared between the two threads */
+   _ToonDrawList ring[ASYNC_RINGSIZE];
+   atomic_ulong write; /* lists published, written by simulation */
+   atomic_ulong read; /* lists consumed, written by render thread */
+   atomic_ulong requests, dropped;
+   atomic_int quit;
+   atomic_ulong sync_wanted; /* XSync()s asked for by simulation... */
+   atomic_ulong synced; /* ...and made by the render thread */
+   sem_t wakeup;
+
+   /* Render thread side */
+   Display *display;
+   GC gc;
+   Window root;
+   GC fill_gc;
+   XRectangle *drawn;
+   int ndrawn, drawn_size;
+   XRectangle *fills; /* the run of rectangles being filled */
+   int fills_size;
+   _ToonCells filled; /* where they went, to be cleared */
+} _ToonAsync;
+
+/* Simulation side, one of each per display */
+TOON_LOCAL _ToonAsync *async = NULL;
+TOON_LOCAL _ToonDrawList async_staging = { NULL, 0, 0 };
+TOON_LOCAL int async_complete = 0; /* staging holds a whole frame */
+TOON_LOCAL int async_pending = 0; /* ...which has not been published yet */
+TOON_LOCAL unsigned long async_dropped_seen = 0;
+TOON_LOCAL int async_running = 0;
+TOON_LOCAL pthread_t async_thread;
+
+/* INTERNAL FUNCTION PROTOTYPES */
+int _ToonAsyncOpenDisplay(char *display_name);
+int _ToonAsyncInstallData(ToonData *data, int n, int type);
+void _ToonAsyncFreeData(ToonData *data, int n, int type);
+void _ToonAsyncDraw(Toon *t);
+void _ToonAsyncErase(int x, int y, int width, int height);
+void _ToonAsyncFill(XRectangle *rects, int n, unsigned int colour);
+void _ToonAsyncRepair(Toon *t);
+void _ToonAsyncFlush();
+void _ToonAsyncCloseDisplay();
+void _ToonAsyncCountRequests(unsigned long *requests,
+      unsigned long *round_trips);
+int _ToonAsyncWait(double timeout);
+
+ToonBackend toon_async_backend = {
+   "async",
+   _ToonAsyncOpenDisplay,
+   _ToonAsyncInstallData,
+   _ToonAsyncFreeData,
+   _ToonAsyncDraw,
+   _ToonAsyncErase,
+   _ToonAsyncFill,
+   _ToonAsyncRepair,
+   _ToonAsyncFlush,
+   _ToonXLocateWindows,
+   _ToonXWindowsMoved,
+   _ToonAsyncCloseDisplay,
+   _ToonAsyncCountRequests,
+   _ToonAsyncWait
+};
+
+/* Make room for n items in a draw list */
+void _ToonAsyncReserve(_ToonDrawList *list, int n)
+{
+   if (n <= list->size) return;
+   list->size = n > 2*list->size ? n : 2*list->size;
+   if ((list->items = realloc(list->items, list->size*sizeof(_ToonDrawItem)))
+         == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      _ToonExitGracefully(1);
+   }
+   return;
+}
+
+/* RENDER THREAD */
+
+/* Fill a run of filled rectangles of the same colour with one request,
+   noting the cells they cover to be cleared next time */
+/* Returns the number of items taken */
+int _ToonAsyncPaintFills(_ToonAsync *a, _ToonDrawItem *item, int n)
+{
+   int i;
+   XRectangle *r;
+
+   for (i=0; i<n && item[i].type == ASYNC_FILL
+         && item[i].colour == item->colour; i++);
+   if (i > a->fills_size) {
+      a->fills_size = i;
+      if ((a->fills = realloc(a->fills, a->fills_size*sizeof(XRectangle)))
+            == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         exit(1);
+      }
+   }
+   for (n=0, r=a->fills; n<i; n++, r++) {
+      r->x = item[n].x;
+      r->y = item[n].y;
+      r->width = item[n].frame;
+      r->height = item[n].direction;
+      _ToonCellsMark(&a->filled, r->x, r->y, r->width, r->height);
+   }
+   XSetForeground(a->display, a->fill_gc, _ToonXPixel(a->display,
+         item->colour));
+   XFillRectangles(a->display, a->root, a->fill_gc, a->fills, i);
+   return i;
+}
+
+/* Replace what is on the screen with the contents of a draw list */
+void _ToonAsyncPaint(_ToonAsync *a, _ToonDrawList *list)
+{
+   int i, n, width, height;
+   _ToonDrawItem *item;
+   XRectangle *r;
+
+   for (i=0; i<a->ndrawn; i++)
+      XClearArea(a->display, a->root, a->drawn[i].x, a->drawn[i].y,
+            a->drawn[i].width, a->drawn[i].height, False);
+   /* Filled rectangles are cleared by the cells they were in, there can
+      be thousands of them */
+   n = _ToonCellsRuns(&a->filled);
+   for (i=0, r=a->filled.runs; i<n; i++, r++)
+      XClearArea(a->display, a->root, r->x, r->y, r->width, r->height,
+            False);
+
+   if (list->nitems > a->drawn_size) {
+      a->drawn_size = list->nitems;
+      if ((a->drawn = realloc(a->drawn, a->drawn_size*sizeof(XRectangle)))
+            == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         exit(1);
+      }
+   }
+   a->ndrawn = 0;
+   for (i=0; i<list->nitems; ) {
+      item = list->items+i;
+      if (item->type == ASYNC_FILL) {
+         i += _ToonAsyncPaintFills(a, item, list->nitems-i);
+         continue;
+      }
+      width = item->width;
+      height = item->height;
+      XSetClipOrigin(a->display, a->gc,
+            item->x-width*item->frame, item->y-height*item->direction);
+      XSetClipMask(a->display, a->gc, item->mask);
+      XCopyArea(a->display, item->pixmap, a->root, a->gc,
+            width*item->frame, height*item->direction, width, height,
+            item->x, item->y);
+      a->drawn[a->ndrawn].x = item->x;
+      a->drawn[a->ndrawn].y = item->y;
+      a->drawn[a->ndrawn].width = width;
+      a->drawn[a->ndrawn].height = height;
+      a->ndrawn++;
+      i++;
+   }
+   XSetClipMask(a->display, a->gc, None);
+   XFlush(a->display);
+   atomic_store(&a->requests, NextRequest(a->display) - 1);
+   return;
+}
+
+void *_ToonAsyncRender(void *arg)
+{
+   _ToonAsync *a = arg;
+   unsigned long r, w, sync;
+   for (;;) {
+      sem_wait(&a->wakeup);
+      /* A sync is asked for after the last list it must cover has been
+         published, so that list is seen here too */
+      sync = atomic_load(&a->sync_wanted);
+      w = atomic_load_explicit(&a->write, memory_order_acquire);
+      r = atomic_load_explicit(&a->read, memory_order_relaxed);
+      if (w != r) {
+         /* Only the newest list matters */
+         if (w - r > 1)
+            atomic_fetch_add(&a->dropped, w - r - 1);
+         _ToonAsyncPaint(a, a->ring + (w-1) % ASYNC_RINGSIZE);
+         atomic_store_explicit(&a->read, w, memory_order_release);
+      }
+      if (sync != atomic_load_explicit(&a->synced, memory_order_relaxed)) {
+         XSync(a->display, False);
+         atomic_store(&a->synced, sync);
+      }
+      if (w == r && atomic_load(&a->quit))
+         break;
+   }
+   return NULL;
+}
+
+/* SIMULATION SIDE */
+
+/* Try to hand the staged frame to the render thread */
+/* Returns 1 if published, 0 if the ring is full */
+int _ToonAsyncPublish()
+{
+   _ToonDrawList *slot;
+   unsigned long w = atomic_load_explicit(&async->write, memory_order_relaxed);
+   unsigned long r = atomic_load_explicit(&async->read, memory_order_acquire);
+
+   if (w - r >= ASYNC_RINGSIZE)
+      return 0;
+   slot = async->ring + w % ASYNC_RINGSIZE;
+   _ToonAsyncReserve(slot, async_staging.nitems);
+   memcpy(slot->items, async_staging.items,
+         async_staging.nitems*sizeof(_ToonDrawItem));
+   slot->nitems = async_staging.nitems;
+   atomic_store_explicit(&async->write, w+1, memory_order_release);
+   sem_post(&async->wakeup);
+   async_pending = 0;
+   return 1;
+}
+
+/* ToonErase() or ToonDraw() after a flush starts a new frame */
+void _ToonAsyncStartFrame()
+{
+   if (async_complete) {
+      async_staging.nitems = 0;
+      async_complete = 0;
+      async_pending = 0;
+   }
+   return;
+}
+
+int _ToonAsyncOpenDisplay(char *display_name)
+{
+   XGCValues gc_values;
+
+   XInitThreads();
+   if (_ToonXOpenDisplay(display_name))
+      return 1;
+   if ((async = calloc(1, sizeof(_ToonAsync))) == NULL) {
+      strncpy(toon_error_message, "Out of memory", TOON_MESSAGE_LENGTH);
+      _ToonXCloseDisplay();
+      return 1;
+   }
+   if ((async->display = XOpenDisplay(display_name)) == NULL) {
+      strncpy(toon_error_message, "Can't open display for rendering",
+            TOON_MESSAGE_LENGTH);
+      free(async);
+      async = NULL;
+      _ToonXCloseDisplay();
+      return 1;
+   }
+   gc_values.function = GXcopy;
+   gc_values.graphics_exposures = False;
+   gc_values.fill_style = FillTiled;
+   async->root = root;
+   async->gc = XCreateGC(async->display, root,
+         GCFunction | GCFillStyle | GCGraphicsExposures, &gc_values);
+   async->fill_gc = XCreateGC(async->display, root,
+         GCFunction | GCGraphicsExposures, &gc_values);
+
+   async_complete = async_pending = 0;
+   async_staging.nitems = 0;
+   async_dropped_seen = 0;
+   sem_init(&async->wakeup, 0, 0);
+   if (pthread_create(&async_thread, NULL, _ToonAsyncRender, async)) {
+      strncpy(toon_error_message, "Can't start render thread",
+            TOON_MESSAGE_LENGTH);
+      XFreeGC(async->display, async->gc);
+      XFreeGC(async->display, async->fill_gc);
+      XCloseDisplay(async->display);
+      sem_destroy(&async->wakeup);
+      free(async);
+      async = NULL;
+      _ToonXCloseDisplay();
+      return 1;
+   }
+   async_running = 1;
+   return 0;
+}
+
+/* Pixmaps are made on the main connection; make sure the server has them
+   before the render thread refers to them */
+int _ToonAsyncInstallData(ToonData *data, int n, int type)
+{
+   int status = _ToonXInstallData(data, n, type);
+   XSync(display, False);
+   return status;
+}
+
+/* Nothing published may still refer to the pixmaps when they go: the
+   render thread must have drawn the last list, and the server have seen
+   it do so, since its connection is not the one they are freed on */
+void _ToonAsyncFreeData(ToonData *data, int n, int type)
+{
+   unsigned long sync;
+   if (async_running) {
+      sync = atomic_fetch_add(&async->sync_wanted, 1) + 1;
+      sem_post(&async->wakeup);
+      while (atomic_load_explicit(&async->read, memory_order_acquire)
+            != atomic_load(&async->write)
+            || atomic_load(&async->synced) != sync)
+         sched_yield();
+   }
+   _ToonXFreeData(data, n, type);
+   return;
+}
+
+void _ToonAsyncDraw(Toon *t)
+{
+   _ToonDrawItem *item;
+   _ToonAsyncStartFrame();
+   _ToonAsyncReserve(&async_staging, async_staging.nitems+1);
+   item = async_staging.items + async_staging.nitems++;
+   item->x = t->x;
+   item->y = t->y;
+   item->type = t->type;
+   item->frame = t->frame;
+   item->direction = t->direction;
+   /* The render thread only sees the image through the list */
+   item->width = toon_data[t->type].width;
+   item->height = toon_data[t->type].height;
+   item->pixmap = toon_data[t->type].pixmap;
+   item->mask = toon_data[t->type].mask;
+   return;
+}
+
+/* Filled rectangles go in the draw list as items of their own */
+void _ToonAsyncFill(XRectangle *rects, int n, unsigned int colour)
+{
+   int i;
+   _ToonDrawItem *item;
+   _ToonAsyncStartFrame();
+   _ToonAsyncReserve(&async_staging, async_staging.nitems+n);
+   item = async_staging.items + async_staging.nitems;
+   for (i=0; i<n; i++, item++) {
+      item->x = rects[i].x;
+      item->y = rects[i].y;
+      item->type = ASYNC_FILL;
+      item->frame = rects[i].width > 255 ? 255 : rects[i].width;
+      item->direction = rects[i].height > 255 ? 255 : rects[i].height;
+      item->colour = colour;
+   }
+   async_staging.nitems += n;
+   return;
+}
+
+/* The render thread erases what it drew itself */
+void _ToonAsyncErase(int x, int y, int width, int height)
+{
+   _ToonAsyncStartFrame();
+   return;
+}
+
+/* The flush that follows publishes the whole of the last frame again */
+void _ToonAsyncRepair(Toon *t)
+{
+   return;
+}
+
+void _ToonAsyncFlush()
+{
+   unsigned long dropped;
+   async_complete = 1;
+   async_pending = !_ToonAsyncPublish();
+   XFlush(display);
+   dropped = atomic_load(&async->dropped);
+   if (dropped != async_dropped_seen) {
+      ToonStatsCount(TOON_STAT_DROPPED, dropped - async_dropped_seen);
+      async_dropped_seen = dropped;
+   }
+   return;
+}
+
+/* A frame that found the ring full is retried while we wait */
+int _ToonAsyncWait(double timeout)
+{
+   if (async_pending && !_ToonAsyncPublish() && timeout > ASYNC_RETRY)
+      timeout = ASYNC_RETRY;
+   return _ToonXWait(timeout);
+}
+
+void _ToonAsyncCountRequests(unsigned long *requests,
+      unsigned long *round_trips)
+{
+   _ToonXCountRequests(requests, round_trips);
+   if (async) *requests += atomic_load(&async->requests);
+   return;
+}
+
+/* Let the render thread show the last frame (normally the empty one left
+   by the final ToonErase()), then shut it down */
+void _ToonAsyncCloseDisplay()
+{
+   int i;
+   if (async_running) {
+      async_complete = 1;
+      while (!_ToonAsyncPublish())
+         sched_yield();
+      atomic_store(&async->quit, 1);
+      sem_post(&async->wakeup);
+      pthread_join(async_thread, NULL);
+      sem_destroy(&async->wakeup);
+      async_running = 0;
+   }
+   if (async) {
+      XFreeGC(async->display, async->gc);
+      XFreeGC(async->display, async->fill_gc);
+      XCloseDisplay(async->display);
+      for (i=0; i<ASYNC_RINGSIZE; i++)
+         if (async->ring[i].items) free(async->ring[i].items);
+      if (async->drawn) free(async->drawn);
+      if (async->fills) free(async->fills);
+      _ToonCellsFree(&async->filled);
+      free(async);
+      async = NULL;
+   }
+   if (async_staging.items) free(async_staging.items);
+   async_staging.items = NULL;
+   async_staging.size = async_staging.nitems = 0;
+   _ToonXCloseDisplay();
+   return;
+}
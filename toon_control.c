@@ -0,0 +1,293 @@
+/* toon_control.c - control socket and file watching for toon programs
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Lets a running program be reconfigured without a restart. Commands
+ * arrive as lines of text on a Unix socket, and files or directories can
+ * be watched with inotify. Nothing here blocks: the main loop calls
+ * ToonControlPoll() once a frame and gets back one command or change at
+ * a time. What the commands mean is up to the program. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+
+#include "toonP.h"
+
+#define CONTROL_MAXCLIENTS 8
+#define CONTROL_MAXWATCHES 8
+#define CONTROL_LINE 256
+
+typedef struct {
+   int fd;
+   char buf[CONTROL_LINE];
+   int len;
+} _ToonControlClient;
+
+typedef struct {
+   int wd; /* inotify watch on the directory */
+   char name[NAME_MAX+1]; /* file within it, or "" for any */
+   int changed;
+} _ToonControlWatch;
+
+int control_socket = -1;
+char *control_socket_path = NULL;
+_ToonControlClient control_clients[CONTROL_MAXCLIENTS];
+int control_reply_fd = -1; /* client that sent the last command */
+int control_inotify = -1;
+_ToonControlWatch control_watches[CONTROL_MAXWATCHES];
+
+/* Listen for commands on a Unix socket */
+/* Returns 0 on success, 1 on failure (see ToonErrorMessage()) */
+int ToonControlOpen(char *socket_path)
+{
+   struct sockaddr_un addr;
+   int i;
+
+   for (i=0; i<CONTROL_MAXCLIENTS; i++)
+      control_clients[i].fd = -1;
+   if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+      strncpy(toon_error_message, "Control socket path too long",
+            TOON_MESSAGE_LENGTH);
+      return 1;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, socket_path);
+   unlink(socket_path);
+   if ((control_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+         || bind(control_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0
+         || listen(control_socket, 4) < 0) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't open control socket %s", socket_path);
+      if (control_socket >= 0) close(control_socket);
+      control_socket = -1;
+      return 1;
+   }
+   fcntl(control_socket, F_SETFL, O_NONBLOCK);
+   control_socket_path = socket_path;
+   return 0;
+}
+
+/* Watch a file, or every file in a directory, for changes */
+/* Returns a watch number for ToonControlPoll(), or -1 on failure */
+int ToonControlWatch(char *path)
+{
+   char dir[PATH_MAX], *slash;
+   int i, is_dir;
+
+   if (control_inotify < 0) {
+      if ((control_inotify = inotify_init1(IN_NONBLOCK)) < 0) {
+         strncpy(toon_error_message, "Can't watch files (inotify)",
+               TOON_MESSAGE_LENGTH);
+         return -1;
+      }
+      for (i=0; i<CONTROL_MAXWATCHES; i++)
+         control_watches[i].wd = -1;
+   }
+   for (i=0; i<CONTROL_MAXWATCHES && control_watches[i].wd >= 0; i++);
+   if (i == CONTROL_MAXWATCHES) {
+      strncpy(toon_error_message, "Too many watches", TOON_MESSAGE_LENGTH);
+      return -1;
+   }
+
+   /* Editors replace files rather than rewrite them, so a file is
+      watched through its directory */
+   snprintf(dir, sizeof(dir), "%s", path);
+   is_dir = inotify_add_watch(control_inotify, dir, IN_ONLYDIR | IN_MASK_ADD
+         | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+   if (is_dir >= 0) {
+      control_watches[i].wd = is_dir;
+      control_watches[i].name[0] = '\0';
+   }
+   else {
+      if ((slash = strrchr(dir, '/'))) {
+         *slash = '\0';
+         snprintf(control_watches[i].name, NAME_MAX+1, "%.*s", NAME_MAX,
+               slash+1);
+         if (dir[0] == '\0') strcpy(dir, "/");
+      }
+      else {
+         snprintf(control_watches[i].name, NAME_MAX+1, "%.*s", NAME_MAX,
+               dir);
+         strcpy(dir, ".");
+      }
+      if ((control_watches[i].wd = inotify_add_watch(control_inotify, dir,
+            IN_MASK_ADD | IN_CLOSE_WRITE | IN_MOVED_TO)) < 0) {
+         snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+               "Can't watch %s", path);
+         return -1;
+      }
+   }
+   control_watches[i].changed = 0;
+   return i;
+}
+
+/* Stop watching; the inotify watch itself is dropped if nobody else
+   shares it */
+void ToonControlUnwatch(int watch)
+{
+   int i, wd;
+   if (watch < 0 || watch >= CONTROL_MAXWATCHES
+         || (wd = control_watches[watch].wd) < 0)
+      return;
+   control_watches[watch].wd = -1;
+   for (i=0; i<CONTROL_MAXWATCHES && control_watches[i].wd != wd; i++);
+   if (i == CONTROL_MAXWATCHES)
+      inotify_rm_watch(control_inotify, wd);
+   return;
+}
+
+/* Note which watches the pending inotify events touch */
+void _ToonControlReadEvents()
+{
+   char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+   struct inotify_event *event;
+   ssize_t len;
+   char *p;
+   int i;
+
+   while ((len = read(control_inotify, buf, sizeof(buf))) > 0) {
+      for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+         event = (struct inotify_event *) p;
+         for (i=0; i<CONTROL_MAXWATCHES; i++) {
+            if (control_watches[i].wd != event->wd) continue;
+            if (control_watches[i].name[0] == '\0'
+                  || (event->len
+                  && strcmp(control_watches[i].name, event->name) == 0))
+               control_watches[i].changed = 1;
+         }
+      }
+   }
+   return;
+}
+
+/* Take a complete line from a client's buffer */
+/* Returns 1 if there was one */
+int _ToonControlLine(_ToonControlClient *client, char *line, int n)
+{
+   char *end;
+   int len;
+   if ((end = memchr(client->buf, '\n', client->len)) == NULL) {
+      /* Too long to be a command: throw it away */
+      if (client->len == CONTROL_LINE) client->len = 0;
+      return 0;
+   }
+   len = end - client->buf;
+   snprintf(line, n, "%.*s", len, client->buf);
+   if (len > 0 && len < n && line[len-1] == '\r') line[len-1] = '\0';
+   client->len -= len + 1;
+   memmove(client->buf, end + 1, client->len);
+   return 1;
+}
+
+/* Return the next thing to be done: TOON_CONTROL_COMMAND with the command
+   in `line', TOON_CONTROL_CHANGED with the watch number in *watch, or
+   TOON_CONTROL_NONE once there is nothing left */
+int ToonControlPoll(char *line, int n, int *watch)
+{
+   _ToonControlClient *client;
+   ssize_t len;
+   int fd, i;
+
+   if (control_inotify >= 0) {
+      _ToonControlReadEvents();
+      for (i=0; i<CONTROL_MAXWATCHES; i++) {
+         if (control_watches[i].wd >= 0 && control_watches[i].changed) {
+            control_watches[i].changed = 0;
+            *watch = i;
+            return TOON_CONTROL_CHANGED;
+         }
+      }
+   }
+   if (control_socket < 0)
+      return TOON_CONTROL_NONE;
+
+   while ((fd = accept(control_socket, NULL, NULL)) >= 0) {
+      for (i=0; i<CONTROL_MAXCLIENTS && control_clients[i].fd >= 0; i++);
+      if (i == CONTROL_MAXCLIENTS) {
+         close(fd);
+         continue;
+      }
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+      control_clients[i].fd = fd;
+      control_clients[i].len = 0;
+   }
+   for (i=0; i<CONTROL_MAXCLIENTS; i++) {
+      client = control_clients + i;
+      if (client->fd < 0) continue;
+      if (_ToonControlLine(client, line, n)) {
+         control_reply_fd = client->fd;
+         return TOON_CONTROL_COMMAND;
+      }
+      len = read(client->fd, client->buf + client->len,
+            CONTROL_LINE - client->len);
+      if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+         close(client->fd);
+         client->fd = -1;
+         continue;
+      }
+      if (len > 0) {
+         client->len += len;
+         if (_ToonControlLine(client, line, n)) {
+            control_reply_fd = client->fd;
+            return TOON_CONTROL_COMMAND;
+         }
+      }
+   }
+   return TOON_CONTROL_NONE;
+}
+
+/* Answer the client that sent the last command, without SIGPIPE if it
+   has already gone */
+void ToonControlReply(char *text)
+{
+   if (control_reply_fd < 0) return;
+   if (send(control_reply_fd, text, strlen(text), MSG_NOSIGNAL) < 0
+         || send(control_reply_fd, "\n", 1, MSG_NOSIGNAL) < 0)
+      control_reply_fd = -1;
+   return;
+}
+
+/* Close the socket and any connections to it, and stop watching */
+void ToonControlClose()
+{
+   int i;
+   for (i=0; i<CONTROL_MAXCLIENTS; i++) {
+      if (control_socket >= 0 && control_clients[i].fd >= 0)
+         close(control_clients[i].fd);
+      control_clients[i].fd = -1;
+   }
+   if (control_socket >= 0) {
+      close(control_socket);
+      unlink(control_socket_path);
+      control_socket = -1;
+   }
+   if (control_inotify >= 0) {
+      close(control_inotify);
+      control_inotify = -1;
+   }
+   control_reply_fd = -1;
+   return;
+}
@@ -0,0 +1,780 @@
+/* toon_graph.c - the surfaces and walls the toons can walk and climb along
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* ToonLocateWindows() ends by bringing the graph up to date: the tops of
+ * the windows (and the bottom of the screen) that a toon can stand on,
+ * and their sides (and the screen's) that it can climb, each cut into the
+ * pieces along which a toon of any type has room and is held up all the
+ * way. The ends of the pieces are linked to the next surface a step up or
+ * down, or to the wall they run into. A toon on a piece cannot run into
+ * anything until it comes off the end, so ToonAdvance() moves it without
+ * looking at the windows, and a program need only react at the ends.
+ *
+ * The pieces of each window are kept with it, and only those of windows
+ * near one that moved, appeared or went are made again. A shaped window
+ * may change its shape without moving, so it counts as moved every time;
+ * the graph is only ever believed where _ToonMoveTowards() would agree,
+ * and a toon off it is moved as it always was. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "toonP.h"
+
+#define GRAPH_CELL 128 /* pixels, the side of the cells windows are filed in */
+#define GRAPH_FINEST 4 /* pixels, how closely the ends of a piece are found */
+
+/* A window, or the screen's edges as window 0, and its pieces */
+typedef struct {
+   unsigned int wid;
+   XRectangle pos;
+   ToonSegment *piece;
+   int npieces, piece_size;
+   char dirty;
+   char shaped; /* so its pieces can't be kept */
+} _ToonGraphSource;
+
+TOON_LOCAL ToonSegment *graph = NULL; /* surfaces first, then walls */
+TOON_LOCAL int graph_n = 0, graph_nsurfaces = 0;
+TOON_LOCAL unsigned int graph_generation = 0;
+TOON_LOCAL _ToonGraphSource *graph_source = NULL; /* in order of wid */
+TOON_LOCAL int graph_nsources = 0;
+TOON_LOCAL int graph_step = TOON_DEFAULTSTEP;
+/* What the graph was made for: room for the biggest type, pieces no
+   shorter than the smallest. If any of it changes it is made afresh */
+TOON_LOCAL int graph_clear_w, graph_clear_h, graph_min_w, graph_min_h;
+TOON_LOCAL int graph_width, graph_height, graph_made_step, graph_edge;
+/* The solid windows, filed by cell while pieces are being made */
+TOON_LOCAL XRectangle *graph_rect = NULL;
+TOON_LOCAL int *graph_cell_start = NULL, *graph_cell_entry = NULL;
+TOON_LOCAL int *graph_mark = NULL, graph_stamp = 0;
+TOON_LOCAL int graph_columns, graph_rows;
+
+/* Link toons to the surfaces up or down to `pixels' from the end of the
+   one they are on, from the next ToonLocateWindows(); TOON_DEFAULTSTEP
+   unless set */
+void ToonSetStepHeight(int pixels)
+{
+   graph_step = pixels < 0 ? 0 : pixels;
+   return;
+}
+
+/* Get the graph made by the last ToonLocateWindows(), which stays good
+   until the next */
+/* Returns the number of segments, surfaces first */
+int ToonSegments(ToonSegment **segments)
+{
+   *segments = graph;
+   return graph_n;
+}
+
+/* Throw the graph away, to be made afresh by the next ToonLocateWindows():
+   when the types or the gaps between monitors change */
+void _ToonGraphForget()
+{
+   int i;
+   for (i=0; i<graph_nsources; i++)
+      if (graph_source[i].piece) free(graph_source[i].piece);
+   if (graph_source) free(graph_source);
+   if (graph) free(graph);
+   graph_source = NULL;
+   graph = NULL;
+   graph_nsources = graph_n = graph_nsurfaces = 0;
+   if (++graph_generation == 0) graph_generation = 1;
+   return;
+}
+
+/* Surfaces in order of height and then x, then the walls on the toon's
+   left and right in order of x and then height */
+int _ToonCompareSegments(const void *a, const void *b)
+{
+   const ToonSegment *s = a, *t = b;
+   int sk = s->wall == TOON_DOWN ? 0 : 1 + s->wall;
+   int tk = t->wall == TOON_DOWN ? 0 : 1 + t->wall;
+   if (sk != tk) return sk - tk;
+   if (s->wall == TOON_DOWN) {
+      if (s->y != t->y) return s->y < t->y ? -1 : 1;
+      return s->x < t->x ? -1 : s->x > t->x;
+   }
+   if (s->x != t->x) return s->x < t->x ? -1 : 1;
+   return s->y < t->y ? -1 : s->y > t->y;
+}
+
+int _ToonCompareSources(const void *a, const void *b)
+{
+   const _ToonGraphSource *s = a, *t = b;
+   return s->wid < t->wid ? -1 : s->wid > t->wid;
+}
+
+int _ToonCompareInts(const void *a, const void *b)
+{
+   const int *s = a, *t = b;
+   return s[0] < t[0] ? -1 : s[0] > t[0];
+}
+
+/* Returns the first segment of the graph that comes after `key' */
+int _ToonGraphAfter(ToonSegment *key)
+{
+   int lo = 0, hi = graph_n, mid;
+   while (lo < hi) {
+      mid = (lo + hi)/2;
+      if (_ToonCompareSegments(graph + mid, key) <= 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return lo;
+}
+
+/* Returns 1 if a toon at x,y is on the free part of a segment, 0 if not */
+int _ToonSegmentFits(ToonSegment *s, Toon *toon, int x, int y)
+{
+   int width = toon_data[toon->type].width;
+   int height = toon_data[toon->type].height;
+
+   if (s->wall != toon->associate
+         || width > graph_clear_w || height > graph_clear_h)
+      return 0;
+   /* Where _ToonMoveTowards() would stop it at the edges */
+   if (edge_block && (x < 0 || x + width > display_width
+         || (y < 0 && edge_block != 2) || y + height > display_height))
+      return 0;
+   switch (s->wall) {
+      case TOON_DOWN:
+         return y + height == s->y && x >= s->x
+               && x + width <= s->x + s->length;
+      case TOON_LEFT:
+         return x == s->x && y >= s->y && y + height <= s->y + s->length;
+      case TOON_RIGHT:
+         return x + width == s->x && y >= s->y
+               && y + height <= s->y + s->length;
+   }
+   return 0;
+}
+
+/* Returns the segment the toon is on as it is associated, or -1 */
+int _ToonFindSegment(Toon *toon)
+{
+   ToonSegment key;
+   int i;
+
+   if (graph_n == 0 || toon->associate < TOON_LEFT
+         || toon->associate == TOON_UP)
+      return -1;
+   key.wall = toon->associate;
+   if (key.wall == TOON_DOWN) {
+      key.y = toon->y + toon_data[toon->type].height;
+      key.x = toon->x;
+   }
+   else {
+      key.x = toon->x + (key.wall == TOON_RIGHT
+            ? toon_data[toon->type].width : 0);
+      key.y = toon->y;
+   }
+   /* Pieces of different windows may overlap, so look back through all
+      on the same line that start before the toon */
+   for (i = _ToonGraphAfter(&key) - 1; i >= 0 && graph[i].wall == key.wall
+         && (key.wall == TOON_DOWN ? graph[i].y == key.y
+            : graph[i].x == key.x); i--)
+      if (_ToonSegmentFits(graph + i, toon, toon->x, toon->y))
+         return i;
+   return -1;
+}
+
+/* Find which segment of the graph a toon is on, as it is associated:
+   standing on a surface (TOON_DOWN) or climbing a wall (TOON_LEFT or
+   TOON_RIGHT). Nothing can be in its way until it comes to an end of it */
+/* Returns the segment (see ToonSegments()), or -1 if it is on none */
+int ToonOnGraph(Toon *toon)
+{
+   if (toon->segment_graph == graph_generation && toon->segment >= 0
+         && toon->segment < graph_n
+         && _ToonSegmentFits(graph + toon->segment, toon, toon->x, toon->y))
+      return toon->segment;
+   toon->segment = _ToonFindSegment(toon);
+   toon->segment_graph = graph_generation;
+   return toon->segment;
+}
+
+/* Returns 1 if a toon at x,y can go there along the segment it is on, so
+   _ToonMoveTowards() need not look at the windows */
+int _ToonAlongGraph(Toon *toon, int x, int y)
+{
+   int s = ToonOnGraph(toon);
+   return s >= 0 && _ToonSegmentFits(graph + s, toon, x, y);
+}
+
+/* Take a walker blocked at the end of the surface it is on up the step
+   the graph links it to, a little way forward in `direction' */
+/* Returns TOON_OK if it stepped, TOON_BLOCKED if there is no step it
+   can take here */
+int ToonTakeStep(Toon *toon, int direction)
+{
+   ToonSegment *p, *q;
+   int s, end, x, y, width, height;
+
+   if ((direction != TOON_LEFT && direction != TOON_RIGHT)
+         || toon->associate != TOON_DOWN || (s = ToonOnGraph(toon)) < 0)
+      return TOON_BLOCKED;
+   p = graph + s;
+   end = direction == TOON_RIGHT;
+   if (p->link[end] != TOON_LINKSTEP)
+      return TOON_BLOCKED;
+   q = graph + p->next[end];
+   width = toon_data[toon->type].width;
+   height = toon_data[toon->type].height;
+   x = toon->x + (2*direction - 1)*(graph_step/2 > 0 ? graph_step/2 : 1);
+   y = q->y - height;
+   /* It must land with a foot on the step, and room to stand */
+   if (x + width <= q->x || x >= q->x + q->length
+         || (edge_block && (x < 0 || x + width > display_width
+            || (y < 0 && edge_block != 2)))
+         || XRectInRegion(windows, x, y, width, height) != RectangleOut)
+      return TOON_BLOCKED;
+   ToonSetPosition(toon, x, y);
+   return TOON_OK;
+}
+
+/* The cells from c0,r0 to c1,r1 that x,y,width,height touches, counting
+   anything off the screen as in the cells at its edge */
+void _ToonGraphCells(int x, int y, int width, int height, int *c0, int *r0,
+      int *c1, int *r1)
+{
+   *c0 = x < 0 ? 0 : x/GRAPH_CELL;
+   *r0 = y < 0 ? 0 : y/GRAPH_CELL;
+   *c1 = x + width <= 0 ? 0 : (x + width - 1)/GRAPH_CELL;
+   *r1 = y + height <= 0 ? 0 : (y + height - 1)/GRAPH_CELL;
+   if (*c0 >= graph_columns) *c0 = graph_columns - 1;
+   if (*r0 >= graph_rows) *r0 = graph_rows - 1;
+   if (*c1 >= graph_columns) *c1 = graph_columns - 1;
+   if (*r1 >= graph_rows) *r1 = graph_rows - 1;
+   return;
+}
+
+/* File n rectangles by the cells of the screen they touch */
+/* Returns 0 on success, 1 if out of memory */
+int _ToonGraphFile(XRectangle *rect, int n)
+{
+   int i, c, r, c0, c1, r0, r1, ncells, *count;
+
+   graph_columns = display_width/GRAPH_CELL + 1;
+   graph_rows = display_height/GRAPH_CELL + 1;
+   ncells = graph_columns*graph_rows;
+   if ((graph_cell_start = calloc(ncells + 1, sizeof(int))) == NULL
+         || (graph_mark = calloc(n + 1, sizeof(int))) == NULL)
+      return 1;
+   for (i=0; i<n; i++) {
+      _ToonGraphCells(rect[i].x, rect[i].y, rect[i].width, rect[i].height,
+            &c0, &r0, &c1, &r1);
+      for (r=r0; r<=r1; r++)
+         for (c=c0; c<=c1; c++)
+            graph_cell_start[r*graph_columns + c + 1]++;
+   }
+   for (c=0; c<ncells; c++)
+      graph_cell_start[c+1] += graph_cell_start[c];
+   if ((graph_cell_entry = malloc((graph_cell_start[ncells] + 1)
+         *sizeof(int))) == NULL
+         || (count = calloc(ncells, sizeof(int))) == NULL)
+      return 1;
+   for (i=0; i<n; i++) {
+      _ToonGraphCells(rect[i].x, rect[i].y, rect[i].width, rect[i].height,
+            &c0, &r0, &c1, &r1);
+      for (r=r0; r<=r1; r++)
+         for (c=c0; c<=c1; c++)
+            graph_cell_entry[graph_cell_start[r*graph_columns + c]
+                  + count[r*graph_columns + c]++] = i;
+   }
+   free(count);
+   graph_stamp = 0;
+   return 0;
+}
+
+/* Find the windows whose rectangles meet x,y,width,height from the cells
+   it touches, one each call by *i; *cell starts at -1 */
+/* Returns 1 while there are more, then 0 */
+int _ToonGraphNear(int x, int y, int width, int height, int *cell,
+      int *entry, int *i)
+{
+   int c0, c1, r0, r1, c, r;
+   XRectangle *R;
+
+   _ToonGraphCells(x, y, width, height, &c0, &r0, &c1, &r1);
+   if (*cell < 0) {
+      graph_stamp++;
+      *cell = r0*graph_columns + c0;
+      *entry = graph_cell_start[*cell];
+   }
+   while (1) {
+      while (*entry < graph_cell_start[*cell + 1]) {
+         *i = graph_cell_entry[(*entry)++];
+         R = graph_rect + *i;
+         /* A window filed in several cells is only seen once */
+         if (graph_mark[*i] == graph_stamp
+               || R->x >= x + width || R->x + R->width <= x
+               || R->y >= y + height || R->y + R->height <= y)
+            continue;
+         graph_mark[*i] = graph_stamp;
+         return 1;
+      }
+      c = *cell % graph_columns;
+      r = *cell / graph_columns;
+      if (++c > c1) {
+         c = c0;
+         if (++r > r1) return 0;
+      }
+      *cell = r*graph_columns + c;
+      *entry = graph_cell_start[*cell];
+   }
+}
+
+/* Add a piece to a window's list, or lengthen the last if it ends where
+   this one starts */
+/* Returns 0 on success, 1 if out of memory */
+int _ToonGraphAdd(_ToonGraphSource *source, int wall, int at, int from,
+      int to)
+{
+   ToonSegment *s;
+   if (source->npieces) {
+      s = source->piece + source->npieces - 1;
+      if (s->wall == wall && (wall == TOON_DOWN
+            ? s->y == at && s->x + s->length == from
+            : s->x == at && s->y + s->length == from)) {
+         s->length += to - from;
+         return 0;
+      }
+   }
+   if (source->npieces == source->piece_size) {
+      source->piece_size = source->piece_size ? 2*source->piece_size : 4;
+      if ((s = realloc(source->piece, source->piece_size
+            *sizeof(ToonSegment))) == NULL)
+         return 1;
+      source->piece = s;
+   }
+   s = source->piece + source->npieces++;
+   memset(s, 0, sizeof(ToonSegment));
+   s->wall = wall;
+   s->wid = source->wid;
+   if (wall == TOON_DOWN) {
+      s->x = from;
+      s->y = at;
+   }
+   else {
+      s->x = at;
+      s->y = from;
+   }
+   s->length = to - from;
+   s->next[0] = s->next[1] = -1;
+   return 0;
+}
+
+/* The room a toon needs beside part of a line, from..to along it */
+void _ToonGraphBand(int wall, int at, int from, int to, int *x, int *y,
+      int *width, int *height)
+{
+   switch (wall) {
+      case TOON_DOWN:
+         *x = from; *y = at - graph_clear_h;
+         *width = to - from; *height = graph_clear_h;
+         break;
+      case TOON_LEFT:
+         *x = at; *y = from;
+         *width = graph_clear_w; *height = to - from;
+         break;
+      default:
+         *x = at - graph_clear_w; *y = from;
+         *width = graph_clear_w; *height = to - from;
+   }
+   return;
+}
+
+/* Keep the part of a line from..to that has room beside it and is held up
+   all the way (if `held'), halving it to find the parts that are: the
+   halves that are both join up again */
+/* Returns 0 on success, 1 if out of memory */
+int _ToonGraphVerify(_ToonGraphSource *source, int wall, int at, int from,
+      int to, int held)
+{
+   int x, y, width, height, ok;
+
+   _ToonGraphBand(wall, at, from, to, &x, &y, &width, &height);
+   ok = XRectInRegion(windows, x, y, width, height) == RectangleOut;
+   if (ok && held) {
+      if (wall == TOON_DOWN)
+         ok = XRectInRegion(windows, from, at, to - from, 1) == RectangleIn;
+      else
+         ok = XRectInRegion(windows, wall == TOON_LEFT ? at - 1 : at, from,
+               1, to - from) == RectangleIn;
+   }
+   if (ok)
+      return _ToonGraphAdd(source, wall, at, from, to);
+   if (to - from < 2*GRAPH_FINEST)
+      return 0;
+   return _ToonGraphVerify(source, wall, at, from, (from + to)/2, held)
+         || _ToonGraphVerify(source, wall, at, (from + to)/2, to, held);
+}
+
+/* Find the pieces of one line of a window: the parts of from..to at `at'
+   that no other window's rectangle keeps too close to be any use */
+/* Returns 0 on success, 1 if out of memory */
+int _ToonGraphLine(_ToonGraphSource *source, int wall, int at, int from,
+      int to, int held)
+{
+   int x, y, width, height, cell = -1, entry, i, n = 0, size = 0;
+   int shortest = wall == TOON_DOWN ? graph_min_w : graph_min_h;
+   int *blocked = NULL, *more, a, b, status = 0, first, j;
+   XRectangle *R;
+
+   if (wall == TOON_DOWN) {
+      if (at <= 0 || at > display_height
+            || (edge_block == 1 && at - graph_clear_h < 0))
+         return 0;
+      if (from < 0) from = 0;
+      if (to > display_width) to = display_width;
+   }
+   else {
+      if (at < 0 || at > display_width || (edge_block
+            && (wall == TOON_LEFT ? at + graph_clear_w > display_width
+            : at - graph_clear_w < 0)))
+         return 0;
+      if (from < 0) from = 0;
+      if (to > display_height) to = display_height;
+   }
+   if (to - from < shortest)
+      return 0;
+
+   /* What the other windows take out of it, as pairs of ends */
+   _ToonGraphBand(wall, at, from, to, &x, &y, &width, &height);
+   while (_ToonGraphNear(x, y, width, height, &cell, &entry, &i)) {
+      if (n == size) {
+         size = size ? 2*size : 16;
+         if ((more = realloc(blocked, 2*size*sizeof(int))) == NULL) {
+            free(blocked);
+            return 1;
+         }
+         blocked = more;
+      }
+      R = graph_rect + i;
+      blocked[2*n] = wall == TOON_DOWN ? R->x : R->y;
+      blocked[2*n+1] = blocked[2*n] + (wall == TOON_DOWN ? R->width
+            : R->height);
+      /* On a crowded screen one window usually hides the lot */
+      if (blocked[2*n] <= from && blocked[2*n+1] >= to) {
+         free(blocked);
+         return 0;
+      }
+      n++;
+   }
+   qsort(blocked, n, 2*sizeof(int), _ToonCompareInts);
+
+   /* ...and whatever is left between them */
+   first = source->npieces;
+   for (a = from, i = 0; a < to && !status; i++) {
+      b = i < n ? blocked[2*i] : to;
+      if (b > to) b = to;
+      if (b - a >= shortest)
+         status = _ToonGraphVerify(source, wall, at, a, b, held);
+      if (i >= n) break;
+      if (blocked[2*i+1] > a) a = blocked[2*i+1];
+   }
+   if (blocked) free(blocked);
+
+   /* Only keep what would hold a toon */
+   for (i = j = first; i < source->npieces; i++)
+      if (source->piece[i].length >= shortest)
+         source->piece[j++] = source->piece[i];
+   source->npieces = j;
+   return status;
+}
+
+/* Make the pieces of a window, or of the screen's edges */
+/* Returns 0 on success, 1 if out of memory */
+int _ToonGraphPieces(_ToonGraphSource *source)
+{
+   XRectangle *R = &(source->pos);
+   source->npieces = 0;
+   if (source->wid == 0)
+      return _ToonGraphLine(source, TOON_DOWN, display_height, 0,
+            display_width, 0)
+            || _ToonGraphLine(source, TOON_LEFT, 0, 0, display_height, 0)
+            || _ToonGraphLine(source, TOON_RIGHT, display_width, 0,
+            display_height, 0);
+   return _ToonGraphLine(source, TOON_DOWN, R->y, R->x, R->x + R->width, 1)
+         || _ToonGraphLine(source, TOON_RIGHT, R->x, R->y,
+         R->y + R->height, 1)
+         || _ToonGraphLine(source, TOON_LEFT, R->x + R->width, R->y,
+         R->y + R->height, 1);
+}
+
+/* Returns 1 if x,y,width,height meets any of the n rectangles */
+int _ToonGraphMeets(XRectangle *rect, int n, int x, int y, int width,
+      int height)
+{
+   int i;
+   for (i=0; i<n; i++)
+      if (rect[i].x < x + width && rect[i].x + rect[i].width > x
+            && rect[i].y < y + height && rect[i].y + rect[i].height > y)
+         return 1;
+   return 0;
+}
+
+/* Link an end of a segment to whatever of kind `wall' lies within the
+   step height of x,y there; `along' picks which way it must go on */
+void _ToonGraphLink(int s, int end, int wall, int x, int y, int along,
+      int link)
+{
+   ToonSegment key, *t;
+   int i, d, best = -1, best_d = INT_MAX;
+
+   key.wall = wall;
+   if (wall == TOON_DOWN) {
+      key.y = y - graph_step;
+      key.x = INT_MIN;
+   }
+   else {
+      key.x = along < 0 ? x - graph_step : x;
+      key.y = INT_MIN;
+   }
+   for (i = _ToonGraphAfter(&key); i < graph_n && graph[i].wall == wall;
+         i++) {
+      t = graph + i;
+      if (i == s) continue;
+      if (wall == TOON_DOWN) {
+         if (t->y > y + graph_step) break;
+         /* It must carry on past the end, starting no further on than a
+            step */
+         if (along > 0 ? t->x + t->length <= x || t->x > x + graph_step
+               : t->x >= x || t->x + t->length < x - graph_step)
+            continue;
+         d = abs(t->y - y) + (along > 0 ? (t->x > x ? t->x - x : 0)
+               : (t->x + t->length < x ? x - t->x - t->length : 0));
+      }
+      else {
+         if (t->x > (along < 0 ? x : x + graph_step)) break;
+         /* The wall must reach down to about the surface */
+         if (t->y >= y || t->y + t->length < y - graph_step)
+            continue;
+         d = abs(t->x - x);
+      }
+      if (d < best_d) {
+         best = i;
+         best_d = d;
+      }
+   }
+   if (best >= 0) {
+      graph[s].link[end] = link;
+      graph[s].next[end] = best;
+   }
+   return;
+}
+
+/* Put the pieces of every window together into one graph and link it */
+void _ToonGraphJoin()
+{
+   ToonSegment *s;
+   int i, n = 0;
+
+   for (i=0; i<graph_nsources; i++)
+      n += graph_source[i].npieces;
+   if (graph) free(graph);
+   graph_n = graph_nsurfaces = 0;
+   if ((graph = malloc((n ? n : 1)*sizeof(ToonSegment))) == NULL)
+      return;
+   for (i=0; i<graph_nsources; i++) {
+      memcpy(graph + graph_n, graph_source[i].piece,
+            graph_source[i].npieces*sizeof(ToonSegment));
+      graph_n += graph_source[i].npieces;
+   }
+   qsort(graph, graph_n, sizeof(ToonSegment), _ToonCompareSegments);
+   while (graph_nsurfaces < graph_n
+         && graph[graph_nsurfaces].wall == TOON_DOWN)
+      graph_nsurfaces++;
+
+   for (i=0; i<graph_n; i++) {
+      s = graph + i;
+      s->link[0] = s->link[1] = TOON_LINKNONE;
+      s->next[0] = s->next[1] = -1;
+      if (s->wall == TOON_DOWN) {
+         /* Walk on to the next surface, or else climb what is in the way */
+         _ToonGraphLink(i, 0, TOON_DOWN, s->x, s->y, -1, TOON_LINKSTEP);
+         _ToonGraphLink(i, 1, TOON_DOWN, s->x + s->length, s->y, 1,
+               TOON_LINKSTEP);
+         if (s->link[0] == TOON_LINKNONE)
+            _ToonGraphLink(i, 0, TOON_LEFT, s->x, s->y, -1, TOON_LINKCLIMB);
+         if (s->link[1] == TOON_LINKNONE)
+            _ToonGraphLink(i, 1, TOON_RIGHT, s->x + s->length, s->y, 1,
+                  TOON_LINKCLIMB);
+      }
+      else {
+         /* Over the top onto the window, or down onto what it stands on */
+         _ToonGraphLink(i, 0, TOON_DOWN, s->x, s->y,
+               s->wall == TOON_RIGHT ? 1 : -1, TOON_LINKCLIMB);
+         _ToonGraphLink(i, 1, TOON_DOWN, s->x, s->y + s->length,
+               s->wall == TOON_RIGHT ? -1 : 1, TOON_LINKCLIMB);
+      }
+   }
+   return;
+}
+
+/* Bring the graph up to date with the window table and region just made
+   by ToonLocateWindows(). Out of memory, there is simply no graph */
+void _ToonGraphUpdate()
+{
+   _ToonGraphSource *source, *old = graph_source;
+   XRectangle *changed = NULL;
+   int nsources, nold = graph_nsources, nchanged = 0, nrects = 0;
+   int i, j, k, fresh = 0, dirty = 0, failed = 0;
+   int clear_w = 0, clear_h = 0, min_w = INT_MAX, min_h = INT_MAX;
+
+   if (toon_data == NULL || toon_ntypes == 0) {
+      _ToonGraphForget();
+      return;
+   }
+   for (i=0; i<toon_ntypes; i++) {
+      if (toon_data[i].width > clear_w) clear_w = toon_data[i].width;
+      if (toon_data[i].height > clear_h) clear_h = toon_data[i].height;
+      if (toon_data[i].width < min_w) min_w = toon_data[i].width;
+      if (toon_data[i].height < min_h) min_h = toon_data[i].height;
+   }
+   if (graph == NULL || clear_w != graph_clear_w || clear_h != graph_clear_h
+         || min_w != graph_min_w || min_h != graph_min_h
+         || display_width != graph_width || display_height != graph_height
+         || graph_step != graph_made_step || edge_block != graph_edge)
+      fresh = 1;
+   graph_clear_w = clear_w;
+   graph_clear_h = clear_h;
+   graph_min_w = min_w;
+   graph_min_h = min_h;
+   graph_width = display_width;
+   graph_height = display_height;
+   graph_made_step = graph_step;
+   graph_edge = edge_block;
+
+   /* This time's windows, and the screen's edges */
+   for (i=0; i<nwindows; i++)
+      if (windata[i].solid) nrects++;
+   nsources = nrects + (edge_block != 0);
+   if ((source = calloc(nsources + 1, sizeof(_ToonGraphSource))) == NULL
+         || (graph_rect = malloc((nrects + 1)*sizeof(XRectangle))) == NULL
+         || (changed = malloc(2*(nsources + nold + 1)*sizeof(XRectangle)))
+         == NULL) {
+      if (source) free(source);
+      failed = 1;
+      goto done;
+   }
+   for (i=0, j=0; i<nwindows; i++) {
+      if (!windata[i].solid) continue;
+      graph_rect[j] = windata[i].pos;
+      source[j].wid = windata[i].wid;
+      source[j].shaped = windata[i].shaped;
+      source[j++].pos = windata[i].pos;
+   }
+   if (edge_block) {
+      source[j].wid = 0;
+      source[j].pos.width = display_width;
+      source[j].pos.height = display_height;
+   }
+   qsort(source, nsources, sizeof(_ToonGraphSource), _ToonCompareSources);
+
+   /* Keep the pieces of windows that stayed put, noting where the others
+      were and are now */
+   for (i=0, k=0; i<nsources || k<nold; ) {
+      if (k == nold || (i < nsources && source[i].wid < old[k].wid)) {
+         changed[nchanged++] = source[i].pos;
+         source[i++].dirty = 1;
+      }
+      else if (i == nsources || old[k].wid < source[i].wid) {
+         changed[nchanged++] = old[k++].pos;
+      }
+      else {
+         if (fresh || source[i].shaped || old[k].shaped
+               || memcmp(&(source[i].pos), &(old[k].pos),
+               sizeof(XRectangle)) != 0) {
+            changed[nchanged++] = old[k].pos;
+            changed[nchanged++] = source[i].pos;
+            source[i].dirty = 1;
+         }
+         else {
+            source[i].piece = old[k].piece;
+            source[i].npieces = old[k].npieces;
+            source[i].piece_size = old[k].piece_size;
+            old[k].piece = NULL;
+         }
+         i++;
+         k++;
+      }
+   }
+   /* ...and the pieces of those near them go too: anything within a toon
+      of a window's top or sides, or on its edge, may have cut them */
+   for (i=0; i<nsources && nchanged; i++) {
+      XRectangle *R = &(source[i].pos);
+      if (source[i].dirty) continue;
+      if (source[i].wid == 0)
+         source[i].dirty = _ToonGraphMeets(changed, nchanged, 0,
+               display_height - clear_h - 1, display_width, clear_h + 2)
+               || _ToonGraphMeets(changed, nchanged, 0, 0, clear_w + 1,
+               display_height)
+               || _ToonGraphMeets(changed, nchanged,
+               display_width - clear_w - 1, 0, clear_w + 1, display_height);
+      else
+         source[i].dirty = _ToonGraphMeets(changed, nchanged,
+               R->x, R->y - clear_h, R->width, clear_h + 1)
+               || _ToonGraphMeets(changed, nchanged, R->x - clear_w, R->y,
+               clear_w + 1, R->height)
+               || _ToonGraphMeets(changed, nchanged,
+               R->x + R->width - 1, R->y, clear_w + 1, R->height);
+      if (source[i].dirty) {
+         free(source[i].piece);
+         source[i].piece = NULL;
+         source[i].npieces = source[i].piece_size = 0;
+      }
+   }
+   for (k=0; k<nold; k++)
+      if (old[k].piece) free(old[k].piece);
+   if (old) free(old);
+   graph_source = source;
+   graph_nsources = nsources;
+
+   for (i=0; i<nsources; i++)
+      dirty += source[i].dirty;
+   if (dirty && _ToonGraphFile(graph_rect, nrects))
+      failed = 1;
+   for (i=0; i<nsources && dirty && !failed; i++) {
+      if (source[i].dirty && _ToonGraphPieces(source + i))
+         failed = 1;
+      source[i].dirty = 0;
+   }
+   if (!failed && (dirty || fresh || nchanged)) {
+      _ToonGraphJoin();
+      if (++graph_generation == 0) graph_generation = 1;
+   }
+   failed = failed || graph == NULL;
+
+ done:
+   if (graph_cell_start) free(graph_cell_start);
+   if (graph_cell_entry) free(graph_cell_entry);
+   if (graph_mark) free(graph_mark);
+   if (graph_rect) free(graph_rect);
+   if (changed) free(changed);
+   graph_cell_start = graph_cell_entry = graph_mark = NULL;
+   graph_rect = NULL;
+   if (failed)
+      _ToonGraphForget();
+   return;
+}
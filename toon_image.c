@@ -0,0 +1,234 @@
+/* toon_image.c - decode XPM images without the help of an X server
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Only the subset of XPM used by the toon images is understood: `c'
+ * colours given as hex triplets, `None' or one of a handful of names */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "toonP.h"
+
+#define _TOON_TRANSPARENT 0x00000000
+
+typedef struct {
+   char *name;
+   unsigned int rgb;
+} _ToonNamedColor;
+
+_ToonNamedColor _toon_named_colors[] = {
+   { "black",   0x000000 },
+   { "white",   0xffffff },
+   { "red",     0xff0000 },
+   { "green",   0x00ff00 },
+   { "blue",    0x0000ff },
+   { "yellow",  0xffff00 },
+   { "cyan",    0x00ffff },
+   { "magenta", 0xff00ff },
+   { "orange",  0xffa500 },
+   { "brown",   0xa52a2a },
+   { NULL, 0 }
+};
+
+/* Convert an XPM colour specification to 0xAARRGGBB */
+unsigned int _ToonParseColor(char *spec)
+{
+   int i, len;
+   unsigned int r, g, b;
+   char *p;
+
+   if (strcasecmp(spec, "none") == 0)
+      return _TOON_TRANSPARENT;
+   if (spec[0] == '#') {
+      len = strlen(spec+1);
+      if (len == 3 && sscanf(spec+1, "%1x%1x%1x", &r, &g, &b) == 3)
+         return 0xff000000 | (r*0x11)<<16 | (g*0x11)<<8 | (b*0x11);
+      if (len == 6 && sscanf(spec+1, "%2x%2x%2x", &r, &g, &b) == 3)
+         return 0xff000000 | r<<16 | g<<8 | b;
+      if (len == 12 && sscanf(spec+1, "%4x%4x%4x", &r, &g, &b) == 3)
+         return 0xff000000 | (r>>8)<<16 | (g>>8)<<8 | (b>>8);
+   }
+   if (strncasecmp(spec, "gray", 4) == 0 || strncasecmp(spec, "grey", 4) == 0) {
+      p = spec+4;
+      if (*p == '\0')
+         return 0xffbebebe;
+      g = atoi(p);
+      if (g <= 100) {
+         g = (g*255+50)/100;
+         return 0xff000000 | g<<16 | g<<8 | g;
+      }
+   }
+   for (i=0; _toon_named_colors[i].name; i++) {
+      if (strcasecmp(spec, _toon_named_colors[i].name) == 0)
+         return 0xff000000 | _toon_named_colors[i].rgb;
+   }
+   return 0xff000000;
+}
+
+/* Pick the colour out of an XPM colour line, preferring the `c' key */
+unsigned int _ToonColorFromLine(char *line)
+{
+   char buf[256], *key, *value, *best = NULL;
+   int rank, best_rank = 0;
+
+   strncpy(buf, line, sizeof(buf)-1);
+   buf[sizeof(buf)-1] = '\0';
+   key = strtok(buf, " \t");
+   while (key) {
+      value = strtok(NULL, " \t");
+      if (value == NULL) break;
+      if (strcmp(key, "c") == 0) rank = 4;
+      else if (strcmp(key, "g") == 0) rank = 3;
+      else if (strcmp(key, "g4") == 0) rank = 2;
+      else if (strcmp(key, "m") == 0) rank = 1;
+      else rank = 0;
+      if (rank > best_rank) {
+         best = value;
+         best_rank = rank;
+      }
+      key = strtok(NULL, " \t");
+   }
+   if (best == NULL)
+      return 0xff000000;
+   return _ToonParseColor(best);
+}
+
+/* Decode an XPM held as an array of strings (as from #include "x.xpm") */
+/* Returns 0 on success, 1 on a malformed image, 2 if out of memory */
+int _ToonDecodeXpm(char **xpm, _ToonImage *image)
+{
+   int width, height, ncolors, cpp;
+   int i, x, y, c, code, len;
+   unsigned int *colors, *lookup = NULL;
+   char **codes = NULL, *row;
+
+   image->pixels = NULL;
+   image->shared = 0;
+   if (sscanf(xpm[0], "%d %d %d %d", &width, &height, &ncolors, &cpp) != 4
+         || width <= 0 || height <= 0 || ncolors <= 0 || cpp <= 0)
+      return 1;
+
+   if ((colors = malloc(ncolors*sizeof(unsigned int))) == NULL)
+      return 2;
+   /* Codes of one or two characters index a table directly */
+   if (cpp <= 2) {
+      if ((lookup = malloc(65536*sizeof(unsigned int))) == NULL) {
+         free(colors);
+         return 2;
+      }
+      for (i=0; i<65536; i++) lookup[i] = 0xff000000;
+   }
+   else if ((codes = malloc(ncolors*sizeof(char *))) == NULL) {
+      free(colors);
+      return 2;
+   }
+
+   for (c=0; c<ncolors; c++) {
+      row = xpm[1+c];
+      if ((int) strlen(row) < cpp) break;
+      colors[c] = _ToonColorFromLine(row+cpp);
+      if (lookup) {
+         code = (unsigned char) row[0];
+         if (cpp == 2) code |= ((unsigned char) row[1])<<8;
+         lookup[code] = colors[c];
+      }
+      else {
+         codes[c] = row;
+      }
+   }
+
+   if (c < ncolors
+         || (image->pixels = malloc(width*height*sizeof(unsigned int))) == NULL) {
+      free(colors);
+      if (lookup) free(lookup);
+      if (codes) free(codes);
+      return c < ncolors ? 1 : 2;
+   }
+   image->width = width;
+   image->height = height;
+
+   for (y=0; y<height; y++) {
+      row = xpm[1+ncolors+y];
+      /* A short row is padded with transparent pixels */
+      len = strlen(row)/cpp;
+      for (x=0; x<width; x++, row+=cpp) {
+         if (x >= len) {
+            image->pixels[y*width+x] = _TOON_TRANSPARENT;
+         }
+         else if (lookup) {
+            code = (unsigned char) row[0];
+            if (cpp == 2) code |= ((unsigned char) row[1])<<8;
+            image->pixels[y*width+x] = lookup[code];
+         }
+         else {
+            for (c=0; c<ncolors; c++)
+               if (strncmp(codes[c], row, cpp) == 0) break;
+            image->pixels[y*width+x] = c<ncolors ? colors[c] : _TOON_TRANSPARENT;
+         }
+      }
+   }
+
+   free(colors);
+   if (lookup) free(lookup);
+   if (codes) free(codes);
+   return 0;
+}
+
+/* Release the pixels of a decoded image */
+void _ToonFreeImage(_ToonImage *image)
+{
+   if (image->pixels && !image->shared)
+      free(image->pixels);
+   image->pixels = NULL;
+   return;
+}
+
+/* Opaque spans: image_height+1 row offsets into the array, then for each
+   row its runs as (x, length) pairs */
+/* Returns the length of the table, or -1 if it will not fit */
+int _ToonMakeSpans(_ToonImage *image, unsigned short **spans)
+{
+   int x, y, start, n, size = image->height + 1;
+   unsigned int *row;
+   unsigned short *s;
+
+   /* At worst every other pixel starts a run */
+   size += image->height*(image->width+1);
+   if ((s = malloc(size*sizeof(unsigned short))) == NULL) return -1;
+   n = image->height + 1;
+   for (y=0; y<image->height; y++) {
+      s[y] = n;
+      row = image->pixels + y*image->width;
+      for (x=0; x<image->width; ) {
+         for (; x<image->width && !(row[x] & 0xff000000); x++);
+         if (x == image->width) break;
+         for (start = x; x<image->width && (row[x] & 0xff000000); x++);
+         s[n++] = start;
+         s[n++] = x - start;
+      }
+      if (n > 65535) {
+         free(s);
+         return -1;
+      }
+   }
+   s[image->height] = n;
+   *spans = s;
+   return n;
+}
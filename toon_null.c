@@ -0,0 +1,695 @@
+/* toon_null.c - headless display backend for toon.c
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The null backend never talks to an X server. The `windows' are a
+ * synthetic layout generated from a seed, or one recorded from a real
+ * desktop, and toons are drawn into an in-memory framebuffer that is only
+ * allocated if somebody asks for it with ToonNullFramebuffer(); frames
+ * can be streamed from it with ToonNullWriteFrame(). Regions are handled
+ * client-side by Xlib, so the collision code is exactly the same as with
+ * a real display.
+ *
+ * For request accounting the backend charges what the Xlib backend would
+ * have sent for the same work; keep the two in step when either changes. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "toonP.h"
+
+#define NULL_DEFAULTWIDTH 1280
+#define NULL_DEFAULTHEIGHT 1024
+#define NULL_DEFAULTWINDOWS 8
+#define NULL_BACKGROUND 0xff305080
+#define NULL_WINDOW 0xffd8d8d0
+#define NULL_TITLE 0xff506890
+#define NULL_TITLEHEIGHT 18
+
+typedef struct {
+   XRectangle pos;
+   int shaped;
+} _ToonNullWindow;
+
+TOON_LOCAL int null_width = NULL_DEFAULTWIDTH, null_height = NULL_DEFAULTHEIGHT;
+TOON_LOCAL int null_nwindows = NULL_DEFAULTWINDOWS;
+TOON_LOCAL int null_shaped = 0;
+TOON_LOCAL unsigned int null_seed = 1;
+TOON_LOCAL int null_moved = 0;
+TOON_LOCAL _ToonNullWindow *null_windows = NULL;
+TOON_LOCAL unsigned int *null_framebuffer = NULL;
+TOON_LOCAL unsigned int *null_desktop = NULL; /* what erasing uncovers */
+TOON_LOCAL _ToonImage *null_images = NULL;
+TOON_LOCAL int null_nimages = 0;
+TOON_LOCAL unsigned long null_requests = 0, null_round_trips = 0;
+TOON_LOCAL XRectangle *null_monitors = NULL;
+TOON_LOCAL int null_nmonitors = 0;
+TOON_LOCAL _ToonNullWindow *null_layout = NULL; /* from ToonNullReadLayout() */
+TOON_LOCAL unsigned char *null_frame = NULL; /* one frame, as written */
+TOON_LOCAL int null_streaming = 0; /* Y4M header written */
+TOON_LOCAL int null_pointer_x, null_pointer_y; /* from ToonNullPointer()... */
+TOON_LOCAL unsigned int null_pointer_buttons;
+TOON_LOCAL int null_pointer_moved = 0; /* ...not yet seen by the drain */
+
+/* INTERNAL FUNCTION PROTOTYPES */
+int _ToonNullOpenDisplay(char *display_name);
+int _ToonNullInstallData(ToonData *data, int n, int type);
+void _ToonNullFreeData(ToonData *data, int n, int type);
+void _ToonNullDraw(Toon *t);
+void _ToonNullErase(int x, int y, int width, int height);
+void _ToonNullFill(XRectangle *rects, int n, unsigned int colour);
+void _ToonNullFlush();
+int _ToonNullLocateWindows();
+int _ToonNullWindowsMoved();
+void _ToonNullPaintDesktop();
+void _ToonNullCountRequests(unsigned long *requests,
+      unsigned long *round_trips)
+{
+   *requests = null_requests;
+   *round_trips = null_round_trips;
+   return;
+}
+
+/* Synthetic windows only move when we are told, never while asleep */
+int _ToonNullWait(double timeout)
+{
+   struct timespec t;
+   if (null_moved) return 1;
+   t.tv_sec = (time_t) (timeout/1e9);
+   t.tv_nsec = (long) (timeout - t.tv_sec*1e9);
+   nanosleep(&t, NULL);
+   return 0;
+}
+
+void _ToonNullCloseDisplay();
+void _ToonNullCountRequests(unsigned long *requests,
+      unsigned long *round_trips);
+int _ToonNullWait(double timeout);
+
+ToonBackend toon_null_backend = {
+   "null",
+   _ToonNullOpenDisplay,
+   _ToonNullInstallData,
+   _ToonNullFreeData,
+   _ToonNullDraw,
+   _ToonNullErase,
+   _ToonNullFill,
+   _ToonNullDraw,
+   _ToonNullFlush,
+   _ToonNullLocateWindows,
+   _ToonNullWindowsMoved,
+   _ToonNullCloseDisplay,
+   _ToonNullCountRequests,
+   _ToonNullWait
+};
+
+/* Small private generator so that layouts do not depend on rand() */
+int _ToonNullRandom(int maxint)
+{
+   null_seed = null_seed*1103515245 + 12345;
+   return (int) (((null_seed>>8) & 0xffffff) % (unsigned int) maxint);
+}
+
+/* Scatter the synthetic windows over the screen, or put them where a
+   recorded layout says */
+void _ToonNullGenerate()
+{
+   int i, w, h;
+   if (null_windows) free(null_windows);
+   null_windows = NULL;
+   if (null_nwindows <= 0) return;
+   if ((null_windows = calloc(null_nwindows, sizeof(_ToonNullWindow)))
+         == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      _ToonExitGracefully(1);
+   }
+   if (null_layout) {
+      memcpy(null_windows, null_layout,
+            null_nwindows*sizeof(_ToonNullWindow));
+      return;
+   }
+   for (i=0; i<null_nwindows; i++) {
+      w = 80 + _ToonNullRandom(null_width/3 + 1);
+      h = 60 + _ToonNullRandom(null_height/3 + 1);
+      null_windows[i].pos.x = _ToonNullRandom(null_width - w/2);
+      null_windows[i].pos.y = 1 + _ToonNullRandom(null_height - h/2);
+      null_windows[i].pos.width = w;
+      null_windows[i].pos.height = h;
+      null_windows[i].shaped = null_shaped;
+   }
+   return;
+}
+
+/* Set the size of the synthetic screen and the number of windows on it;
+   `shaped' gives the windows rounded tops. Takes effect at the next
+   ToonOpenDisplay() */
+void ToonNullLayout(int width, int height, int nwindows, int shaped,
+      unsigned int seed)
+{
+   null_width = width;
+   null_height = height;
+   null_nwindows = nwindows;
+   null_shaped = shaped;
+   null_seed = seed;
+   if (null_layout) free(null_layout);
+   null_layout = NULL;
+   return;
+}
+
+/* Use the screen size and windows recorded by ToonNullSaveLayout() in
+   place of a synthetic layout, from the next ToonOpenDisplay(). The file
+   is a line `width height' and then `x y width height shaped' for each
+   window, bottom first; lines starting with # are ignored */
+/* Returns 0 on success, 1 on failure (see ToonErrorMessage()) */
+int ToonNullReadLayout(char *file)
+{
+   FILE *f;
+   char line[256];
+   int width = 0, height = 0, n = 0, allocated = 0, x, y, w, h, shaped;
+   _ToonNullWindow *layout = NULL, *grown;
+
+   if ((f = fopen(file, "r")) == NULL) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't read layout %s", file);
+      return 1;
+   }
+   while (fgets(line, sizeof(line), f)) {
+      if (line[0] == '#' || line[0] == '\n') continue;
+      if (width == 0) {
+         if (sscanf(line, "%d %d", &width, &height) != 2
+               || width <= 0 || height <= 0) {
+            width = 0;
+            break;
+         }
+         continue;
+      }
+      shaped = 0;
+      if (sscanf(line, "%d %d %d %d %d", &x, &y, &w, &h, &shaped) < 4
+            || w <= 0 || h <= 0) {
+         width = 0;
+         break;
+      }
+      if (n == allocated) {
+         allocated = allocated ? 2*allocated : 16;
+         if ((grown = realloc(layout, allocated*sizeof(_ToonNullWindow)))
+               == NULL) {
+            width = 0;
+            break;
+         }
+         layout = grown;
+      }
+      layout[n].pos.x = x;
+      layout[n].pos.y = y;
+      layout[n].pos.width = w;
+      layout[n].pos.height = h;
+      layout[n].shaped = shaped;
+      n++;
+   }
+   fclose(f);
+   if (width == 0) {
+      if (layout) free(layout);
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Bad layout in %s", file);
+      return 1;
+   }
+   if (null_layout) free(null_layout);
+   null_layout = layout;
+   null_width = width;
+   null_height = height;
+   null_nwindows = n;
+   null_shaped = 0;
+   for (x=0; x<n; x++)
+      if (layout[x].shaped) null_shaped = 1;
+   return 0;
+}
+
+/* Record the size of the screen and where the windows on it are, from
+   whichever backend is in use, for ToonNullReadLayout() */
+/* Only the windows toons can stand on are known to be anywhere, so those
+   that are not (popups, and windows off the screen or reaching its top)
+   are left out; a window is only recorded as shaped if it was found to
+   be with ToonConfigure(TOON_SHAPEDWINDOWS) */
+/* Returns 0 on success, 1 on failure (see ToonErrorMessage()) */
+int ToonNullSaveLayout(char *file)
+{
+   FILE *f;
+   int wx, ok;
+
+   if ((f = fopen(file, "w")) == NULL) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't write layout %s", file);
+      return 1;
+   }
+   fprintf(f, "# screen, then x y width height shaped of each window\n");
+   fprintf(f, "%d %d\n", display_width, display_height);
+   for (wx=0; wx<nwindows; wx++) {
+      if (!windata[wx].solid) continue;
+      fprintf(f, "%d %d %d %d %d\n", windata[wx].pos.x, windata[wx].pos.y,
+            windata[wx].pos.width, windata[wx].pos.height,
+            windata[wx].shaped);
+   }
+   ok = !ferror(f);
+   if (fclose(f) != 0 || !ok) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't write layout %s", file);
+      return 1;
+   }
+   return 0;
+}
+
+/* Put the pointer at (x, y) with `buttons' held down (bit n-1 for button
+   n), as if the user had moved it; ToonPointer() has it after the next
+   ToonWindowsMoved() */
+void ToonNullPointer(int x, int y, unsigned int buttons)
+{
+   null_pointer_x = x;
+   null_pointer_y = y;
+   null_pointer_buttons = buttons;
+   null_pointer_moved = 1;
+   return;
+}
+
+/* Nudge n of the synthetic windows, as if the user had moved them */
+void ToonNullMoveWindows(int n)
+{
+   int i, wx;
+   for (i=0; i<n && null_nwindows>0; i++) {
+      wx = _ToonNullRandom(null_nwindows);
+      null_windows[wx].pos.x += _ToonNullRandom(33) - 16;
+      null_windows[wx].pos.y += _ToonNullRandom(33) - 16;
+      if (null_windows[wx].pos.y < 1) null_windows[wx].pos.y = 1;
+      null_moved = 1;
+   }
+   return;
+}
+
+/* Lay the screen out as n monitors, which need not cover all of it; n = 0
+   makes it one monitor again. Once the display is open this looks to the
+   program like a change of layout */
+void ToonNullMonitors(XRectangle *rects, int n)
+{
+   if (null_monitors) free(null_monitors);
+   null_monitors = NULL;
+   null_nmonitors = 0;
+   if (n > 0 && (null_monitors = malloc(n*sizeof(XRectangle)))) {
+      memcpy(null_monitors, rects, n*sizeof(XRectangle));
+      null_nmonitors = n;
+   }
+   if (windows && _ToonSetMonitors(null_monitors, null_nmonitors))
+      null_moved = 1;
+   return;
+}
+
+/* Paint the desktop that erasing uncovers: the background with the
+   windows on top, bottom first, shaped ones with the same rounded tops
+   as their regions */
+void _ToonNullPaintDesktop()
+{
+   int i, wx, x, y, x0, x1, y0, y1, inset;
+   unsigned int colour, *dst;
+   XRectangle *pos;
+
+   for (i=0; i<display_width*display_height; i++)
+      null_desktop[i] = NULL_BACKGROUND;
+   for (wx=0; wx<null_nwindows; wx++) {
+      pos = &(null_windows[wx].pos);
+      x0 = pos->x < 0 ? 0 : pos->x;
+      y0 = pos->y < 0 ? 0 : pos->y;
+      x1 = pos->x + pos->width > display_width ? display_width
+            : pos->x + pos->width;
+      y1 = pos->y + pos->height > display_height ? display_height
+            : pos->y + pos->height;
+      for (y=y0; y<y1; y++) {
+         colour = y - pos->y < NULL_TITLEHEIGHT ? NULL_TITLE : NULL_WINDOW;
+         inset = shaped_windows && null_windows[wx].shaped
+               && y - pos->y < 4 ? 8 - 2*(y - pos->y) : 0;
+         dst = null_desktop + y*display_width;
+         for (x = x0 > pos->x+inset ? x0 : pos->x+inset;
+               x < x1 && x < pos->x + pos->width - inset; x++)
+            dst[x] = colour;
+      }
+   }
+   return;
+}
+
+/* Return the framebuffer (0xAARRGGBB, display_width*display_height),
+   allocating it on first use; until then drawing is a no-op */
+unsigned int *ToonNullFramebuffer()
+{
+   if (null_framebuffer == NULL && display_width > 0) {
+      null_framebuffer = malloc(display_width*display_height
+            *sizeof(unsigned int));
+      null_desktop = malloc(display_width*display_height
+            *sizeof(unsigned int));
+      if (null_framebuffer == NULL || null_desktop == NULL) {
+         if (null_framebuffer) free(null_framebuffer);
+         if (null_desktop) free(null_desktop);
+         null_framebuffer = null_desktop = NULL;
+         return NULL;
+      }
+      _ToonNullPaintDesktop();
+      memcpy(null_framebuffer, null_desktop,
+            display_width*display_height*sizeof(unsigned int));
+   }
+   return null_framebuffer;
+}
+
+/* Write the framebuffer to f as a binary PPM image, or as the next frame
+   of a YUV4MPEG2 stream (4:4:4, studio range) whose header goes out with
+   the first, for frames `frame_usec' microseconds apart; the alpha
+   channel is dropped */
+/* Returns 0 on success, 1 on failure (see ToonErrorMessage()) */
+int ToonNullWriteFrame(FILE *f, int format, unsigned long frame_usec)
+{
+   unsigned int pixel, *src;
+   int r, g, b, i, npixels = display_width*display_height;
+   unsigned char *y, *u, *v;
+
+   if (ToonNullFramebuffer() == NULL || (null_frame == NULL
+         && (null_frame = malloc(3*npixels)) == NULL)) {
+      strncpy(toon_error_message, "Out of memory", TOON_MESSAGE_LENGTH);
+      return 1;
+   }
+   src = null_framebuffer;
+   if (format == TOON_FRAME_PPM) {
+      fprintf(f, "P6\n%d %d\n255\n", display_width, display_height);
+      for (i=0, y=null_frame; i<npixels; i++, y+=3) {
+         pixel = src[i];
+         y[0] = pixel >> 16;
+         y[1] = pixel >> 8;
+         y[2] = pixel;
+      }
+   }
+   else {
+      if (!null_streaming) {
+         /* The rate as a ratio, exactly */
+         fprintf(f, "YUV4MPEG2 W%d H%d F1000000:%lu Ip A1:1 C444\n",
+               display_width, display_height, frame_usec);
+         null_streaming = 1;
+      }
+      fputs("FRAME\n", f);
+      y = null_frame;
+      u = y + npixels;
+      v = u + npixels;
+      for (i=0; i<npixels; i++) {
+         pixel = src[i];
+         r = (pixel >> 16) & 0xff;
+         g = (pixel >> 8) & 0xff;
+         b = pixel & 0xff;
+         y[i] = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+         u[i] = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+         v[i] = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+      }
+   }
+   if (fwrite(null_frame, 3*npixels, 1, f) != 1) {
+      strncpy(toon_error_message, "Can't write frame", TOON_MESSAGE_LENGTH);
+      return 1;
+   }
+   return 0;
+}
+
+int _ToonNullOpenDisplay(char *display_name)
+{
+   display_width = null_width;
+   display_height = null_height;
+   _ToonNullGenerate();
+   _ToonSetMonitors(null_monitors, null_nmonitors);
+   return 0;
+}
+
+/* Decode the XPM data so that the framebuffer can be drawn into; a
+   theme's pixels are used as they are */
+int _ToonNullInstallData(ToonData *data, int n, int type)
+{
+   int i;
+   if (null_nimages != n) {
+      if (null_images) {
+         for (i=0; i<null_nimages; i++)
+            _ToonFreeImage(null_images+i);
+         free(null_images);
+      }
+      null_nimages = 0;
+      if ((null_images = calloc(n, sizeof(_ToonImage))) == NULL)
+         return XpmNoMemory;
+      null_nimages = n;
+   }
+   data += type;
+   if (data->pixels) {
+      null_images[type].width = data->image_width;
+      null_images[type].height = data->image_height;
+      null_images[type].pixels = data->pixels;
+      null_images[type].shared = 1;
+      return 0;
+   }
+   return _ToonDecodeXpm(data->image, null_images+type);
+}
+
+void _ToonNullFreeData(ToonData *data, int n, int type)
+{
+   if (type < null_nimages)
+      _ToonFreeImage(null_images+type);
+   return;
+}
+
+void _ToonNullDraw(Toon *t)
+{
+   int x, y, x0, x1, y0, y1, sx, sy;
+   int width = toon_data[t->type].width;
+   int height = toon_data[t->type].height;
+   _ToonImage *image = null_images + t->type;
+   unsigned int *src, *dst, pixel;
+   unsigned short *spans, *run;
+   int a, b;
+
+   /* SetClipOrigin, SetClipMask, CopyArea, SetClipMask */
+   null_requests += 4;
+   if (null_framebuffer == NULL) return;
+
+   /* Clip to the screen and to the image */
+   sx = width*t->frame;
+   sy = height*t->direction;
+   x0 = t->x < 0 ? -t->x : 0;
+   y0 = t->y < 0 ? -t->y : 0;
+   x1 = t->x + width > display_width ? display_width - t->x : width;
+   y1 = t->y + height > display_height ? display_height - t->y : height;
+   if (sx + x1 > image->width) x1 = image->width - sx;
+   if (sy + y1 > image->height) y1 = image->height - sy;
+
+   /* With spritec's span table whole opaque runs are copied at once */
+   if ((spans = toon_data[t->type].spans)) {
+      for (y=y0; y<y1; y++) {
+         src = image->pixels + (sy+y)*image->width;
+         dst = null_framebuffer + (t->y+y)*display_width + t->x;
+         for (run = spans + spans[sy+y]; run < spans + spans[sy+y+1];
+               run += 2) {
+            a = run[0];
+            b = run[0] + run[1];
+            if (a >= sx+x1) break;
+            if (a < sx+x0) a = sx+x0;
+            if (b > sx+x1) b = sx+x1;
+            if (a < b)
+               memcpy(dst+a-sx, src+a, (b-a)*sizeof(unsigned int));
+         }
+      }
+      return;
+   }
+
+   for (y=y0; y<y1; y++) {
+      src = image->pixels + (sy+y)*image->width + sx;
+      dst = null_framebuffer + (t->y+y)*display_width + t->x;
+      x = x0;
+#ifdef __SSE2__
+      /* Four pixels at a time, keeping what is underneath wherever the
+         alpha is zero, just as the mask would */
+      for (; x+4<=x1; x+=4) {
+         __m128i s = _mm_loadu_si128((__m128i *) (src+x));
+         __m128i d = _mm_loadu_si128((__m128i *) (dst+x));
+         __m128i clear = _mm_cmpeq_epi32(_mm_srli_epi32(s, 24),
+               _mm_setzero_si128());
+         _mm_storeu_si128((__m128i *) (dst+x), _mm_or_si128(
+               _mm_and_si128(clear, d), _mm_andnot_si128(clear, s)));
+      }
+#endif
+      for (; x<x1; x++) {
+         pixel = src[x];
+         if (pixel & 0xff000000) dst[x] = pixel;
+      }
+   }
+   return;
+}
+
+void _ToonNullErase(int x, int y, int width, int height)
+{
+   int j, x1, y1;
+
+   /* ClearArea */
+   null_requests++;
+   if (null_framebuffer == NULL) return;
+
+   x1 = x + width > display_width ? display_width : x + width;
+   y1 = y + height > display_height ? display_height : y + height;
+   if (x < 0) x = 0;
+   if (y < 0) y = 0;
+   for (j=y; j<y1 && x<x1; j++)
+      memcpy(null_framebuffer + j*display_width + x,
+            null_desktop + j*display_width + x,
+            (x1-x)*sizeof(unsigned int));
+   return;
+}
+
+void _ToonNullFill(XRectangle *rects, int n, unsigned int colour)
+{
+   int i, j, k, x0, y0, x1, y1;
+   unsigned int pixel = 0xff000000 | colour, *dst;
+
+   /* SetForeground, FillRectangles */
+   null_requests += 2;
+   if (null_framebuffer == NULL) return;
+
+   for (i=0; i<n; i++) {
+      x0 = rects[i].x < 0 ? 0 : rects[i].x;
+      y0 = rects[i].y < 0 ? 0 : rects[i].y;
+      x1 = rects[i].x + rects[i].width;
+      y1 = rects[i].y + rects[i].height;
+      if (x1 > display_width) x1 = display_width;
+      if (y1 > display_height) y1 = display_height;
+      for (j=y0; j<y1; j++) {
+         dst = null_framebuffer + j*display_width;
+         for (k=x0; k<x1; k++)
+            dst[k] = pixel;
+      }
+   }
+   return;
+}
+
+void _ToonNullFlush()
+{
+   return;
+}
+
+/* Build the window region and table from the synthetic layout */
+int _ToonNullLocateWindows()
+{
+   int wx, step, inset;
+   XRectangle *window_rect, rect;
+
+   if ((int) nwindows < null_nwindows || windata == NULL) {
+      if (windata) free(windata);
+      if ((windata=calloc(null_nwindows+1, sizeof(_ToonWindowData))) == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         _ToonExitGracefully(1);
+      }
+   }
+   nwindows = null_nwindows;
+   /* QueryTree, then GetWindowAttributes and GetGeometry per window */
+   null_requests += 1 + 2*nwindows;
+   null_round_trips += 1 + 2*nwindows;
+
+   for (wx=0; wx<nwindows; wx++) {
+      window_rect = &(null_windows[wx].pos);
+      windata[wx].wid = wx+1;
+      windata[wx].solid = 0;
+      windata[wx].shaped = shaped_windows && null_windows[wx].shaped;
+      XUnionRectWithRegion(window_rect, covered, covered);
+      if (window_rect->x >= display_width) continue;
+      if (window_rect->y >= display_height) continue;
+      if (window_rect->y <= 0) continue;
+      if ((window_rect->x + window_rect->width) < 0) continue;
+      windata[wx].solid = 1;
+      windata[wx].pos = *window_rect;
+      if (shaped_windows) {
+         /* ShapeGetRectangles */
+         null_requests++;
+         null_round_trips++;
+      }
+
+      if (!shaped_windows || !null_windows[wx].shaped) {
+         XUnionRectWithRegion(window_rect, windows, windows);
+      }
+      else {
+         /* Round off the top corners with a staircase of rectangles,
+            as a shaped window manager frame would */
+         for (step=0; step<4; step++) {
+            inset = 8 - 2*step;
+            rect.x = window_rect->x + inset;
+            rect.y = window_rect->y + step;
+            rect.width = window_rect->width > 2*inset ?
+                  window_rect->width - 2*inset : 1;
+            rect.height = 1;
+            XUnionRectWithRegion(&rect, windows, windows);
+         }
+         rect = *window_rect;
+         rect.y += 4;
+         rect.height = rect.height > 4 ? rect.height - 4 : 1;
+         XUnionRectWithRegion(&rect, windows, windows);
+      }
+   }
+   /* What erasing uncovers has moved with the windows */
+   if (null_framebuffer) {
+      _ToonNullPaintDesktop();
+      memcpy(null_framebuffer, null_desktop,
+            display_width*display_height*sizeof(unsigned int));
+   }
+   return 0;
+}
+
+/* The pointer is heard of here, as it would be from the event queue */
+int _ToonNullWindowsMoved()
+{
+   int moved = null_moved;
+   null_moved = 0;
+   if (null_pointer_moved) {
+      pointer_x = null_pointer_x;
+      pointer_y = null_pointer_y;
+      pointer_buttons = null_pointer_buttons;
+      pointer_known = 1;
+      null_pointer_moved = 0;
+   }
+   return moved;
+}
+
+void _ToonNullCloseDisplay()
+{
+   int i;
+   if (null_framebuffer) {
+      free(null_framebuffer);
+      free(null_desktop);
+      null_framebuffer = null_desktop = NULL;
+   }
+   if (null_frame) {
+      free(null_frame);
+      null_frame = NULL;
+   }
+   null_streaming = 0;
+   if (null_images) {
+      for (i=0; i<null_nimages; i++)
+         _ToonFreeImage(null_images+i);
+      free(null_images);
+      null_images = NULL;
+      null_nimages = 0;
+   }
+   if (null_windows) {
+      free(null_windows);
+      null_windows = NULL;
+   }
+   return;
+}
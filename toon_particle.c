@@ -0,0 +1,420 @@
+/* toon_particle.c - sparks and dust for explosions and landings
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Particles are kept as a structure of arrays, with position, velocity
+ * and life each in an array of its own, so that ToonAdvanceParticles()
+ * moves four at a time with SSE2 where the compiler has it. They are
+ * drawn as small filled squares, all those of one colour with a single
+ * fill (one XFillRectangles under Xlib), and erased by the cells of a
+ * coarse grid they were drawn in, as few rectangles as the cells allow,
+ * so the requests a frame depend on the area the particles cover and not
+ * on how many there are. Like the toons they are drawn on the root
+ * window, behind every window, and they pass through windows rather
+ * than bounce off them. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "toonP.h"
+
+#define PARTICLE_MAX 65536 /* alive at once, more are not made */
+#define PARTICLE_COLOURS 16 /* distinct colours alive at once */
+#define PARTICLE_SIZE 2 /* pixels square, before scaling */
+
+TOON_LOCAL float *particle_x = NULL, *particle_y = NULL;
+TOON_LOCAL float *particle_u = NULL, *particle_v = NULL;
+TOON_LOCAL float *particle_life = NULL; /* left, in the units of dt */
+TOON_LOCAL unsigned char *particle_colour = NULL; /* into the palette */
+TOON_LOCAL int nparticles = 0, particles_size = 0;
+TOON_LOCAL unsigned int particle_palette[PARTICLE_COLOURS];
+TOON_LOCAL int particle_ncolours = 0;
+TOON_LOCAL float particle_gravity = 0.0; /* as given, in pixels */
+TOON_LOCAL unsigned int particle_seed = 1;
+TOON_LOCAL XRectangle *particle_rects = NULL; /* sorted by colour */
+TOON_LOCAL int particle_rects_size = 0;
+TOON_LOCAL _ToonCells particle_cells = { NULL, 0, 0, 0, 0, NULL, 0 };
+
+/* Velocities are in the units of ToonSetVelocity(): fixed-point pixels a
+   second with ToonSetTimeStep(), otherwise pixels a frame */
+static float _ToonParticleUnit()
+{
+   return time_step > 0.0 ? 1.0/TOON_SUBPIXELS : 1.0;
+}
+
+/* Small private generator, so that bursts do not depend on rand() */
+static float _ToonParticleRandom()
+{
+   particle_seed = particle_seed*1103515245 + 12345;
+   return ((particle_seed>>8) & 0xffffff)/16777216.0;
+}
+
+/* Make room for n particles */
+/* Returns 0 on success, 1 if out of memory */
+static int _ToonParticleReserve(int n)
+{
+   float **arrays[5], *p;
+   unsigned char *colour;
+   int i;
+
+   if (n <= particles_size) return 0;
+   n = n > 2*particles_size ? n : 2*particles_size;
+   arrays[0] = &particle_x;
+   arrays[1] = &particle_y;
+   arrays[2] = &particle_u;
+   arrays[3] = &particle_v;
+   arrays[4] = &particle_life;
+   for (i=0; i<5; i++) {
+      if ((p = realloc(*arrays[i], n*sizeof(float))) == NULL)
+         return 1;
+      *arrays[i] = p;
+   }
+   if ((colour = realloc(particle_colour, n)) == NULL)
+      return 1;
+   particle_colour = colour;
+   particles_size = n;
+   return 0;
+}
+
+/* The palette entry for a colour, taking the nearest if it is full */
+static int _ToonParticleColour(unsigned int colour)
+{
+   int i, shift, best = 0, d, best_d = 0x7fffffff;
+   colour &= 0xffffff;
+   /* Nothing refers to the old colours any more */
+   if (nparticles == 0)
+      particle_ncolours = 0;
+   for (i=0; i<particle_ncolours; i++) {
+      if (particle_palette[i] == colour)
+         return i;
+      for (shift=0, d=0; shift<24; shift+=8)
+         d += abs((int) ((particle_palette[i]>>shift) & 0xff)
+               - (int) ((colour>>shift) & 0xff));
+      if (d < best_d) {
+         best_d = d;
+         best = i;
+      }
+   }
+   if (particle_ncolours == PARTICLE_COLOURS)
+      return best;
+   particle_palette[particle_ncolours] = colour;
+   return particle_ncolours++;
+}
+
+/* Set the pull on the particles, downwards, in the units of
+   ToonSetVelocity() gained each second (or each frame) */
+void ToonSetParticleGravity(int gravity)
+{
+   particle_gravity = gravity;
+   return;
+}
+
+/* Throw n particles of colour 0xRRGGBB out from (x, y) in every direction,
+   at up to `speed' in the units of ToonSetVelocity(), to live for up to
+   `life' frames of animation */
+/* Returns the number of particles made, fewer than n if there are too
+   many already */
+int ToonBurst(int x, int y, int n, int speed, int life, unsigned int colour)
+{
+   int i, c;
+   float unit = _ToonParticleUnit(), s, angle;
+   /* Lives are counted in the units time is stepped in */
+   float lifetime = time_step > 0.0 ? life/frame_rate : life;
+
+   if (n > PARTICLE_MAX - nparticles)
+      n = PARTICLE_MAX - nparticles;
+   if (n <= 0 || life <= 0) return 0;
+   if (_ToonParticleReserve(nparticles + n)) {
+      fprintf(stderr,"Error: Out of memory\n");
+      _ToonExitGracefully(1);
+   }
+   c = _ToonParticleColour(colour);
+   for (i=nparticles; i<nparticles+n; i++) {
+      angle = 2*M_PI*_ToonParticleRandom();
+      s = speed*unit*(0.25 + 0.75*_ToonParticleRandom());
+      particle_x[i] = x;
+      particle_y[i] = y;
+      particle_u[i] = s*cosf(angle);
+      particle_v[i] = s*sinf(angle);
+      particle_life[i] = lifetime*(0.5 + 0.5*_ToonParticleRandom());
+      particle_colour[i] = c;
+   }
+   nparticles += n;
+   return n;
+}
+
+/* Move every particle on by a frame, and let go of those that have died
+   or fallen off the bottom of the screen */
+/* Returns the number still alive */
+int ToonAdvanceParticles()
+{
+   int i = 0, n;
+   float dt = time_step > 0.0 ? time_step : 1.0;
+   float g = particle_gravity*_ToonParticleUnit()*dt;
+#ifdef __SSE2__
+   __m128 t4 = _mm_set1_ps(dt), g4 = _mm_set1_ps(g), v4;
+   for (; i+4<=nparticles; i+=4) {
+      v4 = _mm_add_ps(_mm_loadu_ps(particle_v+i), g4);
+      _mm_storeu_ps(particle_x+i, _mm_add_ps(_mm_loadu_ps(particle_x+i),
+            _mm_mul_ps(_mm_loadu_ps(particle_u+i), t4)));
+      _mm_storeu_ps(particle_y+i, _mm_add_ps(_mm_loadu_ps(particle_y+i),
+            _mm_mul_ps(v4, t4)));
+      _mm_storeu_ps(particle_v+i, v4);
+      _mm_storeu_ps(particle_life+i,
+            _mm_sub_ps(_mm_loadu_ps(particle_life+i), t4));
+   }
+#endif
+   for (; i<nparticles; i++) {
+      particle_v[i] += g;
+      particle_x[i] += particle_u[i]*dt;
+      particle_y[i] += particle_v[i]*dt;
+      particle_life[i] -= dt;
+   }
+   for (i=n=0; i<nparticles; i++) {
+      if (particle_life[i] <= 0 || particle_y[i] >= display_height)
+         continue;
+      if (n != i) {
+         particle_x[n] = particle_x[i];
+         particle_y[n] = particle_y[i];
+         particle_u[n] = particle_u[i];
+         particle_v[n] = particle_v[i];
+         particle_life[n] = particle_life[i];
+         particle_colour[n] = particle_colour[i];
+      }
+      n++;
+   }
+   nparticles = n;
+   return n;
+}
+
+/* Return the number of particles alive */
+int ToonParticles()
+{
+   return nparticles;
+}
+
+/* Draw every particle, one fill for each colour */
+/* Returns the number drawn */
+int ToonDrawParticles()
+{
+   int i, c, x, y, size, ndrawn = 0;
+   int start[PARTICLE_COLOURS+1], end[PARTICLE_COLOURS];
+   unsigned long req, rt;
+   XRectangle *rect;
+
+   if (nparticles == 0) return 0;
+   if (nparticles > particle_rects_size) {
+      particle_rects_size = nparticles;
+      if ((particle_rects = realloc(particle_rects,
+            particle_rects_size*sizeof(XRectangle))) == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         _ToonExitGracefully(1);
+      }
+   }
+   size = (int) (PARTICLE_SIZE*toon_scale + 0.5);
+   if (size < 1) size = 1;
+
+   /* Sort them by colour as they go in, leaving out those off the screen */
+   memset(start, 0, sizeof(start));
+   for (i=0; i<nparticles; i++)
+      start[particle_colour[i]+1]++;
+   for (c=0; c<particle_ncolours; c++) {
+      start[c+1] += start[c];
+      end[c] = start[c];
+   }
+   for (i=0; i<nparticles; i++) {
+      x = (int) particle_x[i];
+      y = (int) particle_y[i];
+      if (x + size <= 0 || x >= display_width || y + size <= 0
+            || y >= display_height)
+         continue;
+      rect = particle_rects + end[particle_colour[i]]++;
+      rect->x = x;
+      rect->y = y;
+      rect->width = rect->height = size;
+      _ToonCellsMark(&particle_cells, x, y, size, size);
+   }
+   toon_backend->count_requests(&req, &rt);
+   for (c=0; c<particle_ncolours; c++) {
+      if (end[c] > start[c])
+         toon_backend->fill(particle_rects+start[c], end[c]-start[c],
+               particle_palette[c]);
+      ndrawn += end[c]-start[c];
+   }
+   _ToonAccount(TOON_CALL_DRAW, req, rt);
+   return ndrawn;
+}
+
+/* Erase the particles drawn by the last ToonDrawParticles(), wherever
+   they have got to since */
+/* Returns the number of rectangles cleared */
+int ToonEraseParticles()
+{
+   int i, n;
+   unsigned long req, rt;
+   XRectangle *r;
+
+   toon_backend->count_requests(&req, &rt);
+   n = _ToonCellsRuns(&particle_cells);
+   for (i=0, r=particle_cells.runs; i<n; i++, r++)
+      toon_backend->erase(r->x, r->y, r->width, r->height);
+   _ToonAccount(TOON_CALL_ERASE, req, rt);
+   return n;
+}
+
+/* Clear the particles from the screen and let them all go, as the
+   display closes */
+void _ToonParticlesClose()
+{
+   ToonEraseParticles();
+   _ToonCellsFree(&particle_cells);
+   free(particle_x);
+   free(particle_y);
+   free(particle_u);
+   free(particle_v);
+   free(particle_life);
+   free(particle_colour);
+   free(particle_rects);
+   particle_x = particle_y = particle_u = particle_v = particle_life = NULL;
+   particle_colour = NULL;
+   particle_rects = NULL;
+   nparticles = particles_size = particle_rects_size = 0;
+   particle_ncolours = 0;
+   return;
+}
+
+/* CELLS */
+
+/* Grow the grid to at least `columns' by `rows' cells, keeping the marks */
+static void _ToonCellsGrow(_ToonCells *cells, int columns, int rows)
+{
+   unsigned char *marks;
+   int j;
+
+   if (columns < cells->columns) columns = cells->columns;
+   if (rows < cells->rows) rows = cells->rows;
+   if ((marks = calloc(columns*rows, 1)) == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      _ToonExitGracefully(1);
+   }
+   for (j=cells->top; j<cells->bottom; j++)
+      memcpy(marks + j*columns, cells->marks + j*cells->columns,
+            cells->columns);
+   free(cells->marks);
+   cells->marks = marks;
+   cells->columns = columns;
+   cells->rows = rows;
+   return;
+}
+
+/* Note that a rectangle has been drawn in, for _ToonCellsRuns() to clear.
+   The grid grows to take whatever is drawn, it needn't know the size of
+   the screen */
+void _ToonCellsMark(_ToonCells *cells, int x, int y, int width, int height)
+{
+   int i, j, x0, y0, x1, y1;
+
+   if (x + width <= 0 || y + height <= 0 || width <= 0 || height <= 0)
+      return;
+   x0 = x < 0 ? 0 : x/TOON_CELL;
+   y0 = y < 0 ? 0 : y/TOON_CELL;
+   x1 = (x + width - 1)/TOON_CELL;
+   y1 = (y + height - 1)/TOON_CELL;
+   if (x1 >= cells->columns || y1 >= cells->rows)
+      _ToonCellsGrow(cells, x1+1, y1+1);
+   for (j=y0; j<=y1; j++)
+      for (i=x0; i<=x1; i++)
+         cells->marks[j*cells->columns + i] = 1;
+   if (cells->top >= cells->bottom) {
+      cells->top = y0;
+      cells->bottom = y1+1;
+   }
+   if (y0 < cells->top) cells->top = y0;
+   if (y1 >= cells->bottom) cells->bottom = y1+1;
+   return;
+}
+
+/* Cover the marked cells with rectangles, in cells->runs: the runs of
+   marked cells along each row, each joined to the run of the row above if
+   it spans the same columns. The marks are cleared */
+/* Returns the number of rectangles */
+int _ToonCellsRuns(_ToonCells *cells)
+{
+   int i, j, k, m, n = 0, above_end = 0, keep;
+   unsigned char *row;
+   XRectangle *r, swap;
+
+   /* The runs reaching down to the row before are kept at the front, in
+      runs[0..above_end]: only they can be carried on by this row's runs */
+   for (j=cells->top; j<cells->bottom; j++) {
+      row = cells->marks + j*cells->columns;
+      keep = 0;
+      for (i=0; i<cells->columns; i++) {
+         if (!row[i]) continue;
+         for (k=i; k<cells->columns && row[k]; k++)
+            row[k] = 0;
+         for (r=cells->runs+keep; r<cells->runs+above_end; r++)
+            if (r->x == i*TOON_CELL && r->width == (k-i)*TOON_CELL)
+               break;
+         if (r < cells->runs+above_end) {
+            /* Carried on: to the front, after the others carried on */
+            r->height += TOON_CELL;
+            swap = *r;
+            *r = cells->runs[keep];
+            cells->runs[keep++] = swap;
+         }
+         else {
+            if (n == cells->runs_size) {
+               cells->runs_size = cells->runs_size ? 2*cells->runs_size : 16;
+               if ((cells->runs = realloc(cells->runs,
+                     cells->runs_size*sizeof(XRectangle))) == NULL) {
+                  fprintf(stderr,"Error: Out of memory\n");
+                  _ToonExitGracefully(1);
+               }
+            }
+            r = cells->runs + n++;
+            r->x = i*TOON_CELL;
+            r->y = j*TOON_CELL;
+            r->width = (k-i)*TOON_CELL;
+            r->height = TOON_CELL;
+         }
+         i = k;
+      }
+      /* Those that stopped at the row before go behind the new ones */
+      for (m=above_end; m<n; m++) {
+         swap = cells->runs[m];
+         cells->runs[m] = cells->runs[keep + m - above_end];
+         cells->runs[keep + m - above_end] = swap;
+      }
+      above_end = keep + n - above_end;
+   }
+   cells->top = cells->bottom = 0;
+   return n;
+}
+
+void _ToonCellsFree(_ToonCells *cells)
+{
+   if (cells->marks) free(cells->marks);
+   if (cells->runs) free(cells->runs);
+   memset(cells, 0, sizeof(_ToonCells));
+   return;
+}
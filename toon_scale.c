@@ -0,0 +1,320 @@
+/* toon_scale.c - enlarging the toon images for high resolution screens
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The images were drawn for a screen of about TOON_DPI dots per inch. On
+ * anything finer ToonInstallData() installs a scaled copy of the table
+ * instead, made once from the decoded pixels and kept in a cache shared
+ * by every thread, so that two displays at the same scale (or the same
+ * display with the theme put back) use the same copy. Each frame of the
+ * image is scaled on its own, so that filtering never bleeds one frame
+ * into the next. The copy has the scaled width and height, and so the
+ * toons collide with the windows at their scaled size; nothing is done
+ * per frame. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "toonP.h"
+
+#define SCALE_MAX 16.0
+
+/* A scaled copy of a table of n images */
+typedef struct _ToonScaled {
+   ToonData *source;
+   int n, filter;
+   double scale;
+   ToonData *data;
+   struct _ToonScaled *next;
+} _ToonScaled;
+
+/* Shared by every thread */
+_ToonScaled *toon_scaled = NULL;
+pthread_mutex_t toon_scaled_lock = PTHREAD_MUTEX_INITIALIZER;
+
+TOON_LOCAL double scale_wanted = 1.0; /* 0 to follow the display */
+TOON_LOCAL int scale_filter = TOON_SCALENEAREST;
+TOON_LOCAL double toon_scale = 1.0;
+TOON_LOCAL char scale_warned = 0;
+
+/* Enlarge the images by `scale' from the next ToonInstallData(), or by
+   whatever suits the display's resolution if scale is TOON_SCALEAUTO.
+   With TOON_SCALENEAREST the scale is rounded to a whole number and each
+   pixel repeated; TOON_SCALEFILTERED takes any scale and interpolates */
+void ToonSetScale(double scale, int filter)
+{
+   scale_wanted = scale < 0 ? 1.0 : (scale > SCALE_MAX ? SCALE_MAX : scale);
+   scale_filter = filter;
+   return;
+}
+
+/* Return the scale of the images installed by ToonInstallData(), so that
+   a program can scale its speeds and distances to match */
+double ToonScale()
+{
+   return toon_scale;
+}
+
+/* The resolution of the display in dots per inch: as set for the desktop
+   in the Xft.dpi resource if it is, else from the screen's size */
+double _ToonDisplayDPI()
+{
+   char *resources, *p;
+   double dpi;
+
+   if (display == NULL)
+      return TOON_DPI;
+   if ((resources = XResourceManagerString(display))
+         && (p = strstr(resources, "Xft.dpi:"))
+         && (dpi = atof(p + strlen("Xft.dpi:"))) > 0)
+      return dpi;
+   if (DisplayWidthMM(display, screen) <= 0)
+      return TOON_DPI;
+   return DisplayWidth(display, screen)*25.4/DisplayWidthMM(display, screen);
+}
+
+/* The scale to install at: a whole number for TOON_SCALENEAREST, else a
+   multiple of a quarter, and never smaller than the images unless asked.
+   A scaled copy has only decoded pixels, which only a TrueColor visual
+   can draw (see _ToonXPutPixels()), so on any other it is always 1 */
+double _ToonScaleFor()
+{
+   double scale = scale_wanted;
+   if (display && DefaultVisual(display, screen)->class != TrueColor) {
+      if (scale != 1.0 && scale != TOON_SCALEAUTO && !scale_warned) {
+         fprintf(stderr, "Warning: can't scale the images without a "
+               "TrueColor visual\n");
+         scale_warned = 1;
+      }
+      return 1.0;
+   }
+   if (scale == TOON_SCALEAUTO) {
+      scale = _ToonDisplayDPI()/TOON_DPI;
+      if (scale < 1.0) scale = 1.0;
+   }
+   if (scale_filter == TOON_SCALENEAREST)
+      scale = (int) (scale + 0.5);
+   else
+      scale = (int) (scale*4 + 0.5)/4.0;
+   return scale < 0.25 ? 0.25 : scale;
+}
+
+/* Interpolate a premultiplied pixel of one frame at (x, y) in its own
+   pixels, keeping within the frame */
+unsigned int _ToonSample(unsigned int *frame, int stride, int width,
+      int height, double x, double y)
+{
+   int x0, y0, x1, y1, shift;
+   double fx, fy, top, bottom;
+   unsigned int p00, p01, p10, p11, result = 0;
+
+   if (x < 0) x = 0;
+   if (y < 0) y = 0;
+   if (x > width-1) x = width-1;
+   if (y > height-1) y = height-1;
+   x0 = (int) x;
+   y0 = (int) y;
+   x1 = x0 < width-1 ? x0+1 : x0;
+   y1 = y0 < height-1 ? y0+1 : y0;
+   fx = x - x0;
+   fy = y - y0;
+   p00 = frame[y0*stride + x0];
+   p01 = frame[y0*stride + x1];
+   p10 = frame[y1*stride + x0];
+   p11 = frame[y1*stride + x1];
+   for (shift=0; shift<32; shift+=8) {
+      top = ((p00>>shift) & 0xff)*(1-fx) + ((p01>>shift) & 0xff)*fx;
+      bottom = ((p10>>shift) & 0xff)*(1-fx) + ((p11>>shift) & 0xff)*fx;
+      result |= ((unsigned int) (top*(1-fy) + bottom*fy + 0.5)) << shift;
+   }
+   return result;
+}
+
+/* One channel of a premultiplied pixel of alpha a, as it would be opaque */
+unsigned int _ToonUnmultiply(unsigned int channel, unsigned int a)
+{
+   channel = (channel & 0xff)*255/a;
+   return channel > 255 ? 255 : channel;
+}
+
+/* Scale one frame, from `width' by `height' pixels to `w' by `h'. The
+   mask stays 1-bit: a filtered pixel at least half covered is opaque,
+   with its colour taken back out of premultiplied form */
+void _ToonScaleFrame(unsigned int *src, int src_stride, int width,
+      int height, unsigned int *dst, int dst_stride, int w, int h,
+      int filter)
+{
+   int x, y;
+   unsigned int p, a;
+
+   for (y=0; y<h; y++) {
+      for (x=0; x<w; x++) {
+         if (filter == TOON_SCALENEAREST) {
+            dst[y*dst_stride + x] = src[(y*height/h)*src_stride
+                  + x*width/w];
+            continue;
+         }
+         p = _ToonSample(src, src_stride, width, height,
+               (x + 0.5)*width/w - 0.5, (y + 0.5)*height/h - 0.5);
+         a = p >> 24;
+         if (a < 128)
+            p = 0;
+         else if (a < 255)
+            p = 0xff000000 | _ToonUnmultiply(p>>16, a) << 16
+                  | _ToonUnmultiply(p>>8, a) << 8 | _ToonUnmultiply(p, a);
+         dst[y*dst_stride + x] = p;
+      }
+   }
+   return;
+}
+
+/* Make the scaled copy of one entry, pixels, mask and spans */
+/* Returns 0 on success, 1 if out of memory or the image is unreadable */
+int _ToonScaleEntry(ToonData *from, ToonData *to, double scale, int filter)
+{
+   _ToonImage image, scaled;
+   int columns, rows, c, r, w, h;
+
+   memcpy(to, from, sizeof(ToonData));
+   to->image = NULL; /* only the pixels are scaled */
+   to->pixmap = to->mask = None;
+   to->colors = NULL;
+   to->ncolors = 0;
+   to->pixels = NULL;
+   to->mask_bits = NULL;
+   to->spans = NULL;
+
+   if (from->pixels) {
+      image.pixels = from->pixels;
+      image.width = from->image_width;
+      image.height = from->image_height;
+      image.shared = 1;
+   }
+   else if (from->image == NULL || _ToonDecodeXpm(from->image, &image))
+      return 1;
+   columns = image.width/from->width;
+   rows = image.height/from->height;
+   w = (int) (from->width*scale + 0.5);
+   h = (int) (from->height*scale + 0.5);
+   if (w < 1) w = 1;
+   if (h < 1) h = 1;
+
+   scaled.width = w*columns;
+   scaled.height = h*rows;
+   scaled.shared = 0;
+   if ((scaled.pixels = calloc(scaled.width*scaled.height,
+         sizeof(unsigned int))) == NULL
+         || (to->mask_bits = malloc(((scaled.width+7)/8)*scaled.height))
+         == NULL) {
+      _ToonFreeImage(&image);
+      _ToonFreeImage(&scaled);
+      return 1;
+   }
+   for (r=0; r<rows; r++)
+      for (c=0; c<columns; c++)
+         _ToonScaleFrame(image.pixels + r*from->height*image.width
+               + c*from->width, image.width, from->width, from->height,
+               scaled.pixels + r*h*scaled.width + c*w, scaled.width, w, h,
+               filter);
+   _ToonFreeImage(&image);
+   _ToonPremultiply(&scaled, to->mask_bits);
+   /* Too big for a span table is fine: the backends do without */
+   if (_ToonMakeSpans(&scaled, &(to->spans)) < 0)
+      to->spans = NULL;
+
+   to->pixels = scaled.pixels;
+   to->width = w;
+   to->height = h;
+   to->image_width = scaled.width;
+   to->image_height = scaled.height;
+   return 0;
+}
+
+void _ToonFreeScaledData(ToonData *data, int n)
+{
+   int i;
+   for (i=0; i<n; i++) {
+      if (data[i].pixels) free(data[i].pixels);
+      if (data[i].mask_bits) free(data[i].mask_bits);
+      if (data[i].spans) free(data[i].spans);
+   }
+   free(data);
+   return;
+}
+
+/* Find the copy of a table at a scale, making it if there is none yet */
+/* Returns the scaled table, or NULL if out of memory */
+ToonData *_ToonScaleData(ToonData *data, int n, double scale, int filter)
+{
+   _ToonScaled *s;
+   ToonData *copy;
+   int i;
+
+   /* Held while scaling, so each copy is only ever made once */
+   pthread_mutex_lock(&toon_scaled_lock);
+   for (s = toon_scaled; s; s = s->next) {
+      if (s->source == data && s->n == n && s->scale == scale
+            && s->filter == filter) {
+         pthread_mutex_unlock(&toon_scaled_lock);
+         return s->data;
+      }
+   }
+   if ((copy = calloc(n, sizeof(ToonData))) == NULL
+         || (s = malloc(sizeof(_ToonScaled))) == NULL) {
+      if (copy) free(copy);
+      pthread_mutex_unlock(&toon_scaled_lock);
+      return NULL;
+   }
+   for (i=0; i<n; i++) {
+      if (_ToonScaleEntry(data+i, copy+i, scale, filter)) {
+         _ToonFreeScaledData(copy, i+1);
+         free(s);
+         pthread_mutex_unlock(&toon_scaled_lock);
+         return NULL;
+      }
+   }
+   s->source = data;
+   s->n = n;
+   s->scale = scale;
+   s->filter = filter;
+   s->data = copy;
+   s->next = toon_scaled;
+   toon_scaled = s;
+   pthread_mutex_unlock(&toon_scaled_lock);
+   return copy;
+}
+
+/* Drop the copies of a table that is about to go, at every scale */
+void _ToonScaleForget(ToonData *data)
+{
+   _ToonScaled **s, *gone;
+   pthread_mutex_lock(&toon_scaled_lock);
+   for (s = &toon_scaled; *s; ) {
+      if ((*s)->source == data) {
+         gone = *s;
+         *s = gone->next;
+         _ToonFreeScaledData(gone->data, gone->n);
+         free(gone);
+      }
+      else
+         s = &((*s)->next);
+   }
+   pthread_mutex_unlock(&toon_scaled_lock);
+   return;
+}
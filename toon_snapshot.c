@@ -0,0 +1,182 @@
+/* toon_snapshot.c - saving and restoring the state of a toon program
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Lets a restarted program carry on where the last one left off. A
+ * snapshot holds the toons, the window table they were last associated
+ * against and whatever else the program wants kept, as one block of
+ * its own. It is only good for the same build on a screen of the same
+ * size with the same number of types: anything else is refused, and the
+ * program starts afresh. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "toonP.h"
+
+#define SNAPSHOT_MAGIC "XTOONSNP"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+   char magic[8];
+   unsigned int version;
+   unsigned int toon_size, window_size; /* sizeof each, for this build */
+   int ntoons, nwindows, ntypes;
+   int display_width, display_height;
+   unsigned int state_size;
+} _ToonSnapshotHeader;
+
+/* Write the toons, the window table and `size' bytes of the program's
+   own state to a file, replacing it in one go */
+/* Returns 0 on success, 1 on failure (see ToonErrorMessage()) */
+int ToonSnapshotSave(char *file, Toon *toon, int n, void *state, size_t size)
+{
+   _ToonSnapshotHeader header;
+   char tmp[PATH_MAX];
+   FILE *f;
+   int ok;
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+   header.version = SNAPSHOT_VERSION;
+   header.toon_size = sizeof(Toon);
+   header.window_size = sizeof(_ToonWindowData);
+   header.ntoons = n;
+   header.nwindows = nwindows;
+   header.ntypes = toon_ntypes;
+   header.display_width = display_width;
+   header.display_height = display_height;
+   header.state_size = size;
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+   if ((f = fopen(tmp, "w")) == NULL) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't write snapshot %s", file);
+      return 1;
+   }
+   ok = fwrite(&header, sizeof(header), 1, f) == 1
+         && (n == 0 || fwrite(toon, sizeof(Toon), n, f) == n)
+         && (nwindows == 0 || fwrite(windata, sizeof(_ToonWindowData),
+               nwindows, f) == nwindows)
+         && (size == 0 || fwrite(state, size, 1, f) == 1);
+   if (fclose(f) != 0 || !ok || rename(tmp, file) != 0) {
+      unlink(tmp);
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't write snapshot %s", file);
+      return 1;
+   }
+   return 0;
+}
+
+/* Read a snapshot made by ToonSnapshotSave() on this display. The window
+   table becomes the one the toons were last associated against, so the
+   first ToonCalculateAssociations() carries them along with any windows
+   that moved while nobody was watching. The toons count as not yet drawn */
+/* Returns the toons, *n of them, and the program's state, *size bytes,
+   both to be freed by the caller; or NULL if there is no usable snapshot
+   (see ToonErrorMessage()) */
+Toon *ToonSnapshotLoad(char *file, int *n, void **state, size_t *size)
+{
+   _ToonSnapshotHeader *header;
+   struct stat st;
+   char *map, *p;
+   Toon *toon = NULL;
+   _ToonWindowData *table = NULL;
+   void *copy = NULL;
+   int fd, i;
+
+   if ((fd = open(file, O_RDONLY)) < 0) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't read snapshot %s", file);
+      return NULL;
+   }
+   if (fstat(fd, &st) < 0 || st.st_size < sizeof(_ToonSnapshotHeader)
+         || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+         == MAP_FAILED) {
+      close(fd);
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't read snapshot %s", file);
+      return NULL;
+   }
+   close(fd);
+
+   header = (_ToonSnapshotHeader *) map;
+   if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+         || header->version != SNAPSHOT_VERSION
+         || header->toon_size != sizeof(Toon)
+         || header->window_size != sizeof(_ToonWindowData)
+         || header->ntoons < 0 || header->nwindows < 0
+         || st.st_size != sizeof(_ToonSnapshotHeader)
+               + (off_t) header->ntoons*sizeof(Toon)
+               + (off_t) header->nwindows*sizeof(_ToonWindowData)
+               + header->state_size) {
+      strncpy(toon_error_message, "Snapshot is from another version",
+            TOON_MESSAGE_LENGTH);
+      munmap(map, st.st_size);
+      return NULL;
+   }
+   if (header->ntypes != toon_ntypes
+         || header->display_width != display_width
+         || header->display_height != display_height) {
+      strncpy(toon_error_message, "Snapshot is of another screen or theme",
+            TOON_MESSAGE_LENGTH);
+      munmap(map, st.st_size);
+      return NULL;
+   }
+
+   if ((toon = malloc((header->ntoons ? header->ntoons : 1)*sizeof(Toon)))
+         == NULL
+         || (header->nwindows
+            && (table = malloc(header->nwindows*sizeof(_ToonWindowData)))
+            == NULL)
+         || (header->state_size
+            && (copy = malloc(header->state_size)) == NULL)) {
+      if (toon) free(toon);
+      if (table) free(table);
+      munmap(map, st.st_size);
+      strncpy(toon_error_message, "Out of memory", TOON_MESSAGE_LENGTH);
+      return NULL;
+   }
+   p = map + sizeof(_ToonSnapshotHeader);
+   memcpy(toon, p, header->ntoons*sizeof(Toon));
+   p += header->ntoons*sizeof(Toon);
+   if (table) memcpy(table, p, header->nwindows*sizeof(_ToonWindowData));
+   p += header->nwindows*sizeof(_ToonWindowData);
+   if (copy) memcpy(copy, p, header->state_size);
+
+   for (i=0; i<header->ntoons; i++) {
+      if (toon[i].type < 0 || toon[i].type >= toon_ntypes)
+         toon[i].active = 0;
+      toon[i].width_map = toon[i].height_map = 0;
+      toon[i].segment = -1;
+   }
+   if (windata) free(windata);
+   windata = table;
+   nwindows = header->nwindows;
+
+   *n = header->ntoons;
+   *state = copy;
+   *size = header->state_size;
+   munmap(map, st.st_size);
+   return toon;
+}
@@ -0,0 +1,300 @@
+/* toon_stats.c - per-frame phase timing and counters for toon.c
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Each phase keeps the durations of its last TOON_STATS_WINDOW samples
+ * in a ring, from which the percentiles are worked out only when a dump
+ * is asked for. The dump is plain text, one `name value' pair per line,
+ * and can be had by sending SIGUSR1 (to stderr), from a file that is
+ * rewritten every second, or by connecting to a Unix socket. X requests
+ * and round trips are charged to the toon.c call that made them. Like the
+ * rest of the per-display state the statistics belong to a thread, and
+ * only a thread that called ToonStatsOpen() publishes them. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "toonP.h"
+
+#define TOON_STATS_WINDOW 1024
+#define TOON_STATS_INTERVAL 1000000000.0 /* ns between stats file updates */
+
+typedef struct {
+   double start;
+   double ring[TOON_STATS_WINDOW];
+   int nring, next;
+   double max, total;
+} _ToonPhase;
+
+char *toon_phase_names[TOON_PHASES] = {
+   "rescan", "behaviour", "erase", "draw", "flush", "frame", "present"
+};
+char *toon_counter_names[TOON_COUNTERS] = {
+   "frames", "rescans", "relocations", "partial_moves", "explosions",
+   "skipped_frames", "dropped_frames"
+};
+char *toon_call_names[TOON_CALLS] = {
+   "install", "locate", "events", "erase", "draw", "flush"
+};
+
+TOON_LOCAL _ToonPhase toon_phases[TOON_PHASES];
+TOON_LOCAL long toon_counters[TOON_COUNTERS];
+TOON_LOCAL long toon_call_requests[TOON_CALLS], toon_call_round_trips[TOON_CALLS];
+volatile sig_atomic_t toon_stats_dumps = 0; /* SIGUSR1s received... */
+TOON_LOCAL sig_atomic_t stats_dumps_done = 0; /* ...and answered here */
+TOON_LOCAL int stats_open = 0;
+TOON_LOCAL char *stats_file = NULL;
+TOON_LOCAL char *stats_socket_path = NULL;
+TOON_LOCAL int stats_socket = -1;
+TOON_LOCAL double stats_last_write = 0.0;
+
+/* Monotonic time in nanoseconds */
+double _ToonNow()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+void _ToonStatsSignalHandler(int sig)
+{
+   toon_stats_dumps++;
+   return;
+}
+
+int _ToonCompareDouble(const void *a, const void *b)
+{
+   double x = *(double *) a, y = *(double *) b;
+   return (x > y) - (x < y);
+}
+
+/* Start timing a phase of the main loop */
+void ToonStatsBegin(int phase)
+{
+   toon_phases[phase].start = _ToonNow();
+   return;
+}
+
+/* Stop timing a phase and add the sample to its ring */
+void ToonStatsEnd(int phase)
+{
+   _ToonStatsSample(phase, _ToonNow() - toon_phases[phase].start);
+   return;
+}
+
+/* Add a duration measured some other way to a phase's ring */
+void _ToonStatsSample(int phase, double t)
+{
+   _ToonPhase *p = toon_phases + phase;
+   p->ring[p->next] = t;
+   p->next = (p->next + 1) % TOON_STATS_WINDOW;
+   if (p->nring < TOON_STATS_WINDOW) p->nring++;
+   if (t > p->max) p->max = t;
+   p->total += t;
+   return;
+}
+
+/* Add to one of the event counters */
+void ToonStatsCount(int counter, long n)
+{
+   toon_counters[counter] += n;
+   return;
+}
+
+/* Charge X requests and round trips to one of the TOON_CALL_* calls */
+void _ToonStatsRequests(int call, long requests, long round_trips)
+{
+   toon_call_requests[call] += requests;
+   toon_call_round_trips[call] += round_trips;
+   return;
+}
+
+/* Return the requests and round trips charged to a call so far */
+void ToonRequestCounts(int call, long *requests, long *round_trips)
+{
+   *requests = toon_call_requests[call];
+   *round_trips = toon_call_round_trips[call];
+   return;
+}
+
+/* Write the current statistics to a stream */
+void ToonStatsDump(FILE *f)
+{
+   double sorted[TOON_STATS_WINDOW];
+   _ToonPhase *p;
+   int i, n;
+   long requests = 0, round_trips = 0, frames;
+
+   for (i=0; i<TOON_COUNTERS; i++)
+      fprintf(f, "%s %ld\n", toon_counter_names[i], toon_counters[i]);
+   for (i=0; i<TOON_CALLS; i++) {
+      fprintf(f, "requests.%s %ld\n", toon_call_names[i],
+            toon_call_requests[i]);
+      fprintf(f, "round_trips.%s %ld\n", toon_call_names[i],
+            toon_call_round_trips[i]);
+      /* Startup costs are not part of a frame */
+      if (i != TOON_CALL_INSTALL) {
+         requests += toon_call_requests[i];
+         round_trips += toon_call_round_trips[i];
+      }
+   }
+   frames = toon_counters[TOON_STAT_FRAMES] ? toon_counters[TOON_STAT_FRAMES] : 1;
+   fprintf(f, "requests_per_frame %.2f\n", (double) requests/frames);
+   fprintf(f, "round_trips_per_frame %.2f\n", (double) round_trips/frames);
+   for (i=0; i<TOON_PHASES; i++) {
+      p = toon_phases + i;
+      n = p->nring;
+      if (n == 0) continue;
+      memcpy(sorted, p->ring, n*sizeof(double));
+      qsort(sorted, n, sizeof(double), _ToonCompareDouble);
+      fprintf(f, "%s.p50_us %.1f\n", toon_phase_names[i], sorted[n/2]/1e3);
+      fprintf(f, "%s.p99_us %.1f\n", toon_phase_names[i],
+            sorted[(n*99)/100]/1e3);
+      fprintf(f, "%s.max_us %.1f\n", toon_phase_names[i], sorted[n-1]/1e3);
+      fprintf(f, "%s.alltime_max_us %.1f\n", toon_phase_names[i], p->max/1e3);
+      fprintf(f, "%s.total_ms %.1f\n", toon_phase_names[i], p->total/1e6);
+   }
+   fflush(f);
+   return;
+}
+
+/* Replace the stats file atomically so that a scraper never sees half */
+void _ToonStatsWriteFile()
+{
+   char tmp[PATH_MAX];
+   FILE *f;
+   snprintf(tmp, sizeof(tmp), "%s.tmp", stats_file);
+   if ((f = fopen(tmp, "w")) == NULL) return;
+   ToonStatsDump(f);
+   fclose(f);
+   rename(tmp, stats_file);
+   return;
+}
+
+/* Answer anybody waiting on the stats socket; the dump is sent without
+   SIGPIPE, so a client that hangs up early can't kill the program */
+void _ToonStatsServeSocket()
+{
+   int fd;
+   FILE *f;
+   char *dump = NULL;
+   size_t length = 0, sent;
+   ssize_t n;
+   while ((fd = accept(stats_socket, NULL, NULL)) >= 0) {
+      if (dump == NULL) {
+         if ((f = open_memstream(&dump, &length)) == NULL) {
+            close(fd);
+            return;
+         }
+         ToonStatsDump(f);
+         fclose(f);
+      }
+      for (sent = 0; sent < length; sent += n)
+         if ((n = send(fd, dump + sent, length - sent, MSG_NOSIGNAL)) <= 0)
+            break;
+      close(fd);
+   }
+   if (dump) free(dump);
+   return;
+}
+
+/* Enable the statistics surface: SIGUSR1 always dumps to stderr, and
+   either of `file' or `socket_path' may be NULL */
+/* Returns 0 on success, 1 if the socket could not be set up */
+int ToonStatsOpen(char *file, char *socket_path)
+{
+   struct sockaddr_un addr;
+
+   signal(SIGUSR1, _ToonStatsSignalHandler);
+   stats_dumps_done = toon_stats_dumps;
+   stats_open = 1;
+   stats_file = file;
+   if (socket_path == NULL) return 0;
+
+   if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+      strncpy(toon_error_message, "Stats socket path too long",
+            TOON_MESSAGE_LENGTH);
+      return 1;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, socket_path);
+   unlink(socket_path);
+   if ((stats_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+         || bind(stats_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0
+         || listen(stats_socket, 4) < 0) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't open stats socket %s", socket_path);
+      if (stats_socket >= 0) close(stats_socket);
+      stats_socket = -1;
+      return 1;
+   }
+   fcntl(stats_socket, F_SETFL, O_NONBLOCK);
+   stats_socket_path = socket_path;
+   return 0;
+}
+
+/* Called once per frame: counts the frame and services dump requests */
+void ToonStatsFrame()
+{
+   toon_counters[TOON_STAT_FRAMES]++;
+   ToonStatsPoll();
+   return;
+}
+
+/* Service dump requests, for when there are no frames to count */
+void ToonStatsPoll()
+{
+   double now;
+   if (stats_open && stats_dumps_done != toon_stats_dumps) {
+      stats_dumps_done = toon_stats_dumps;
+      ToonStatsDump(stderr);
+   }
+   if (stats_socket >= 0)
+      _ToonStatsServeSocket();
+   if (stats_file) {
+      now = _ToonNow();
+      if (now - stats_last_write >= TOON_STATS_INTERVAL) {
+         _ToonStatsWriteFile();
+         stats_last_write = now;
+      }
+   }
+   return;
+}
+
+/* Write the stats file one last time and remove the socket */
+void ToonStatsClose()
+{
+   if (stats_file)
+      _ToonStatsWriteFile();
+   if (stats_socket >= 0) {
+      close(stats_socket);
+      unlink(stats_socket_path);
+      stats_socket = -1;
+   }
+   stats_open = 0;
+   signal(SIGUSR1, SIG_DFL);
+   return;
+}
@@ -0,0 +1,597 @@
+/* toon_theme.c - load sprite themes at run time through a binary cache
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A theme is a directory laid out like penguins/: a def.h holding the
+ * ToonData table and the XPM files it #includes. The first time a theme
+ * is loaded, the table is parsed, the images decoded and the result
+ * written to a cache file of premultiplied pixels and 1-bit masks. After
+ * that the cache is simply mapped into memory and the ToonData entries
+ * point straight into it. The cache is rebuilt whenever a file in the
+ * theme directory changes size or modification time. A theme loaded
+ * again, say for another display, shares the mapping already made. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "toonP.h"
+
+#define THEME_MAGIC "XTOONTHM"
+#define THEME_VERSION 1
+#define THEME_BYTEORDER 0x01020304
+#define THEME_MAXTYPES 64
+#define THEME_MAXFILES 64
+
+typedef struct {
+   char magic[8];
+   unsigned int version, byte_order;
+   unsigned int ntypes, pad;
+   unsigned long long stamp; /* of the theme directory contents */
+   unsigned long long size; /* of the whole cache file */
+} _ToonThemeHeader;
+
+typedef struct {
+   int nframes, ndirections, width, height;
+   long long conf;
+   int image_width, image_height;
+   unsigned long long pixels, mask_bits; /* offsets into the file */
+} _ToonThemeEntry;
+
+/* A theme in use, so that ToonFreeTheme() can find its mapping */
+typedef struct _ToonTheme {
+   ToonData *data;
+   void *map;
+   size_t size;
+   unsigned long long stamp;
+   char *cache;
+   int refs; /* ToonLoadTheme() calls not yet freed */
+   struct _ToonTheme *next;
+} _ToonTheme;
+
+/* Shared by every thread */
+_ToonTheme *toon_themes = NULL;
+pthread_mutex_t toon_themes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Flags that may appear in the conf column of def.h */
+struct {
+   char *name;
+   long conf;
+} _toon_theme_flags[] = {
+   { "TOON_DEFAULTS", TOON_DEFAULTS },
+   { "TOON_NOCYCLE", TOON_NOCYCLE },
+   { NULL, 0 }
+};
+
+/* 64-bit FNV-1a */
+unsigned long long _ToonHash(unsigned long long hash, void *p, size_t n)
+{
+   unsigned char *c = p;
+   while (n--) {
+      hash ^= *c++;
+      hash *= 0x100000001b3ULL;
+   }
+   return hash;
+}
+
+/* Summarise the names, sizes and times of the files in the theme
+   directory; the order readdir() gives them in does not matter */
+unsigned long long _ToonThemeStamp(char *dir)
+{
+   DIR *d;
+   struct dirent *entry;
+   struct stat st;
+   char path[PATH_MAX];
+   unsigned long long h, stamp = 0;
+   long long fields[3];
+
+   if ((d = opendir(dir)) == NULL) return 0;
+   while ((entry = readdir(d))) {
+      if (entry->d_name[0] == '.') continue;
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      if (stat(path, &st) || !S_ISREG(st.st_mode)) continue;
+      fields[0] = st.st_size;
+      fields[1] = st.st_mtime;
+      fields[2] = st.st_ino;
+      h = _ToonHash(TOON_HASHINIT, entry->d_name, strlen(entry->d_name));
+      stamp += _ToonHash(h, fields, sizeof(fields));
+   }
+   closedir(d);
+   return stamp ? stamp : 1;
+}
+
+/* Where the cache for a theme lives: under $XDG_CACHE_HOME or
+   ~/.cache, named after the real path of the theme */
+/* Returns 0 on success, 1 if there is nowhere to put it */
+int _ToonThemeCachePath(char *dir, char *path, size_t n)
+{
+   char real[PATH_MAX], base[PATH_MAX];
+   char *env;
+
+   if (realpath(dir, real) == NULL) return 1;
+   if ((env = getenv("XDG_CACHE_HOME")) && env[0])
+      snprintf(base, sizeof(base), "%s", env);
+   else if ((env = getenv("HOME")) && env[0])
+      snprintf(base, sizeof(base), "%s/.cache", env);
+   else
+      return 1;
+   mkdir(base, 0755);
+   strncat(base, "/xpenguins", sizeof(base)-strlen(base)-1);
+   mkdir(base, 0755);
+   snprintf(path, n, "%s/theme-%016llx.cache", base,
+         _ToonHash(TOON_HASHINIT, real, strlen(real)));
+   return 0;
+}
+
+/* Read a whole file into a nul-terminated buffer */
+char *_ToonReadFile(char *path)
+{
+   FILE *f;
+   long size;
+   char *buf;
+
+   if ((f = fopen(path, "r")) == NULL) return NULL;
+   fseek(f, 0, SEEK_END);
+   size = ftell(f);
+   rewind(f);
+   if (size < 0 || (buf = malloc(size+1)) == NULL) {
+      fclose(f);
+      return NULL;
+   }
+   size = fread(buf, 1, size, f);
+   buf[size] = '\0';
+   fclose(f);
+   return buf;
+}
+
+/* Pull the string literals out of an XPM file, in place; `name' gets the
+   name of the array they initialise */
+/* Returns the number of strings, or -1 if the file is not understood */
+int _ToonSplitXpm(char *text, char ***strings, char *name, int n)
+{
+   char *p = text, *q, *end, **s = NULL;
+   int nstrings = 0, size = 0, len;
+
+   /* static char * walker_xpm[] = { */
+   if ((end = strchr(text, '[')) == NULL) return -1;
+   for (q = end; q > text && isspace((unsigned char) q[-1]); q--);
+   for (p = q; p > text && (isalnum((unsigned char) p[-1]) || p[-1] == '_');
+         p--);
+   len = q - p < n-1 ? q - p : n-1;
+   memcpy(name, p, len);
+   name[len] = '\0';
+
+   for (p = end; *p; p++) {
+      if (p[0] == '/' && p[1] == '*') {
+         if ((p = strstr(p+2, "*/")) == NULL) break;
+         p++;
+      }
+      else if (*p == '"') {
+         for (q = ++p; *q && *q != '"'; q++)
+            if (*q == '\\' && q[1]) q++;
+         if (*q == '\0') break;
+         *q = '\0';
+         if (nstrings == size) {
+            size = size ? 2*size : 256;
+            if ((s = realloc(s, size*sizeof(char *))) == NULL) return -1;
+         }
+         s[nstrings++] = p;
+         p = q;
+      }
+   }
+   *strings = s;
+   return nstrings;
+}
+
+/* Turn a 0/255-alpha image into premultiplied pixels and an XBM mask */
+void _ToonPremultiply(_ToonImage *image, unsigned char *mask_bits)
+{
+   int x, y, stride = (image->width+7)/8;
+   unsigned int *p = image->pixels;
+
+   memset(mask_bits, 0, stride*image->height);
+   for (y=0; y<image->height; y++) {
+      for (x=0; x<image->width; x++, p++) {
+         if (*p & 0xff000000)
+            mask_bits[y*stride + x/8] |= 1 << (x%8);
+         else
+            *p = 0;
+      }
+   }
+   return;
+}
+
+/* Parse def.h and decode its images into `images', which is filled in
+   along with `entries' */
+/* Returns the number of types, or -1 with toon_error_message set */
+int _ToonParseTheme(char *dir, _ToonThemeEntry *entries, _ToonImage *images)
+{
+   char path[PATH_MAX], *def, *p, *q, *field[6], *tok;
+   char names[THEME_MAXFILES][64];
+   char *texts[THEME_MAXFILES], **strings[THEME_MAXFILES];
+   int nstrings[THEME_MAXFILES];
+   int nfiles = 0, ntypes = 0, i, f, nf, w, h, ncolors, cpp;
+   long conf;
+
+   snprintf(path, sizeof(path), "%s/def.h", dir);
+   if ((def = _ToonReadFile(path)) == NULL) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't read def.h in %s", dir);
+      return -1;
+   }
+
+   /* Every #include "x.xpm" supplies one named image */
+   for (p = def; (p = strstr(p, "#include")) && nfiles < THEME_MAXFILES; ) {
+      if ((p = strchr(p, '"')) == NULL || (q = strchr(p+1, '"')) == NULL)
+         break;
+      snprintf(path, sizeof(path), "%s/%.*s", dir, (int) (q-p-1), p+1);
+      p = q+1;
+      if ((texts[nfiles] = _ToonReadFile(path)) == NULL) continue;
+      nstrings[nfiles] = _ToonSplitXpm(texts[nfiles], strings+nfiles,
+            names[nfiles], sizeof(names[0]));
+      if (nstrings[nfiles] < 0) {
+         free(texts[nfiles]);
+         continue;
+      }
+      nfiles++;
+   }
+
+   /* ToonData name[] = { { image, nframes, ndirections, width, height,
+      conf }, ... }; */
+   if ((p = strstr(def, "ToonData")) == NULL || (p = strchr(p, '{')) == NULL) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "No ToonData table in %s/def.h", dir);
+      ntypes = -1;
+   }
+   else {
+      for (p++; ntypes >= 0 && (p = strchr(p, '{')); p = q+1) {
+         if ((q = strchr(p, '}')) == NULL) break;
+         *q = '\0';
+         for (i=0, tok = strtok(p+1, ","); tok && i<6;
+               tok = strtok(NULL, ","))
+            field[i++] = tok;
+         if (i < 6 || ntypes == THEME_MAXTYPES) {
+            snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+                  "Bad ToonData entry %d in %s/def.h", ntypes, dir);
+            ntypes = -1;
+            break;
+         }
+         while (isspace((unsigned char) *field[0])) field[0]++;
+         for (tok = field[0]; isalnum((unsigned char) *tok) || *tok == '_';
+               tok++);
+         *tok = '\0';
+         for (f=0; f<nfiles && strcmp(names[f], field[0]); f++);
+         conf = 0;
+         for (tok = strtok(field[5], "| \t\n"); tok;
+               tok = strtok(NULL, "| \t\n")) {
+            for (i=0; _toon_theme_flags[i].name
+                  && strcmp(_toon_theme_flags[i].name, tok); i++);
+            conf |= _toon_theme_flags[i].name ? _toon_theme_flags[i].conf
+                  : strtol(tok, NULL, 0);
+         }
+         if (f == nfiles || nstrings[f] < 1
+               || sscanf(strings[f][0], "%d %d %d %d", &w, &h, &ncolors,
+                  &cpp) != 4
+               || nstrings[f] < 1+ncolors+h
+               || _ToonDecodeXpm(strings[f], images+ntypes)) {
+            snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+                  "Can't load image %s", field[0]);
+            ntypes = -1;
+            break;
+         }
+         nf = ntypes++;
+         entries[nf].nframes = atoi(field[1]);
+         entries[nf].ndirections = atoi(field[2]);
+         entries[nf].width = atoi(field[3]);
+         entries[nf].height = atoi(field[4]);
+         entries[nf].conf = conf;
+         entries[nf].image_width = images[nf].width;
+         entries[nf].image_height = images[nf].height;
+      }
+   }
+
+   for (f=0; f<nfiles; f++) {
+      free(strings[f]);
+      free(texts[f]);
+   }
+   free(def);
+   if (ntypes == 0) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Empty ToonData table in %s/def.h", dir);
+      ntypes = -1;
+   }
+   if (ntypes < 0)
+      for (i=0; i<THEME_MAXTYPES; i++)
+         _ToonFreeImage(images+i);
+   return ntypes;
+}
+
+/* Build the cache file for a theme from its sources */
+/* Returns 0 on success, 1 on failure */
+int _ToonWriteThemeCache(char *dir, char *cache, unsigned long long stamp)
+{
+   _ToonThemeHeader header;
+   _ToonThemeEntry entries[THEME_MAXTYPES];
+   _ToonImage images[THEME_MAXTYPES];
+   unsigned char *mask_bits;
+   unsigned long long offset;
+   char tmp[PATH_MAX];
+   int i, ntypes, stride, status = 0;
+   FILE *f;
+
+   memset(images, 0, sizeof(images));
+   memset(entries, 0, sizeof(entries));
+   if ((ntypes = _ToonParseTheme(dir, entries, images)) < 0)
+      return 1;
+
+   /* Pixels first, at 8-byte boundaries, then the masks */
+   offset = sizeof(header) + ntypes*sizeof(_ToonThemeEntry);
+   for (i=0; i<ntypes; i++) {
+      entries[i].pixels = offset;
+      offset += ((images[i].width*images[i].height*4ULL) + 7) & ~7ULL;
+   }
+   for (i=0; i<ntypes; i++) {
+      entries[i].mask_bits = offset;
+      offset += (((images[i].width+7)/8)*images[i].height + 7) & ~7ULL;
+   }
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, THEME_MAGIC, 8);
+   header.version = THEME_VERSION;
+   header.byte_order = THEME_BYTEORDER;
+   header.ntypes = ntypes;
+   header.stamp = stamp;
+   header.size = offset;
+
+   /* Write to the side and rename, so a reader never sees half a file */
+   snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int) getpid());
+   if ((f = fopen(tmp, "w")) == NULL) {
+      status = 1;
+   }
+   else {
+      /* A short write anywhere (a full disk, say) and it's thrown away */
+      if (fwrite(&header, sizeof(header), 1, f) != 1
+            || fwrite(entries, sizeof(_ToonThemeEntry), ntypes, f)
+               != (size_t) ntypes)
+         status = 1;
+      for (i=0; i<ntypes && status == 0; i++) {
+         stride = (images[i].width+7)/8;
+         if ((mask_bits = malloc(stride*images[i].height)) == NULL) {
+            status = 1;
+            break;
+         }
+         _ToonPremultiply(images+i, mask_bits);
+         if (fseek(f, entries[i].pixels, SEEK_SET)
+               || fwrite(images[i].pixels, 4, images[i].width*images[i].height,
+                  f) != (size_t) images[i].width*images[i].height
+               || fseek(f, entries[i].mask_bits, SEEK_SET)
+               || fwrite(mask_bits, 1, stride*images[i].height, f)
+                  != (size_t) stride*images[i].height)
+            status = 1;
+         free(mask_bits);
+      }
+      /* Pad out to the full size */
+      if (status == 0 && (fseek(f, offset-1, SEEK_SET) || fputc(0, f) == EOF))
+         status = 1;
+      if (fclose(f) || status) {
+         unlink(tmp);
+         status = 1;
+      }
+      else if (rename(tmp, cache)) {
+         unlink(tmp);
+         status = 1;
+      }
+   }
+   if (status)
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't write theme cache");
+   for (i=0; i<ntypes; i++)
+      _ToonFreeImage(images+i);
+   return status;
+}
+
+/* Whether an entry of a cache file `size' bytes long describes images
+   that lie wholly within the file, with frames that lie within them */
+int _ToonThemeEntryFits(_ToonThemeEntry *entry, unsigned long long size)
+{
+   unsigned long long width = entry->image_width;
+   unsigned long long height = entry->image_height;
+   if (entry->image_width <= 0 || entry->image_width > 0xffff
+         || entry->image_height <= 0 || entry->image_height > 0xffff
+         || entry->nframes <= 0 || entry->ndirections <= 0
+         || entry->width <= 0 || entry->height <= 0
+         || (unsigned long long) entry->width*entry->nframes > width
+         || (unsigned long long) entry->height*entry->ndirections > height)
+      return 0;
+   return (entry->pixels & 3) == 0
+         && entry->pixels <= size && width*height*4 <= size - entry->pixels
+         && entry->mask_bits <= size
+         && ((width+7)/8)*height <= size - entry->mask_bits;
+}
+
+/* Map a cache file and check that it belongs to the theme as it is now */
+/* Returns the theme, or NULL if the cache is missing or out of date */
+_ToonTheme *_ToonMapThemeCache(char *cache, unsigned long long stamp)
+{
+   _ToonThemeHeader *header;
+   _ToonThemeEntry *entries;
+   _ToonTheme *theme;
+   struct stat st;
+   void *map;
+   int fd, i;
+
+   if ((fd = open(cache, O_RDONLY)) < 0) return NULL;
+   if (fstat(fd, &st) || st.st_size < (off_t) sizeof(_ToonThemeHeader)) {
+      close(fd);
+      return NULL;
+   }
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) return NULL;
+
+   header = map;
+   entries = (_ToonThemeEntry *) (header+1);
+   if (memcmp(header->magic, THEME_MAGIC, 8)
+         || header->version != THEME_VERSION
+         || header->byte_order != THEME_BYTEORDER
+         || header->stamp != stamp
+         || header->size != (unsigned long long) st.st_size
+         || header->ntypes == 0 || header->ntypes > THEME_MAXTYPES
+         || sizeof(_ToonThemeHeader) + header->ntypes*sizeof(_ToonThemeEntry)
+            > header->size) {
+      munmap(map, st.st_size);
+      return NULL;
+   }
+   /* Nor can any entry be trusted to point inside the file */
+   for (i=0; i<header->ntypes; i++)
+      if (!_ToonThemeEntryFits(entries+i, header->size)) {
+         munmap(map, st.st_size);
+         return NULL;
+      }
+   if ((theme = malloc(sizeof(_ToonTheme))) == NULL) {
+      munmap(map, st.st_size);
+      return NULL;
+   }
+   if ((theme->data = calloc(header->ntypes+1, sizeof(ToonData))) == NULL) {
+      free(theme);
+      munmap(map, st.st_size);
+      return NULL;
+   }
+   for (i=0; i<header->ntypes; i++) {
+      theme->data[i].nframes = entries[i].nframes;
+      theme->data[i].ndirections = entries[i].ndirections;
+      theme->data[i].width = entries[i].width;
+      theme->data[i].height = entries[i].height;
+      theme->data[i].conf = entries[i].conf;
+      theme->data[i].image_width = entries[i].image_width;
+      theme->data[i].image_height = entries[i].image_height;
+      theme->data[i].pixels = (unsigned int *)
+            ((char *) map + entries[i].pixels);
+      theme->data[i].mask_bits = (unsigned char *) map + entries[i].mask_bits;
+   }
+   theme->map = map;
+   theme->size = st.st_size;
+   return theme;
+}
+
+/* Load the theme in directory `dir', building its cache if needed; the
+   number of types goes in *ntypes */
+/* Returns the data to give ToonInstallData(), or NULL on failure (see
+   ToonErrorMessage()) */
+ToonData *ToonLoadTheme(char *dir, int *ntypes)
+{
+   char cache[PATH_MAX];
+   unsigned long long stamp;
+   _ToonTheme *theme;
+
+   if ((stamp = _ToonThemeStamp(dir)) == 0) {
+      snprintf(toon_error_message, TOON_MESSAGE_LENGTH,
+            "Can't read theme %s", dir);
+      return NULL;
+   }
+   if (_ToonThemeCachePath(dir, cache, sizeof(cache))) {
+      strncpy(toon_error_message, "Nowhere to keep the theme cache",
+            TOON_MESSAGE_LENGTH);
+      return NULL;
+   }
+   /* Held while building, so the cache is only ever written once */
+   pthread_mutex_lock(&toon_themes_lock);
+   for (theme = toon_themes; theme; theme = theme->next) {
+      if (theme->stamp == stamp && strcmp(theme->cache, cache) == 0) {
+         theme->refs++;
+         break;
+      }
+   }
+   if (theme == NULL) {
+      if ((theme = _ToonMapThemeCache(cache, stamp)) == NULL) {
+         if (_ToonWriteThemeCache(dir, cache, stamp)) {
+            pthread_mutex_unlock(&toon_themes_lock);
+            return NULL;
+         }
+         if ((theme = _ToonMapThemeCache(cache, stamp)) == NULL) {
+            strncpy(toon_error_message, "Can't map theme cache",
+                  TOON_MESSAGE_LENGTH);
+            pthread_mutex_unlock(&toon_themes_lock);
+            return NULL;
+         }
+      }
+      if ((theme->cache = strdup(cache)) == NULL) {
+         munmap(theme->map, theme->size);
+         free(theme->data);
+         free(theme);
+         strncpy(toon_error_message, "Out of memory", TOON_MESSAGE_LENGTH);
+         pthread_mutex_unlock(&toon_themes_lock);
+         return NULL;
+      }
+      theme->stamp = stamp;
+      theme->refs = 1;
+      theme->next = toon_themes;
+      toon_themes = theme;
+   }
+   pthread_mutex_unlock(&toon_themes_lock);
+   *ntypes = ((_ToonThemeHeader *) theme->map)->ntypes;
+   return theme->data;
+}
+
+/* Point the entries of a compiled-in table at the images spritec made
+   from the same XPM data, so that they need not be decoded */
+void ToonUseRaw(ToonData *data, int n, ToonRawImage *raw)
+{
+   int i;
+   ToonRawImage *r;
+   for (i=0; i<n; i++) {
+      for (r = raw; r->image && r->image != data[i].image; r++);
+      if (r->image == NULL) continue;
+      data[i].pixels = r->pixels;
+      data[i].mask_bits = r->mask_bits;
+      data[i].spans = r->spans;
+      data[i].image_width = r->image_width;
+      data[i].image_height = r->image_height;
+   }
+   return;
+}
+
+/* Release a theme from ToonLoadTheme(); its pixmaps are not touched, and
+   the mapping goes once every load of it has been freed */
+void ToonFreeTheme(ToonData *data)
+{
+   _ToonTheme **t, *theme;
+   pthread_mutex_lock(&toon_themes_lock);
+   for (t = &toon_themes; *t; t = &((*t)->next)) {
+      if ((*t)->data == data) {
+         theme = *t;
+         if (--theme->refs == 0) {
+            *t = theme->next;
+            _ToonScaleForget(theme->data);
+            munmap(theme->map, theme->size);
+            free(theme->cache);
+            free(theme->data);
+            free(theme);
+         }
+         break;
+      }
+   }
+   pthread_mutex_unlock(&toon_themes_lock);
+   return;
+}
@@ -0,0 +1,540 @@
+/* toonbench.c - benchmarks for the hot paths in toon.c
+ * Copyright (C) 1999, 2000  Robin Hogan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ * Runs against the null backend, so no X server is needed. Each line of
+ * output is one result, tab-separated, in the columns given by the
+ * header line; it is meant to be saved and diffed between commits:
+ *
+ *    make bench > before.txt
+ *
+ * With -budget it instead plays the scenarios listed in a budget file
+ * and fails if any of them issues more X requests or round trips per
+ * frame than the file allows; a scenario may also set off bursts of
+ * particles every frame. Under -backend xlib the scenario windows
+ * are real windows created on a second connection, so this can be run
+ * against Xvfb.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "toon.h"
+#include "penguins/def.h"
+#include "penguins/sprites.h"
+
+#define BENCH_WIDTH 3840
+#define BENCH_HEIGHT 2160
+#define BENCH_SEED 1
+#define BENCH_MAXSAMPLES 200
+#define BENCH_MINSAMPLES 5
+#define BENCH_BUDGET_NS 200000000.0 /* time spent on each result */
+#define BENCH_SPARKS 64 /* particles in each burst */
+#define BENCH_PARTICLES 4096
+
+int window_counts[] = { 10, 100, 1000, 10000, 0 };
+int toon_counts[] = { 8, 1000, 100000, 0 };
+
+unsigned int bench_seed = BENCH_SEED;
+int bench_xlib = 0;
+Display *driver = NULL;
+Window *driver_windows = NULL;
+int driver_nwindows = 0;
+double samples[BENCH_MAXSAMPLES];
+int nsamples;
+char *filter = NULL;
+
+/* Deterministic generator so that runs are comparable */
+int BenchRandom(int maxint)
+{
+   bench_seed = bench_seed*1103515245 + 12345;
+   return (int) (((bench_seed>>8) & 0xffffff) % (unsigned int) maxint);
+}
+
+double BenchNow()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+int CompareDouble(const void *a, const void *b)
+{
+   double x = *(double *) a, y = *(double *) b;
+   return (x > y) - (x < y);
+}
+
+/* Print one result from the samples gathered so far; each sample is the
+   time of one operation in nanoseconds */
+void BenchReport(char *name, int nwin, int shaped, int ntoons)
+{
+   double mean = 0.0;
+   int i;
+   for (i=0; i<nsamples; i++) mean += samples[i];
+   mean /= nsamples;
+   qsort(samples, nsamples, sizeof(double), CompareDouble);
+   fprintf(stdout, "%s\t%d\t%d\t%d\t%d\t%.1f\t%.1f\t%.1f\t%.1f\t%.2f\n",
+         name, nwin, shaped, ntoons, nsamples, mean,
+         samples[nsamples/2], samples[(nsamples*99)/100],
+         samples[nsamples-1], 1e9/mean);
+   fflush(stdout);
+   return;
+}
+
+/* Should this benchmark run at all? */
+int BenchWanted(char *name)
+{
+   return filter == NULL || strstr(name, filter) != NULL;
+}
+
+/* Is there time left for another sample? */
+int BenchMore(double start)
+{
+   if (nsamples >= BENCH_MAXSAMPLES) return 0;
+   if (nsamples < BENCH_MINSAMPLES) return 1;
+   return BenchNow() - start < BENCH_BUDGET_NS;
+}
+
+/* Scatter toons over the free space of the desktop */
+void BenchPlaceToons(Toon *toon, int n)
+{
+   int i, tries;
+   for (i=0; i<n; i++) {
+      toon[i].type = PENGUIN_WALKER;
+      ToonSetType(toon+i, BenchRandom(2) ? PENGUIN_WALKER : PENGUIN_FALLER,
+            BenchRandom(2), TOON_HERE);
+      tries = 0;
+      do {
+         ToonSetPosition(toon+i, BenchRandom(ToonDisplayWidth()-64),
+               BenchRandom(ToonDisplayHeight()-64));
+      } while (ToonBlocked(toon+i, TOON_HERE) && ++tries < 8);
+      ToonSetVelocity(toon+i, BenchRandom(2)*8-4, BenchRandom(4));
+      ToonSetAssociation(toon+i, BenchRandom(2) ? TOON_DOWN : TOON_UNASSOCIATED);
+      toon[i].x_map = toon[i].x;
+      toon[i].y_map = toon[i].y;
+      toon[i].width_map = toon[i].height_map = 0;
+   }
+   return;
+}
+
+/* Create the scenario windows on a connection of our own */
+void BenchDriverOpen(int nwin, int shaped)
+{
+   XSetWindowAttributes attributes;
+   XRectangle shape[2];
+   int i, w, h, width, height;
+
+   if ((driver = XOpenDisplay(NULL)) == NULL) {
+      fprintf(stderr, "Error: Can't open display for the scenario windows\n");
+      exit(1);
+   }
+   width = DisplayWidth(driver, DefaultScreen(driver));
+   height = DisplayHeight(driver, DefaultScreen(driver));
+   if ((driver_windows = calloc(nwin, sizeof(Window))) == NULL) {
+      fprintf(stderr, "Error: Out of memory\n");
+      exit(1);
+   }
+   attributes.override_redirect = True;
+   attributes.background_pixel = WhitePixel(driver, DefaultScreen(driver));
+   for (i=0; i<nwin; i++) {
+      w = 80 + BenchRandom(width/3 + 1);
+      h = 60 + BenchRandom(height/3 + 1);
+      driver_windows[i] = XCreateWindow(driver, DefaultRootWindow(driver),
+            BenchRandom(width - w/2), 1 + BenchRandom(height - h/2), w, h, 0,
+            CopyFromParent, InputOutput, CopyFromParent,
+            CWOverrideRedirect | CWBackPixel, &attributes);
+      if (shaped) {
+         shape[0].x = 8; shape[0].y = 0;
+         shape[0].width = w > 16 ? w - 16 : 1; shape[0].height = 4;
+         shape[1].x = 0; shape[1].y = 4;
+         shape[1].width = w; shape[1].height = h - 4;
+         XShapeCombineRectangles(driver, driver_windows[i], ShapeBounding,
+               0, 0, shape, 2, ShapeSet, Unsorted);
+      }
+      XMapWindow(driver, driver_windows[i]);
+   }
+   driver_nwindows = nwin;
+   XSync(driver, False);
+   return;
+}
+
+void BenchDriverClose()
+{
+   if (driver == NULL) return;
+   XCloseDisplay(driver);
+   free(driver_windows);
+   driver = NULL;
+   driver_windows = NULL;
+   return;
+}
+
+/* Move one of the windows as a user would */
+void BenchMoveWindow()
+{
+   int wx;
+   XWindowAttributes attributes;
+   if (driver == NULL) {
+      ToonNullMoveWindows(1);
+      return;
+   }
+   if (driver_nwindows == 0) return;
+   wx = BenchRandom(driver_nwindows);
+   XGetWindowAttributes(driver, driver_windows[wx], &attributes);
+   XMoveWindow(driver, driver_windows[wx], attributes.x + BenchRandom(33) - 16,
+         attributes.y > 16 ? attributes.y + BenchRandom(33) - 16 : 1);
+   XSync(driver, False);
+   return;
+}
+
+/* One frame of a stripped-down version of the xsimpsons main loop, with
+   `bursts' explosions somewhere among the toons */
+void BenchFrame(Toon *toon, int n, int move_windows, int bursts)
+{
+   int i, k;
+   if (move_windows) BenchMoveWindow();
+   if (ToonWindowsMoved()) {
+      ToonCalculateAssociations(toon, n);
+      ToonLocateWindows();
+      ToonRelocateAssociated(toon, n);
+   }
+   for (i=0; i<n; i++) {
+      if (!toon[i].active || ToonBlocked(toon+i, TOON_HERE)) {
+         ToonSetPosition(toon+i, BenchRandom(ToonDisplayWidth()-64), 0);
+         ToonSetType(toon+i, PENGUIN_FALLER, PENGUIN_FORWARD, TOON_HERE);
+         ToonSetVelocity(toon+i, BenchRandom(2)*2-1, 3);
+         continue;
+      }
+      if (ToonAdvance(toon+i, TOON_MOVE) != TOON_OK)
+         ToonSetVelocity(toon+i, -toon[i].u, toon[i].v);
+   }
+   for (i=0; i<bursts; i++) {
+      k = BenchRandom(n);
+      ToonBurst(toon[k].x + PENGUIN_DEFAULTWIDTH/2,
+            toon[k].y + PENGUIN_DEFAULTHEIGHT/2, BENCH_SPARKS, 8, 12,
+            i%2 ? 0xffd040 : 0xff6020);
+   }
+   ToonAdvanceParticles();
+   ToonErase(toon, n);
+   ToonEraseParticles();
+   ToonDraw(toon, n);
+   ToonDrawParticles();
+   ToonFlush();
+   return;
+}
+
+/* Run every benchmark on one desktop */
+void BenchDesktop(int nwin, int shaped, Toon *toon)
+{
+   int i, j, n, dir;
+   double start, t0;
+   char name[64];
+
+   ToonNullLayout(BENCH_WIDTH, BENCH_HEIGHT, nwin, shaped, BENCH_SEED);
+   if (ToonOpenDisplay(NULL)) {
+      fprintf(stderr, "Error: %s\n", ToonErrorMessage());
+      exit(1);
+   }
+   ToonConfigure(TOON_SIDEBOTTOMBLOCK | (shaped ? TOON_SHAPEDWINDOWS
+         : TOON_NOSHAPEDWINDOWS));
+   ToonInstallData(penguin_data, PENGUIN_TYPES);
+   ToonLocateWindows();
+
+   if (BenchWanted("locate")) {
+      nsamples = 0;
+      start = BenchNow();
+      while (BenchMore(start)) {
+         t0 = BenchNow();
+         ToonLocateWindows();
+         samples[nsamples++] = BenchNow() - t0;
+      }
+      BenchReport("locate", nwin, shaped, 0);
+   }
+
+   /* Per particle, moved and drawn, as the ones from the last frame are
+      erased; the count goes in the toons column */
+   if (BenchWanted("particles")) {
+      nsamples = 0;
+      start = BenchNow();
+      while (BenchMore(start)) {
+         bench_seed = BENCH_SEED;
+         for (i=0; i<BENCH_PARTICLES; i+=BENCH_SPARKS)
+            ToonBurst(BenchRandom(ToonDisplayWidth()),
+                  BenchRandom(ToonDisplayHeight()), BENCH_SPARKS, 8, 2,
+                  i%2 ? 0xffd040 : 0xff6020);
+         t0 = BenchNow();
+         ToonAdvanceParticles();
+         ToonEraseParticles();
+         ToonDrawParticles();
+         samples[nsamples++] = (BenchNow() - t0)/BENCH_PARTICLES;
+         /* Two frames is all they live for */
+         ToonAdvanceParticles();
+         ToonEraseParticles();
+      }
+      BenchReport("particles", nwin, shaped, BENCH_PARTICLES);
+   }
+
+   for (j=0; toon_counts[j]; j++) {
+      n = toon_counts[j];
+      bench_seed = BENCH_SEED;
+      BenchPlaceToons(toon, n);
+
+      if (BenchWanted("blocked")) {
+         nsamples = 0;
+         start = BenchNow();
+         while (BenchMore(start)) {
+            t0 = BenchNow();
+            for (i=0; i<n; i++)
+               for (dir=TOON_HERE; dir<=TOON_DOWN; dir++)
+                  ToonBlocked(toon+i, dir);
+            samples[nsamples++] = (BenchNow() - t0)/(5.0*n);
+         }
+         BenchReport("blocked", nwin, shaped, n);
+      }
+
+      if (BenchWanted("offsetblocked")) {
+         nsamples = 0;
+         start = BenchNow();
+         while (BenchMore(start)) {
+            t0 = BenchNow();
+            for (i=0; i<n; i++)
+               ToonOffsetBlocked(toon+i, toon[i].u, -8);
+            samples[nsamples++] = (BenchNow() - t0)/n;
+         }
+         BenchReport("offsetblocked", nwin, shaped, n);
+      }
+
+      if (BenchWanted("advance")) {
+         nsamples = 0;
+         start = BenchNow();
+         while (BenchMore(start)) {
+            BenchPlaceToons(toon, n);
+            t0 = BenchNow();
+            for (i=0; i<n; i++)
+               ToonAdvance(toon+i, TOON_MOVE);
+            samples[nsamples++] = (BenchNow() - t0)/n;
+         }
+         BenchReport("advance", nwin, shaped, n);
+      }
+
+      if (BenchWanted("neighbours")) {
+         int near[8];
+         nsamples = 0;
+         start = BenchNow();
+         while (BenchMore(start)) {
+            t0 = BenchNow();
+            ToonIndexNeighbours(toon, n);
+            for (i=0; i<n; i++)
+               ToonNeighbours(toon+i, 0, near, 8);
+            samples[nsamples++] = (BenchNow() - t0)/n;
+         }
+         BenchReport("neighbours", nwin, shaped, n);
+      }
+
+      /* Each time with the pointer somewhere new, heard of as it would
+         be from the event queue */
+      if (BenchWanted("nearpointer")) {
+         int near[8];
+         ToonIndexNeighbours(toon, n);
+         nsamples = 0;
+         start = BenchNow();
+         while (BenchMore(start)) {
+            t0 = BenchNow();
+            for (i=0; i<n; i++) {
+               ToonNullPointer(BenchRandom(ToonDisplayWidth()),
+                     BenchRandom(ToonDisplayHeight()), 0);
+               ToonWindowsMoved();
+               ToonNearPointer(48, near, 8);
+            }
+            samples[nsamples++] = (BenchNow() - t0)/n;
+         }
+         BenchReport("nearpointer", nwin, shaped, n);
+      }
+
+      if (BenchWanted("associations")) {
+         nsamples = 0;
+         start = BenchNow();
+         while (BenchMore(start)) {
+            t0 = BenchNow();
+            ToonCalculateAssociations(toon, n);
+            ToonRelocateAssociated(toon, n);
+            samples[nsamples++] = (BenchNow() - t0)/n;
+         }
+         BenchReport("associations", nwin, shaped, n);
+      }
+
+      for (dir=0; dir<2; dir++) {
+         strcpy(name, dir ? "frame_moving" : "frame");
+         if (!BenchWanted(name)) continue;
+         BenchPlaceToons(toon, n);
+         nsamples = 0;
+         start = BenchNow();
+         while (BenchMore(start)) {
+            t0 = BenchNow();
+            BenchFrame(toon, n, dir, 0);
+            samples[nsamples++] = BenchNow() - t0;
+         }
+         BenchReport(name, nwin, shaped, n);
+      }
+   }
+   ToonCloseDisplay();
+   return;
+}
+
+/* Total requests and round trips charged to per-frame calls so far */
+void BenchFrameRequests(long *requests, long *round_trips)
+{
+   int call;
+   long r, t;
+   *requests = *round_trips = 0;
+   for (call=0; call<TOON_CALLS; call++) {
+      if (call == TOON_CALL_INSTALL) continue;
+      ToonRequestCounts(call, &r, &t);
+      *requests += r;
+      *round_trips += t;
+   }
+   return;
+}
+
+/* Play the scenarios in a budget file; returns the number over budget */
+int BenchBudget(char *file)
+{
+   FILE *f;
+   char line[256], name[64];
+   int ntoons, nwin, shaped, move_every, nframes, bursts, frame, over = 0;
+   double max_requests, max_round_trips, requests, round_trips;
+   long r0, t0, r1, t1;
+   Toon *toon;
+
+   if ((f = fopen(file, "r")) == NULL) {
+      fprintf(stderr, "Error: Can't open budget file %s\n", file);
+      exit(1);
+   }
+   fprintf(stdout, "#scenario\trequests_per_frame\tbudget"
+         "\tround_trips_per_frame\tbudget\tresult\n");
+   while (fgets(line, sizeof(line), f)) {
+      if (line[0] == '#' || line[0] == '\n') continue;
+      /* The bursts a frame may be left out */
+      bursts = 0;
+      if (sscanf(line, "%63s %d %d %d %d %d %lf %lf %d", name, &ntoons, &nwin,
+            &shaped, &move_every, &nframes, &max_requests,
+            &max_round_trips, &bursts) < 8 || ntoons <= 0 || nframes <= 0) {
+         fprintf(stderr, "Error: Bad budget line: %s", line);
+         exit(1);
+      }
+      if ((toon = calloc(ntoons, sizeof(Toon))) == NULL) {
+         fprintf(stderr, "Error: Out of memory\n");
+         exit(1);
+      }
+
+      bench_seed = BENCH_SEED;
+      if (bench_xlib)
+         BenchDriverOpen(nwin, shaped);
+      else
+         ToonNullLayout(BENCH_WIDTH, BENCH_HEIGHT, nwin, shaped, BENCH_SEED);
+      if (ToonOpenDisplay(NULL)) {
+         fprintf(stderr, "Error: %s\n", ToonErrorMessage());
+         exit(1);
+      }
+      ToonConfigure(TOON_SIDEBOTTOMBLOCK | (shaped ? TOON_SHAPEDWINDOWS
+            : TOON_NOSHAPEDWINDOWS));
+      ToonInstallData(penguin_data, PENGUIN_TYPES);
+      ToonLocateWindows();
+      BenchPlaceToons(toon, ntoons);
+
+      BenchFrameRequests(&r0, &t0);
+      for (frame=1; frame<=nframes; frame++)
+         BenchFrame(toon, ntoons, move_every > 0 && frame % move_every == 0,
+               bursts);
+      BenchFrameRequests(&r1, &t1);
+
+      requests = (double) (r1 - r0)/nframes;
+      round_trips = (double) (t1 - t0)/nframes;
+      if (requests > max_requests || round_trips > max_round_trips) over++;
+      fprintf(stdout, "%s\t%.2f\t%.2f\t%.2f\t%.2f\t%s\n", name,
+            requests, max_requests, round_trips, max_round_trips,
+            requests > max_requests || round_trips > max_round_trips ?
+            "OVER" : "ok");
+      fflush(stdout);
+
+      ToonCloseDisplay();
+      BenchDriverClose();
+      free(toon);
+   }
+   fclose(f);
+   return over;
+}
+
+int main(int argc, char **argv)
+{
+   int n, w, shaped, maxtoons = 0;
+   char *budget = NULL;
+   Toon *toon;
+
+   ToonSetBackend("null");
+   for (n=1; n<argc; n++) {
+      if (strcmp(argv[n], "-quick") == 0) {
+         /* A sweep that finishes in a few seconds */
+         window_counts[2] = 0;
+         toon_counts[2] = 0;
+      }
+      else if (strcmp(argv[n], "-filter") == 0 && argc > n+1) {
+         filter = argv[++n];
+      }
+      else if (strcmp(argv[n], "-budget") == 0 && argc > n+1) {
+         budget = argv[++n];
+      }
+      else if (strcmp(argv[n], "-backend") == 0 && argc > n+1) {
+         if (ToonSetBackend(argv[++n])) {
+            fprintf(stderr, "Error: %s\n", ToonErrorMessage());
+            exit(1);
+         }
+         bench_xlib = strcmp(argv[n], "null") != 0;
+      }
+      else {
+         fprintf(stderr, "Usage: %s [-quick] [-filter <name>]\n"
+               "       %s -budget <file> [-backend <name>]\n",
+               argv[0], argv[0]);
+         exit(1);
+      }
+   }
+
+   if (budget) {
+      if (BenchBudget(budget)) {
+         fprintf(stderr, "Error: over the request budget in %s\n", budget);
+         exit(1);
+      }
+      exit(0);
+   }
+
+   for (n=0; toon_counts[n]; n++)
+      if (toon_counts[n] > maxtoons) maxtoons = toon_counts[n];
+   if ((toon = calloc(maxtoons, sizeof(Toon))) == NULL) {
+      fprintf(stderr, "Error: Out of memory\n");
+      exit(1);
+   }
+
+   fprintf(stdout, "#bench\twindows\tshaped\ttoons\tsamples\tmean_ns\tp50_ns"
+         "\tp99_ns\tmax_ns\tops_per_s\n");
+   for (w=0; window_counts[w]; w++)
+      for (shaped=0; shaped<2; shaped++)
+         BenchDesktop(window_counts[w], shaped, toon);
+
+   free(toon);
+   return 0;
+}
@@ -31,6 +31,9 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 
 /* C structures defined here */
 #include "toon.h"
@@ -41,11 +44,48 @@
  * possibilities are endless!) then point the following line somewhere else. 
  */
 #include "penguins/def.h"
+/* ...and the same images already decoded by spritec at build time */
+#include "penguins/sprites.h"
 
 #define MAX_PENGUINS 256
 #define DEFAULT_DELAY 50
-#define JUMP_DISTANCE 8
-#define RandInt(maxint) ((int) ((maxint)*((float) rand()/(RAND_MAX+1.0))))
+#define JUMP_DISTANCE ((int) (8*sprite_scale))
+#define MAX_IDLE_LEVEL 3 /* -adaptive slows down by up to 2^3 */
+#define MAX_STEP_USEC 250000 /* most the penguins move on in one frame... */
+#define MIN_STEP_USEC 1000 /* ...and least, however late or early it is */
+#define COVERED_USEC 1000000 /* between looks at commands when covered */
+#define HIDDEN_STEP 4 /* frames between updates of penguins behind windows */
+#define OFFSCREEN_STEP 8 /* ...and of those off the screen */
+#define MAX_BUMPS 8 /* neighbours looked at for each walker */
+#define SHY_DISTANCE 48 /* -shy walkers turn from a pointer this close */
+#define MAX_SHY 64 /* ...and this many of them at once */
+#define RENDER_FRAMES 200 /* written by -render unless -frames says */
+#define RENDER_WIDTH 1280 /* ...on a desktop this size, unless -layout */
+#define RENDER_HEIGHT 1024
+#define RENDER_WINDOWS 8
+
+/* Speeds in pixels a second, whatever the frame rate; the penguins were
+ * drawn to be animated at ANIMATION_RATE frames a second */
+#define ANIMATION_RATE 20
+#define WALK_SPEED 80
+#define CLIMB_SPEED 80
+#define FALL_SPEED 60
+#define FLOAT_SPEED 60
+#define DRIFT_SPEED 20 /* sideways, while falling or floating */
+#define TUMBLE_SPEED 160 /* most a tumbler reaches */
+#define TUMBLE_ACCEL 400 /* pixels a second, a second */
+#define EXPLOSION_USEC 50000 /* before an exploded penguin vanishes */
+#define SPARKS 48 /* particles thrown out by an explosion... */
+#define SPARK_SPEED 240 /* ...at up to this speed */
+#define SPARK_LIFE 12 /* ...for up to this many frames of animation */
+#define DUST 6 /* the same for the puff of dust raised by a landing */
+#define DUST_SPEED 40
+#define DUST_LIFE 4
+#define PARTICLE_GRAVITY 480 /* pixels a second, a second */
+/* ...and everything in pixels grows with the images */
+#define Speed(pixels_per_second) \
+      ((int) ((pixels_per_second)*sprite_scale*TOON_SUBPIXELS))
+#define RandInt(maxint) ((int) ((maxint)*(Random()/4294967296.0)))
 
 #define XPENGUINS_VERSION "1.2"
 #define XPENGUINS_AUTHOR "Robin Hogan"
@@ -56,176 +96,667 @@
 #define InitPenguin(penguin) \
    ToonSetType(penguin, PENGUIN_FALLER, PENGUIN_FORWARD, \
          TOON_UNASSOCIATED); \
-   ToonSetPosition(penguin, RandInt(ToonDisplayWidth() \
-         - PENGUIN_DEFAULTWIDTH), 1-PENGUIN_DEFAULTHEIGHT); \
+   DropIn(penguin); \
    ToonSetAssociation(penguin, TOON_UNASSOCIATED); \
-   ToonSetVelocity(penguin, RandInt(2)*2-1, 3)
+   ToonSetVelocity(penguin, Speed(DRIFT_SPEED)*(RandInt(2)*2-1), \
+         Speed(FALL_SPEED))
 
 #define MakeClimber(penguin) \
    ToonSetType(penguin, PENGUIN_CLIMBER, (penguin)->direction, \
          TOON_DOWN); \
    ToonSetAssociation(penguin, (penguin)->direction); \
-   ToonSetVelocity((penguin),0,-4)
+   ToonSetVelocity((penguin),0,-Speed(CLIMB_SPEED))
 
 #define MakeWalker(penguin) \
    ToonSetType(penguin, PENGUIN_WALKER, \
          (penguin)->direction,TOON_DOWN); \
    ToonSetAssociation(penguin, TOON_DOWN); \
-   ToonSetVelocity(penguin, 4*((2*(penguin)->direction)-1), 0)
+   ToonSetVelocity(penguin, Speed(WALK_SPEED)*((2*(penguin)->direction)-1), 0)
 
 #define MakeFaller(penguin) \
-   ToonSetVelocity(penguin, ((penguin)->direction)*2-1, 3); \
+   ToonSetVelocity(penguin, Speed(DRIFT_SPEED)*(((penguin)->direction)*2-1), \
+         Speed(FALL_SPEED)); \
    ToonSetType(penguin, PENGUIN_FALLER, \
          PENGUIN_FORWARD,TOON_DOWN); \
    ToonSetAssociation(penguin, TOON_UNASSOCIATED)
 
+/* The scale of each display's images, from ToonScale() */
+__thread double sprite_scale=1.0;
+
+/* Each display has a random number generator of its own (xorshift), so
+ * that its state can go in a snapshot */
+__thread unsigned int random_state=1;
+
+unsigned int Random() {
+   random_state ^= random_state << 13;
+   random_state ^= random_state >> 17;
+   random_state ^= random_state << 5;
+   return random_state;
+}
+
+/* Put a new penguin at the top of a monitor picked at random: just above
+ * the screen, or just inside a monitor that has something above it */
+void DropIn(Toon *penguin) {
+   int x, y, width, height;
+   ToonMonitorGeometry(RandInt(ToonMonitors()), &x, &y, &width, &height);
+   ToonSetPosition(penguin,
+         x + RandInt(width - (int) (PENGUIN_DEFAULTWIDTH*sprite_scale)),
+         y > 0 ? y : 1 - (int) (PENGUIN_DEFAULTHEIGHT*sprite_scale));
+}
+
 void ShowUsage(char **argv) {
    fprintf(stdout,"Usage: %s [options]\n",argv[0]);
    fprintf(stdout,"Options:\n");
-   fprintf(stdout,"  -display <display>        Send the penguins to <display>'\n");
+   fprintf(stdout,"  -display <display>        Send the penguins to <display>' (may be repeated)\n");
+   fprintf(stdout,"  -backend <name>           Use display backend <name> (xlib, async, null)\n");
+   fprintf(stdout,"  -theme <dir>              Load the penguin images from <dir>\n");
+   fprintf(stdout,"  -scale <factor>           Enlarge the penguins (default: auto, from the DPI)\n");
+   fprintf(stdout,"  -smooth                   Scale by any factor, smoothly, not by whole pixels\n");
+   fprintf(stdout,"  -share                    Share the images with other instances\n");
+   fprintf(stdout,"  -config <file>            Apply the commands in <file>, and again when it changes\n");
+   fprintf(stdout,"  -control <path>           Accept commands on a Unix socket\n");
    fprintf(stdout,"  -delay <millisecs>        Set delay between frames (default %d)\n",
          DEFAULT_DELAY);
    fprintf(stdout,"  -n, -penguins <n>         Create <n> penguins (max %d)\n",
          MAX_PENGUINS);
    fprintf(stdout,"  -ignorepopups             Penguins ignore `popup' windows\n");
    fprintf(stdout,"  -rectwin                  Regard shaped windows as rectangular\n");
+   fprintf(stdout,"  -gapvoids                 Let penguins fall into the gaps between monitors\n");
+   fprintf(stdout,"  -vsync                    Start frames on the display's vertical blank\n");
+   fprintf(stdout,"  -adaptive                 Slow down or pause while nothing can be seen\n");
+   fprintf(stdout,"  -fulldetail               Move hidden penguins every frame too\n");
+   fprintf(stdout,"  -shy                      Penguins walk away from the mouse pointer\n");
+   fprintf(stdout,"  -snapshot <file>          Save the penguins to <file> on exit, and restore them\n");
+   fprintf(stdout,"  -render <file>            Write frames to <file> (- for stdout) as fast as they\n");
+   fprintf(stdout,"                            can be made, as Y4M or, if it ends .ppm, PPM images\n");
+   fprintf(stdout,"  -frames <n>               Stop -render after <n> frames (default %d)\n",
+         RENDER_FRAMES);
+   fprintf(stdout,"  -layout <file>            Put the null backend's windows where <file> says\n");
+   fprintf(stdout,"  -seed <n>                 Start the random numbers from <n>\n");
+   fprintf(stdout,"  -stats <file>             Write frame statistics to <file> every second\n");
+   fprintf(stdout,"  -statsocket <path>        Serve frame statistics on a Unix socket\n");
    fprintf(stdout,"  -q, -quiet, --quiet       Suppress message on exit\n");
    fprintf(stdout,"  -v, -version, --version   Show version information\n");
    fprintf(stdout,"  -h, -?, -help, --help     Show this message\n");
 };
 
 
+/* The windows have moved: rebuild the window region and carry the toons
+ * that were standing on (or clinging to) windows along with them */
+void Rescan(Toon *penguin, int npenguins) {
+   ToonStatsBegin(TOON_PHASE_RESCAN);
+   ToonCalculateAssociations(penguin,npenguins);
+   ToonLocateWindows();
+   ToonRelocateAssociated(penguin,npenguins);
+   ToonStatsEnd(TOON_PHASE_RESCAN);
+}
+
 /* Global variables */
 int finished=0;
 int new_positions=0;
 int verbose=1;
 
-/*** MAIN PROGRAM ***/
-int main (int argc, char **argv) {
-   unsigned long sleep_usec=DEFAULT_DELAY*1000;
-   unsigned long configure_mask = TOON_SIDEBOTTOMBLOCK 
-         | TOON_CATCHSIGNALS;
-   char *display_name=NULL;
-   int windows_moved,status,npenguins=8,i,n,direction;
-   Toon penguin[MAX_PENGUINS];
-   char prefd[MAX_PENGUINS]; /* preferred direction; -1 means none */
-   char prefclimb[MAX_PENGUINS]; /* climbs when possible */
-   char hold_on[MAX_PENGUINS];
-   /* Handle command-line arguments */
-   for (n=1;n<argc;n++) {
-      if (strcmp(argv[n],"-n") == 0 || strcmp(argv[n],"-penguins") == 0) {
-         if (argc > ++n) {
-            npenguins=atoi(argv[n]);
-            if (npenguins > MAX_PENGUINS) {
-               fprintf(stderr,"Warning: only %d penguins created\n",
-                     npenguins=MAX_PENGUINS);
-            }
-            else if (npenguins <= 0) {
-               fprintf(stderr,"Warning: no penguins created\n");
-                     npenguins=0;
-            }
-         }
-         else {
-            fprintf(stderr,"Error: number of penguins not specified\n");
-            ShowUsage(argv);
-            exit(1);
-         }
+/* Options, the same for every display */
+unsigned long configure_mask = TOON_SIDEBOTTOMBLOCK | TOON_CATCHSIGNALS;
+char *backend_name=NULL;
+char *theme_option=NULL;
+char *config_file=NULL;
+char *control_option=NULL;
+char *stats_file_option=NULL, *stats_socket_option=NULL;
+char *snapshot_option=NULL;
+char *layout_option=NULL;
+FILE *render_out=NULL; /* -render: frames go here, not to a display */
+int render_format=TOON_FRAME_Y4M;
+long render_frames=RENDER_FRAMES;
+unsigned int random_seed=1;
+double scale_option=TOON_SCALEAUTO;
+int scale_filter_option=TOON_SCALENEAREST;
+int seed_given=0;
+int start_penguins=8;
+int start_adaptive=0;
+int start_shy=0;
+int full_detail=0;
+unsigned long start_delay=DEFAULT_DELAY*1000;
+int ndisplays=0;
+
+/* Each display is run by a thread of its own, the first by the main
+ * thread, and everything below is kept separately for each */
+__thread int first_display=0;
+__thread int adaptive=0;
+__thread int shy=0;
+__thread unsigned long sleep_usec=DEFAULT_DELAY*1000;
+
+/* The penguins, resized by SetPenguins() */
+__thread Toon *penguin=NULL;
+__thread char *prefd=NULL; /* preferred direction; -1 means none */
+__thread char *prefclimb=NULL; /* climbs when possible */
+__thread char *hold_on=NULL;
+__thread int npenguins=0, penguins_allocated=0;
+
+/* The images: penguin_data, or a theme loaded from theme_dir */
+__thread ToonData *data=penguin_data;
+__thread int data_ntypes=PENGUIN_TYPES; /* installed, of data */
+__thread char *theme_dir=NULL;
+__thread int theme_watch=-1, config_watch=-1;
+__thread int live=0; /* reconfigurable while running */
+
+/* The first display takes the commands from the control socket and the
+ * config file, and passes them on to the others through this log */
+char **command_log=NULL;
+int ncommands=0;
+pthread_mutex_t command_lock=PTHREAD_MUTEX_INITIALIZER;
+__thread int commands_done=0;
+
+/* Snapshots are asked for by SIGUSR2, which every display answers */
+volatile sig_atomic_t snapshots_wanted=0;
+__thread sig_atomic_t snapshots_done=0;
+__thread char *snapshot_file=NULL;
+
+void SnapshotSignalHandler(int sig) {
+   snapshots_wanted++;
+}
+
+/* Change the number of penguins: those already there carry on, and new
+ * ones fall in from the top as at startup */
+void SetPenguins(int n) {
+   int i;
+   if (n > MAX_PENGUINS) n = MAX_PENGUINS;
+   if (n < 0) n = 0;
+   if (n > penguins_allocated) {
+      if ((penguin = realloc(penguin, n*sizeof(Toon))) == NULL
+            || (prefd = realloc(prefd, n)) == NULL
+            || (prefclimb = realloc(prefclimb, n)) == NULL
+            || (hold_on = realloc(hold_on, n)) == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         exit(1);
       }
-      else if (strcmp(argv[n],"-delay") == 0) {
-         if (argc > ++n) {
-            sleep_usec=1000*atoi(argv[n]);
-         }
-         else {
-            fprintf(stderr,"Error: delay in milliseconds not specified\n");
-            ShowUsage(argv);
-            exit(1);
-         }
+      penguins_allocated = n;
+   }
+   if (n < npenguins) {
+      ToonErase(penguin+n, npenguins-n);
+   }
+   for (i=npenguins;i<n;i++) {
+      /* Never drawn, so nothing to erase */
+      memset(penguin+i, 0, sizeof(Toon));
+      prefd[i] = -1;
+      prefclimb[i] = 0;
+      hold_on[i] = 0;
+      InitPenguin(penguin+i);
+   }
+   npenguins = n;
+}
+
+/* Keep the penguins and everything about them in the snapshot file:
+ * the random state, then prefd[], prefclimb[] and hold_on[] */
+void SaveSnapshot() {
+   size_t size = sizeof(random_state) + 3*npenguins;
+   char *state;
+   if ((state = malloc(size)) == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      exit(1);
+   }
+   memcpy(state, &random_state, sizeof(random_state));
+   memcpy(state + sizeof(random_state), prefd, npenguins);
+   memcpy(state + sizeof(random_state) + npenguins, prefclimb, npenguins);
+   memcpy(state + sizeof(random_state) + 2*npenguins, hold_on, npenguins);
+   if (ToonSnapshotSave(snapshot_file, penguin, npenguins, state, size))
+      fprintf(stderr,"Warning: %s\n", ToonErrorMessage());
+   free(state);
+}
+
+/* Carry on from the snapshot file, if there is a good one */
+/* Returns 1 if the penguins were restored from it */
+int LoadSnapshot() {
+   Toon *toons;
+   char *state;
+   size_t size;
+   int n;
+   if ((toons = ToonSnapshotLoad(snapshot_file, &n, (void **) &state, &size))
+         == NULL) {
+      if (access(snapshot_file, F_OK) == 0)
+         fprintf(stderr,"Warning: %s\n", ToonErrorMessage());
+      return 0;
+   }
+   if (n <= MAX_PENGUINS && size == sizeof(random_state) + 3*n) {
+      SetPenguins(n);
+      memcpy(penguin, toons, n*sizeof(Toon));
+      memcpy(&random_state, state, sizeof(random_state));
+      memcpy(prefd, state + sizeof(random_state), n);
+      memcpy(prefclimb, state + sizeof(random_state) + n, n);
+      memcpy(hold_on, state + sizeof(random_state) + 2*n, n);
+   }
+   else {
+      fprintf(stderr,"Warning: snapshot %s is not of penguins\n",
+            snapshot_file);
+      n = -1;
+   }
+   free(toons);
+   if (state) free(state);
+   return n >= 0;
+}
+
+/* A walker that meets another coming the other way: both turn round.
+ * Returns 1 if they did */
+int Bump(int i) {
+   int near[MAX_BUMPS], n, j;
+   Toon *other;
+   n = ToonNeighbours(penguin+i, 0, near, MAX_BUMPS);
+   for (j=0; j<n; j++) {
+      other = penguin+near[j];
+      if (other->type == PENGUIN_WALKER
+            && other->direction != penguin[i].direction
+            && abs(other->y - penguin[i].y) < JUMP_DISTANCE
+            && (other->x - penguin[i].x) * penguin[i].u > 0) {
+         penguin[i].direction = !penguin[i].direction;
+         MakeWalker(penguin+i);
+         other->direction = !other->direction;
+         MakeWalker(other);
+         return 1;
       }
-      else if (strcmp(argv[n],"-display") == 0) {
-         if (argc > ++n) {
-            display_name=argv[n];
-         }
-         else {
-            fprintf(stderr,"Error: display not specified\n");
-            ShowUsage(argv);
-            exit(1);
-         }
+   }
+   return 0;
+}
+
+/* Walkers near the mouse pointer turn their backs on it. The pointer is
+ * followed from events, so this costs no round trips */
+void Shy() {
+   int near[MAX_SHY], n, j, x;
+   Toon *p;
+   if (!ToonPointer(&x, NULL, NULL)) return;
+   n = ToonNearPointer((int) (SHY_DISTANCE*sprite_scale), near, MAX_SHY);
+   for (j=0; j<n; j++) {
+      p = penguin+near[j];
+      if (p->type == PENGUIN_WALKER && p->direction
+            == (x > p->x + (int) (data[p->type].width*sprite_scale/2))) {
+         p->direction = !p->direction;
+         MakeWalker(p);
       }
-      else if (strcmp(argv[n],"-ignorepopups") == 0 ) {
-         configure_mask |= TOON_NOSOLIDPOPUPS;
+   }
+}
+
+/* Throw out particles from a penguin, at height `fraction' of the way
+ * down it, unless it is out of sight */
+void Burst(Toon *penguin, double fraction, int n, int speed, int life,
+      unsigned int colour) {
+   if (penguin->detail != TOON_DETAILFULL) return;
+   ToonBurst(penguin->x + (int) (data[penguin->type].width*sprite_scale/2),
+         penguin->y + (int) (data[penguin->type].height*sprite_scale*fraction),
+         n, Speed(speed), life, colour);
+}
+
+/* Switch to the images in `dir', or back to the built-in ones if dir is
+ * NULL. Each penguin keeps its place, with its feet where they were */
+/* Returns 0 on success, 1 if the theme can't be used */
+int SetTheme(char *dir) {
+   ToonData *new_data = penguin_data, *old_data = data;
+   int i, ntypes = PENGUIN_TYPES, type, status;
+   if (dir) {
+      if ((new_data = ToonLoadTheme(dir, &ntypes)) == NULL)
+         return 1;
+      if (ntypes < PENGUIN_TYPES) {
+         ToonFreeTheme(new_data);
+         return 1;
       }
-      else if (strcmp(argv[n],"-rectwin") == 0 ) {
-         configure_mask |= TOON_NOSHAPEDWINDOWS;
+   }
+   ToonErase(penguin,npenguins);
+   if ((status = ToonInstallData(new_data, ntypes))) {
+      /* Back to the old images, which did fit */
+      if (new_data != penguin_data)
+         ToonFreeTheme(new_data);
+      if (ToonInstallData(old_data, data_ntypes)) {
+         fprintf(stderr,"Error: can't install penguin images (%d)\n", status);
+         exit(1);
       }
-      else if (strcmp(argv[n],"-h") == 0 || strcmp(argv[n],"-help") == 0 || 
-               strcmp(argv[n],"-?") == 0 || strcmp(argv[n],"--help") == 0) {
-         fprintf(stdout,"XPenguins %s (%s) by %s\n",
-               XPENGUINS_VERSION, XPENGUINS_DATE, XPENGUINS_AUTHOR);
-         ShowUsage(argv);
-         exit(0);
+      return 1;
+   }
+   for (i=0;i<npenguins;i++) {
+      type = penguin[i].type;
+      penguin[i].x += (int) ((old_data[type].width - new_data[type].width)
+            *sprite_scale)/2;
+      penguin[i].y += (int) ((old_data[type].height - new_data[type].height)
+            *sprite_scale);
+      penguin[i].frame %= new_data[type].nframes;
+      penguin[i].direction %= new_data[type].ndirections;
+   }
+   data_ntypes = ntypes;
+   if (old_data != penguin_data)
+      ToonFreeTheme(old_data);
+   data = new_data;
+
+   if (theme_dir != dir) {
+      if (theme_dir) free(theme_dir);
+      theme_dir = dir ? strdup(dir) : NULL;
+      if (theme_watch >= 0) ToonControlUnwatch(theme_watch);
+      theme_watch = -1;
+      /* The watches are shared by all, and only the first display polls
+       * them; the others are told of changes by PostCommand() */
+      if (live && first_display && theme_dir)
+         theme_watch = ToonControlWatch(theme_dir);
+   }
+   return 0;
+}
+
+void ReadConfig(char *file);
+
+/* Carry out one command, from the control socket or the config file */
+/* Returns 0 on success, 1 on failure with a message in `reply' */
+int Command(char *line, char *reply, int n) {
+   char word[32], arg[256];
+   int nargs, on;
+   unsigned long flag = 0;
+
+   reply[0] = '\0';
+   nargs = sscanf(line, " %31s %255s", word, arg);
+   if (nargs < 1 || word[0] == '#')
+      return 0;
+   on = nargs == 2 && (strcmp(arg, "on") == 0 || strcmp(arg, "1") == 0);
+   if (strcmp(word, "penguins") == 0 && nargs == 2) {
+      SetPenguins(atoi(arg));
+   }
+   else if (strcmp(word, "delay") == 0 && nargs == 2) {
+      if (atoi(arg) < 1) {
+         snprintf(reply, n, "delay must be at least 1 millisecond");
+         return 1;
       }
-      else if (strcmp(argv[n],"-v") == 0 || strcmp(argv[n],"-version") == 0 || 
-               strcmp(argv[n],"--version") == 0) {
-         fprintf(stdout,"XPenguins %s\n", XPENGUINS_VERSION);
-         exit(0);
+      sleep_usec = 1000*atoi(arg);
+   }
+   else if (strcmp(word, "theme") == 0 && nargs == 2) {
+      if (SetTheme(strcmp(arg, "default") == 0 ? NULL : arg)) {
+         snprintf(reply, n, "can't use theme %s: %s", arg,
+               ToonErrorMessage());
+         return 1;
       }
-      else if (strcmp(argv[n],"-q") == 0 || strcmp(argv[n],"-quiet") == 0 || 
-               strcmp(argv[n],"--quiet") == 0) {
-         verbose=0;
+   }
+   else if (strcmp(word, "adaptive") == 0 && nargs == 2) {
+      adaptive = on;
+   }
+   else if (strcmp(word, "shy") == 0 && nargs == 2) {
+      shy = on;
+   }
+   else if (strcmp(word, "ignorepopups") == 0 && nargs == 2) {
+      flag = on ? TOON_NOSOLIDPOPUPS : TOON_SOLIDPOPUPS;
+   }
+   else if (strcmp(word, "rectwin") == 0 && nargs == 2) {
+      flag = on ? TOON_NOSHAPEDWINDOWS : TOON_SHAPEDWINDOWS;
+   }
+   else if (strcmp(word, "snapshot") == 0 && snapshot_file) {
+      SaveSnapshot();
+   }
+   else if (strcmp(word, "layout") == 0 && nargs == 2) {
+      /* For -layout, to run the penguins again on this desktop */
+      if (ToonNullSaveLayout(arg)) {
+         snprintf(reply, n, "%s", ToonErrorMessage());
+         return 1;
       }
-      else {
-         fprintf(stderr,"Warning: `%s' not understood - use `-h' for a list of options\n",argv[n]);
+   }
+   else if (strcmp(word, "reload") == 0 && config_file) {
+      ReadConfig(config_file);
+   }
+   else {
+      snprintf(reply, n, "not understood: %s", word);
+      return 1;
+   }
+   if (flag) {
+      /* The window region depends on these */
+      ToonConfigure(flag);
+      Rescan(penguin,npenguins);
+   }
+   return 0;
+}
+
+/* Apply every command in a file */
+void ReadConfig(char *file) {
+   FILE *f;
+   char line[256], reply[128];
+   if ((f = fopen(file, "r")) == NULL) {
+      fprintf(stderr,"Warning: can't read %s\n", file);
+      return;
+   }
+   while (fgets(line, sizeof(line), f)) {
+      if (Command(line, reply, sizeof(reply)))
+         fprintf(stderr,"Warning: %s: %s\n", file, reply);
+   }
+   fclose(f);
+}
+
+/* Pass a command on to the other displays */
+void PostCommand(char *line) {
+   char *copy;
+   if (ndisplays < 2) return;
+   pthread_mutex_lock(&command_lock);
+   if ((copy = strdup(line)) == NULL || (command_log = realloc(command_log,
+         (ncommands+1)*sizeof(char *))) == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      exit(1);
+   }
+   command_log[ncommands++] = copy;
+   /* ...which the first display has already carried out */
+   commands_done = ncommands;
+   pthread_mutex_unlock(&command_lock);
+}
+
+/* Apply whatever has been asked for since the last frame */
+void Control() {
+   char line[256], reply[128], *command;
+   int watch;
+   int status;
+   if (!first_display) {
+      /* Logged commands are never freed, so need no lock once found */
+      for (;;) {
+         pthread_mutex_lock(&command_lock);
+         command = commands_done < ncommands
+               ? command_log[commands_done++] : NULL;
+         pthread_mutex_unlock(&command_lock);
+         if (command == NULL) break;
+         Command(command, reply, sizeof(reply));
+      }
+      return;
+   }
+   while ((status = ToonControlPoll(line, sizeof(line), &watch))
+         != TOON_CONTROL_NONE) {
+      if (status == TOON_CONTROL_COMMAND) {
+         Command(line, reply, sizeof(reply));
+         ToonControlReply(reply[0] ? reply : "ok");
+         PostCommand(line);
+      }
+      else if (watch == config_watch) {
+         ReadConfig(config_file);
+         PostCommand("reload");
+      }
+      else if (watch == theme_watch && theme_dir) {
+         if (SetTheme(theme_dir))
+            fprintf(stderr,"Warning: can't reload theme %s: %s\n",
+                  theme_dir, ToonErrorMessage());
+         snprintf(line, sizeof(line), "theme %s", theme_dir);
+         PostCommand(line);
       }
    }
+}
 
-   /* reset random-number generator */
-   srand(time((long *) NULL));
+/* Carry out whatever commands have come in, and take any snapshot asked
+ * for; once a frame, or every so often while there is nothing to draw */
+void Service() {
+   Control();
+   if (snapshot_file && snapshots_done != snapshots_wanted) {
+      snapshots_done = snapshots_wanted;
+      SaveSnapshot();
+   }
+}
+
+/* Run the penguins on one display until a signal is caught */
+/* Returns NULL, or its argument if the display could not be opened */
+void *RunDisplay(void *arg) {
+   char *display_name=arg;
+   int ntypes=PENGUIN_TYPES;
+   int status,i,n,direction;
+   int changed,idle_level=0,restored=0,sparks=0,timed=0;
+   unsigned long frame_usec,longest;
+   long frames=0;
+   struct timespec started, stopped, now, last;
+   double seconds;
+   char *c;
 
    /* contact X server and set up some basic X stuff */
-   if (ToonOpenDisplay(display_name) == NULL) {
+   if (backend_name) ToonSetBackend(backend_name);
+   if (layout_option && ToonNullReadLayout(layout_option)) {
       fprintf(stderr,"Error: %s\n", ToonErrorMessage());
       exit(1);
+   }
+   else if (render_out && !layout_option)
+      ToonNullLayout(RENDER_WIDTH, RENDER_HEIGHT, RENDER_WINDOWS, 1,
+            random_seed);
+   if (ToonOpenDisplay(display_name)) {
+      fprintf(stderr,"Error: %s: %s\n", display_name ? display_name
+            : "default display", ToonErrorMessage());
+      return arg;
    };
+   if (render_out && ToonNullFramebuffer() == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      exit(1);
+   }
    /* Set up various preferences: Edge of screen is solid, and if a signal is caught
     * then exit the main event loop */
-   ToonConfigure(configure_mask);
+   if (ToonConfigure(configure_mask) && first_display)
+      fprintf(stderr,"Warning: %s\n", ToonErrorMessage());
+   /* Frame statistics: dumped on SIGUSR1, and optionally to a file or
+    * socket for monitoring; only the first display's are published */
+   if (first_display
+         && ToonStatsOpen(stats_file_option, stats_socket_option)) {
+      fprintf(stderr,"Warning: %s\n", ToonErrorMessage());
+   }
    /* Set the distance the window can move (up, down, left, right) and penguin
     * can still cling on */
    ToonSetMaximumRelocate(16,16,16,16);
-   /* Send the pixmaps to the X server  - penguin_data should have been 
-    * defined in penguins/def.h */
-   ToonInstallData(penguin_data,PENGUIN_TYPES);
+   if (!full_detail)
+      ToonSetDetail(HIDDEN_STEP, OFFSCREEN_STEP);
+   /* Send the pixmaps to the X server - the theme was checked by main() */
+   if (theme_option) {
+      theme_dir=strdup(theme_option);
+      if ((data = ToonLoadTheme(theme_dir, &ntypes)) == NULL) {
+         fprintf(stderr,"Error: %s\n", ToonErrorMessage());
+         exit(1);
+      }
+   }
+   ToonSetScale(scale_option, scale_filter_option);
+   if ((status = ToonInstallData(data,ntypes))) {
+      fprintf(stderr,"Error: can't install penguin images (%d)\n", status);
+      ToonCloseDisplay();
+      exit(1);
+   }
+   data_ntypes = ntypes;
+   sprite_scale = ToonScale();
+   ToonSetStepHeight(JUMP_DISTANCE);
+   ToonSetParticleGravity(Speed(PARTICLE_GRAVITY));
 
-   /* initialise penguins */
-   for (i=0;i<npenguins;i++) {
-      prefd[i] = -1;
-      prefclimb[i] = 0;
-      hold_on[i] = 0;
-      InitPenguin(penguin+i);
+   /* A random sequence of its own for each display */
+   random_state = random_seed;
+   for (c = display_name; c && *c; c++)
+      random_state = random_state*31 + *c;
+   if (random_state == 0) random_state = 1;
+
+   /* initialise penguins, or carry on from where the last run left off;
+    * each display keeps a snapshot of its own if there are several */
+   sleep_usec = start_delay;
+   adaptive = render_out ? 0 : start_adaptive;
+   shy = start_shy;
+   if (snapshot_option) {
+      if (ndisplays > 1) {
+         if ((snapshot_file = malloc(strlen(snapshot_option)
+               + strlen(display_name) + 2)) == NULL) {
+            fprintf(stderr,"Error: Out of memory\n");
+            exit(1);
+         }
+         sprintf(snapshot_file, "%s.%s", snapshot_option, display_name);
+      }
+      else
+         snapshot_file = strdup(snapshot_option);
+      restored = LoadSnapshot();
    }
+   if (!restored)
+      SetPenguins(start_penguins);
+
+   /* Live reconfiguration: a control socket, and the config file and
+    * theme are watched for changes. The other displays follow the first */
+   if (first_display && control_option) {
+      if (ToonControlOpen(control_option))
+         fprintf(stderr,"Warning: %s\n", ToonErrorMessage());
+      else
+         live = 1;
+   }
+   if (config_file) {
+      ReadConfig(config_file);
+      if (first_display) {
+         live = 1;
+         if ((config_watch = ToonControlWatch(config_file)) < 0)
+            fprintf(stderr,"Warning: %s\n", ToonErrorMessage());
+      }
+   }
+   if (live && first_display && theme_dir)
+      theme_watch = ToonControlWatch(theme_dir);
 
    /* Find out where the windows are - should be done just before beginning the 
-    * event loop */
-   ToonLocateWindows();
+    * event loop. Restored penguins go with the windows they were on */
+   if (restored)
+      Rescan(penguin,npenguins);
+   else
+      ToonLocateWindows();
    /* Event loop */
+   clock_gettime(CLOCK_MONOTONIC, &started);
    while (!finished) {
+      ToonStatsBegin(TOON_PHASE_FRAME);
+      Service();
+      /* Move the penguins on by the time since the last frame, as near as
+       * the clock says; a stall can't send them leaping across the screen,
+       * and a rendered stream keeps to the delay it will be played at */
+      frame_usec = sleep_usec<<idle_level;
+      longest = frame_usec > MAX_STEP_USEC ? frame_usec : MAX_STEP_USEC;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (timed && !render_out) {
+         frame_usec = (now.tv_sec - last.tv_sec)*1000000
+               + (now.tv_nsec - last.tv_nsec)/1000;
+         if (frame_usec > longest) frame_usec = longest;
+         if (frame_usec < MIN_STEP_USEC) frame_usec = MIN_STEP_USEC;
+      }
+      last = now;
+      timed = 1;
+      ToonSetTimeStep(frame_usec/1e6, ANIMATION_RATE);
       /* check if windows have moved, and flush the display */
-      if ( (windows_moved = ToonWindowsMoved()) ) {
+      if (ToonWindowsMoved()) {
          /* if so, check for squashed toons */
-         ToonCalculateAssociations(penguin,npenguins);
-         windows_moved = ToonLocateWindows();
-         ToonRelocateAssociated(penguin,npenguins);
+         Rescan(penguin,npenguins);
       }
+      ToonStatsBegin(TOON_PHASE_BEHAVIOUR);
+      ToonPartition(penguin,npenguins);
+      ToonDetail(penguin,npenguins);
+      ToonIndexNeighbours(penguin,npenguins);
+      if (shy) Shy();
       for (i=0;i<npenguins;i++) {
          if (!penguin[i].active) {
             InitPenguin(penguin+i);
             continue;
          }
+         else if (penguin[i].monitor < 0 && penguin[i].y >= 0
+               && !ToonVisible(penguin+i)) {
+            /* Fallen into the space between monitors: gone for good */
+            penguin[i].active=0;
+            continue;
+         }
+         else if (!ToonDue(penguin+i)) {
+            /* Out of sight, and moved only every few frames */
+            continue;
+         }
          else {
-            if (ToonBlocked(penguin+i,TOON_HERE)) {
+            /* Nothing can be in the way of a penguin on the graph */
+            if (ToonOnGraph(penguin+i) < 0
+                  && ToonBlocked(penguin+i,TOON_HERE)) {
                ToonSetType(penguin+i,PENGUIN_EXPLOSION,
                      PENGUIN_FORWARD,TOON_HERE);
                ToonSetAssociation(penguin+i, TOON_UNASSOCIATED);
+               ToonStatsCount(TOON_STAT_EXPLOSIONS, 1);
+               Burst(penguin+i, 0.5, SPARKS, SPARK_SPEED, SPARK_LIFE,
+                     0xffd040);
+               Burst(penguin+i, 0.5, SPARKS/2, SPARK_SPEED/2, SPARK_LIFE,
+                     0xff6020);
             }
 
             status=ToonAdvance(penguin+i,TOON_MOVE);
@@ -233,6 +764,8 @@ int main (int argc, char **argv) {
                case PENGUIN_FALLER:
                   if (status != TOON_OK) {
                      if (ToonBlocked(penguin+i,TOON_DOWN)) {
+                        Burst(penguin+i, 1.0, DUST, DUST_SPEED, DUST_LIFE,
+                              0xb8b0a0);
                         if (prefd[i]>-1)
                            penguin[i].direction=prefd[i];
                         else
@@ -242,7 +775,8 @@ int main (int argc, char **argv) {
                      }
                      else {
                         if (RandInt(2)) {
-                           ToonSetVelocity(penguin+i,-penguin[i].u,3);
+                           ToonSetVelocity(penguin+i,-penguin[i].u,
+                                 Speed(FALL_SPEED));
                         }
                         else {
                            penguin[i].direction = penguin[i].u>0;
@@ -254,6 +788,8 @@ int main (int argc, char **argv) {
 
                case PENGUIN_TUMBLER:
                   if (status != TOON_OK) {
+                     Burst(penguin+i, 1.0, DUST, DUST_SPEED, DUST_LIFE,
+                           0xb8b0a0);
                      if (prefd[i]>-1)
                         penguin[i].direction=prefd[i];
                      else
@@ -261,21 +797,27 @@ int main (int argc, char **argv) {
                      MakeWalker(penguin+i);
                      prefd[i]=-1;
                   }
-                  else if (penguin[i].v < 8) {
-                     penguin[i].v +=1;
+                  else if (penguin[i].v < Speed(TUMBLE_SPEED)) {
+                     penguin[i].v += (int) (Speed(TUMBLE_ACCEL)*(frame_usec/1e6));
+                     if (penguin[i].v > Speed(TUMBLE_SPEED))
+                        penguin[i].v = Speed(TUMBLE_SPEED);
                   }
                   break;
 
                case PENGUIN_WALKER:
                   if (status != TOON_OK) {
                      if (status == TOON_BLOCKED) {
-                        /* Try to step up... */
-                        int u = penguin[i].u;
-                        if (!ToonOffsetBlocked(penguin+i, u, -JUMP_DISTANCE)) {
-                           ToonMove(penguin+i, u, -JUMP_DISTANCE);
-                           ToonSetVelocity(penguin+i, 0, JUMP_DISTANCE-1);
-                           ToonAdvance(penguin+i, TOON_MOVE);
-                           ToonSetVelocity(penguin+i, u, 0);
+                        /* Try to step up, as the graph says if it
+                           knows of a step here... */
+                        int xoffset = (2*penguin[i].direction-1)
+                              * JUMP_DISTANCE/2;
+                        if (ToonTakeStep(penguin+i, penguin[i].direction)
+                              == TOON_OK) {
+                           /* ...that took */
+                        }
+                        else if (!ToonOffsetBlocked(penguin+i, xoffset, -JUMP_DISTANCE)) {
+                           ToonMove(penguin+i, xoffset, -JUMP_DISTANCE);
+                           ToonAdvanceBy(penguin+i, 0, JUMP_DISTANCE-1, TOON_MOVE);
                         }
                         else {
                            /* Blocked! We can turn round, fly or climb... */
@@ -288,7 +830,9 @@ int main (int argc, char **argv) {
                                        PENGUIN_FORWARD,TOON_DOWN);
                                  ToonSetAssociation(penguin+i, TOON_UNASSOCIATED);
                                  ToonSetVelocity(penguin+i,RandInt(5)
-                                       * (-penguin[i].u/4),-3);
+                                       * (penguin[i].u > 0 ? -1 : 1)
+                                       * Speed(DRIFT_SPEED),
+                                       -Speed(FLOAT_SPEED));
                                  break;
                               default:
                                  penguin[i].direction = (!penguin[i].direction);
@@ -297,22 +841,22 @@ int main (int argc, char **argv) {
                         }
                      }
                   }
-                  else if (!ToonBlocked(penguin+i,TOON_DOWN)) {
+                  else if (ToonOnGraph(penguin+i) < 0
+                        && !ToonBlocked(penguin+i,TOON_DOWN)) {
                      /* Try to step down... */
-                     ToonSetVelocity(penguin+i, 0, JUMP_DISTANCE);
-                     status=ToonAdvance(penguin+i,TOON_MOVE);
+                     status=ToonAdvanceBy(penguin+i, 0, JUMP_DISTANCE, TOON_MOVE);
                      if (status == TOON_OK) {
                         prefd[i]=penguin[i].direction;
                         ToonSetType(penguin+i, PENGUIN_TUMBLER,
                               PENGUIN_FORWARD,TOON_DOWN);
                         ToonSetAssociation(penguin+i, TOON_UNASSOCIATED);
-                        ToonSetVelocity(penguin+i, 0, 1);
+                        ToonSetVelocity(penguin+i, 0, Speed(DRIFT_SPEED));
                         prefclimb[i]=0;
                      }
-                     else {
-                        ToonSetVelocity(penguin+i, 4*((2*penguin[i].direction)-1), 0);
-                     }
                   }
+                  /* Turn round on meeting another walker head on */
+                  if (status == TOON_OK && penguin[i].type == PENGUIN_WALKER)
+                     Bump(i);
                   break;
 
                case PENGUIN_CLIMBER:
@@ -324,13 +868,12 @@ int main (int argc, char **argv) {
                   }
                   else if (status == TOON_BLOCKED) {
                      /* Try to step out... */
-                     int v = penguin[i].v;
+                     int yoffset = -JUMP_DISTANCE/2;
                      int xoffset = (1-direction*2) * JUMP_DISTANCE;
-                     if (!ToonOffsetBlocked(penguin+i, xoffset, v)) {
-                        ToonMove(penguin+i, xoffset, v);
-                        ToonSetVelocity(penguin+i, -xoffset-(1-direction*2), 0);
-                        ToonAdvance(penguin+i, TOON_MOVE);
-                        ToonSetVelocity(penguin+i, 0, v);
+                     if (!ToonOffsetBlocked(penguin+i, xoffset, yoffset)) {
+                        ToonMove(penguin+i, xoffset, yoffset);
+                        ToonAdvanceBy(penguin+i, -xoffset-(1-direction*2), 0,
+                              TOON_MOVE);
                      }
                      else {
                         penguin[i].direction = (!direction);
@@ -338,13 +881,12 @@ int main (int argc, char **argv) {
                         prefclimb[i]=0;
                      }
                   }
-                  else if (!ToonBlocked(penguin+i,direction)) {
+                  else if (ToonOnGraph(penguin+i) < 0
+                        && !ToonBlocked(penguin+i,direction)) {
                      if (ToonOffsetBlocked(penguin+i, ((2*direction)-1)
                            * JUMP_DISTANCE, 0)) {
-                        ToonSetVelocity(penguin+i, ((2*direction)-1)
-                           * (JUMP_DISTANCE-1), 0);
-                        ToonAdvance(penguin+i, TOON_MOVE);
-                        ToonSetVelocity(penguin+i, 0, -4);
+                        ToonAdvanceBy(penguin+i, ((2*direction)-1)
+                           * (JUMP_DISTANCE-1), 0, TOON_MOVE);
                      }
                      else {
                         MakeWalker(penguin+i);
@@ -367,59 +909,499 @@ int main (int argc, char **argv) {
                        MakeFaller(penguin+i);
                      }
                      else {
-                        ToonSetVelocity(penguin+i,-penguin[i].u, -3);
+                        ToonSetVelocity(penguin+i,-penguin[i].u,
+                              -Speed(FLOAT_SPEED));
                      }
                   }
                   break;
 
                case PENGUIN_EXPLOSION:
+                  /* Hold the explosion for EXPLOSION_USEC */
                   if (!hold_on[i]) {
-                     hold_on[i] = 1;
+                     hold_on[i] = EXPLOSION_USEC/frame_usec > 100 ? 100
+                           : EXPLOSION_USEC/frame_usec < 1 ? 1
+                           : EXPLOSION_USEC/frame_usec;
                   }
-                  else {
+                  else if (--hold_on[i] == 0) {
                      penguin[i].active=0;
-                     hold_on[i]=0;
                   }
              }
          }
       }
-      /* First erase them all, then draw them all - should reduce flickering */
-      ToonErase(penguin,npenguins);
-      ToonDraw(penguin,npenguins);
-      ToonFlush();
-      /* pause */
-      ToonSleep(sleep_usec);
+      ToonAdvanceParticles();
+      ToonStatsEnd(TOON_PHASE_BEHAVIOUR);
+      /* With -adaptive, frames in which nothing visible has changed are
+       * not drawn, and each one in a row halves the frame rate */
+      changed = 1;
+      if (adaptive) {
+         for (i=0, changed=ToonParticles()>0; i<npenguins && !changed; i++)
+            changed = ToonChanged(penguin+i);
+         if (changed)
+            idle_level = 0;
+         else if (idle_level < MAX_IDLE_LEVEL)
+            idle_level++;
+      }
+      if (changed) {
+         /* First erase them all, then draw them all - should reduce flickering */
+         ToonStatsBegin(TOON_PHASE_ERASE);
+         ToonErase(penguin,npenguins);
+         ToonEraseParticles();
+         ToonStatsEnd(TOON_PHASE_ERASE);
+         ToonStatsBegin(TOON_PHASE_DRAW);
+         ToonDraw(penguin,npenguins);
+         ToonDrawParticles();
+         ToonStatsEnd(TOON_PHASE_DRAW);
+         ToonStatsBegin(TOON_PHASE_FLUSH);
+         ToonFlush();
+         ToonStatsEnd(TOON_PHASE_FLUSH);
+      }
+      else {
+         ToonRepair(penguin,npenguins);
+      }
+      ToonStatsEnd(TOON_PHASE_FRAME);
+      ToonStatsFrame();
+      if (render_out) {
+         /* No waiting: the frames are played back at the delay later */
+         if (ToonNullWriteFrame(render_out, render_format, sleep_usec)) {
+            fprintf(stderr,"Error: %s\n", ToonErrorMessage());
+            finished=1;
+         }
+         else if (++frames >= render_frames)
+            finished=1;
+      }
+      else if (adaptive && ToonScreenCovered()) {
+         /* Fullscreen window or screen locked: nothing to draw until the
+          * windows change, but commands, snapshots and statistics are
+          * still seen to every so often */
+         for (;;) {
+            if (ToonWaitEvent(COVERED_USEC) == TOON_WINDOWEVENT) {
+               if (ToonWindowsMoved()) {
+                  Rescan(penguin,npenguins);
+                  idle_level = 0;
+                  break;
+               }
+            }
+            else if (ToonSignal()) {
+               finished=1;
+               break;
+            }
+            else {
+               Service();
+               ToonStatsPoll();
+            }
+         }
+      }
+      else {
+         /* pause until the next frame is due, but keep up with the windows
+          * in the meantime so that toons move with them straight away */
+         while (ToonWaitFrame(sleep_usec<<idle_level) == TOON_WINDOWEVENT) {
+            if (ToonWindowsMoved()) {
+               Rescan(penguin,npenguins);
+               ToonErase(penguin,npenguins);
+               ToonDraw(penguin,npenguins);
+               ToonFlush();
+               idle_level = 0;
+            }
+            /* Penguins uncovered by a window need drawing again now */
+            ToonRepair(penguin,npenguins);
+         }
+      }
       /* Has an interupt signal been received? If so, quit gracefully */
-      finished=ToonSignal();
+      if (ToonSignal()) finished=1;
    }
 
    /* Exit sequence... */
    /* Any more signals (TERM, HUP or INT) and the penguins are 
     * erased immediately */
    ToonConfigure(TOON_EXITGRACEFULLY);
-   if (1) {
+   if (snapshot_file) {
+      /* Quietly, to be picked up again next time */
+      SaveSnapshot();
+   }
+   if (render_out) {
+      clock_gettime(CLOCK_MONOTONIC, &stopped);
+      seconds = (stopped.tv_sec - started.tv_sec)
+            + (stopped.tv_nsec - started.tv_nsec)/1e9;
+      if (verbose)
+         fprintf(stderr,"Rendered %ld frames in %.2f s: %.1f frames a second\n",
+               frames, seconds, seconds > 0 ? frames/seconds : 0.0);
+   }
+   else if (!snapshot_file) {
       /* Nice exit sequence... */
-      if (verbose) fprintf(stderr,"Interupt received: exploding penguins");
+      if (verbose && first_display)
+         fprintf(stderr,"Interupt received: exploding penguins");
       for (i=0;i<npenguins;i++) {
          if (penguin[i].active) {
             ToonSetType(penguin+i,PENGUIN_BOMBER,
                   PENGUIN_FORWARD,TOON_DOWN);
          }
       }
-      for (n=0;n<penguin_data[PENGUIN_BOMBER].nframes;n++) {
+      /* One frame of the explosion at a time, at its own pace, and then
+       * the sparks from the last until they die away */
+      ToonSetTimeStep(1.0/ANIMATION_RATE, ANIMATION_RATE);
+      for (n=0;n<data[PENGUIN_BOMBER].nframes || ToonParticles();n++) {
          ToonErase(penguin,npenguins);
+         ToonEraseParticles();
          ToonDraw(penguin,npenguins);
+         ToonDrawParticles();
          ToonFlush();
          for (i=0;i<npenguins;i++) {
+            /* Before the advance, which puts the bomber away for good
+             * once it is past its last frame */
+            if (penguin[i].active && penguin[i].type == PENGUIN_BOMBER
+                  && penguin[i].frame == data[PENGUIN_BOMBER].nframes-1) {
+               Burst(penguin+i, 0.5, SPARKS, SPARK_SPEED, SPARK_LIFE,
+                     0xffd040);
+               Burst(penguin+i, 0.5, SPARKS/2, SPARK_SPEED/2, SPARK_LIFE,
+                     0xff6020);
+            }
             ToonAdvance(penguin+i,TOON_FORCE);
          }
-         ToonSleep(sleep_usec);
-         if (verbose) fprintf(stderr,".");
+         if (ToonParticles() > sparks) sparks = ToonParticles();
+         ToonAdvanceParticles();
+         ToonSleep(1000000/ANIMATION_RATE);
+         if (verbose && first_display) fprintf(stderr,".");
+      }
+      if (verbose && first_display) {
+         if (sparks > 0) fprintf(stderr,"done (%d sparks)\n",sparks);
+         else fprintf(stderr,"done\n");
       }
-      if (verbose) fprintf(stderr,"done\n");
    }
    ToonErase(penguin,npenguins);
+   if (first_display) {
+      ToonStatsClose();
+      ToonControlClose();
+   }
    ToonCloseDisplay();
-   exit(0);
+   if (data != penguin_data) ToonFreeTheme(data);
+   if (theme_dir) free(theme_dir);
+   if (snapshot_file) free(snapshot_file);
+   free(penguin);
+   free(prefd);
+   free(prefclimb);
+   free(hold_on);
+   return NULL;
 }
 
+
+/*** MAIN PROGRAM ***/
+int main (int argc, char **argv) {
+   char **display_names=NULL, **names=NULL, *default_display=NULL;
+   int ndisplay_names=0;
+   pthread_t *threads;
+   void *failed;
+   int nfailed=0;
+   ToonData *theme=NULL;
+   int ntypes=PENGUIN_TYPES;
+   int i,j,n;
+   /* Handle command-line arguments */
+   for (n=1;n<argc;n++) {
+      if (strcmp(argv[n],"-n") == 0 || strcmp(argv[n],"-penguins") == 0) {
+         if (argc > ++n) {
+            start_penguins=atoi(argv[n]);
+            if (start_penguins > MAX_PENGUINS) {
+               fprintf(stderr,"Warning: only %d penguins created\n",
+                     start_penguins=MAX_PENGUINS);
+            }
+            else if (start_penguins <= 0) {
+               fprintf(stderr,"Warning: no penguins created\n");
+                     start_penguins=0;
+            }
+         }
+         else {
+            fprintf(stderr,"Error: number of penguins not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-delay") == 0) {
+         if (argc > ++n) {
+            if (atoi(argv[n]) < 1) {
+               fprintf(stderr,"Error: delay must be at least 1 millisecond\n");
+               exit(1);
+            }
+            start_delay=1000*atoi(argv[n]);
+         }
+         else {
+            fprintf(stderr,"Error: delay in milliseconds not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-display") == 0) {
+         if (argc > ++n) {
+            if ((display_names = realloc(display_names,
+                  (ndisplay_names+1)*sizeof(char *))) == NULL) {
+               fprintf(stderr,"Error: Out of memory\n");
+               exit(1);
+            }
+            display_names[ndisplay_names++]=argv[n];
+         }
+         else {
+            fprintf(stderr,"Error: display not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-backend") == 0) {
+         if (argc > ++n) {
+            if (ToonSetBackend(argv[n])) {
+               fprintf(stderr,"Error: %s\n", ToonErrorMessage());
+               exit(1);
+            }
+            backend_name=argv[n];
+         }
+         else {
+            fprintf(stderr,"Error: backend not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-theme") == 0) {
+         if (argc > ++n) {
+            theme_option=argv[n];
+         }
+         else {
+            fprintf(stderr,"Error: theme directory not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-scale") == 0) {
+         if (argc > ++n) {
+            scale_option = strcmp(argv[n],"auto") == 0 ? TOON_SCALEAUTO
+                  : atof(argv[n]);
+            if (scale_option <= 0 && strcmp(argv[n],"auto") != 0) {
+               fprintf(stderr,"Error: bad scale %s\n",argv[n]);
+               exit(1);
+            }
+         }
+         else {
+            fprintf(stderr,"Error: scale not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-smooth") == 0) {
+         scale_filter_option=TOON_SCALEFILTERED;
+      }
+      else if (strcmp(argv[n],"-config") == 0) {
+         if (argc > ++n) {
+            config_file=argv[n];
+         }
+         else {
+            fprintf(stderr,"Error: config file not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-control") == 0) {
+         if (argc > ++n) {
+            control_option=argv[n];
+         }
+         else {
+            fprintf(stderr,"Error: control socket not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-stats") == 0) {
+         if (argc > ++n) {
+            stats_file_option=argv[n];
+         }
+         else {
+            fprintf(stderr,"Error: stats file not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-statsocket") == 0) {
+         if (argc > ++n) {
+            stats_socket_option=argv[n];
+         }
+         else {
+            fprintf(stderr,"Error: stats socket not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-adaptive") == 0 ) {
+         start_adaptive=1;
+      }
+      else if (strcmp(argv[n],"-shy") == 0 ) {
+         start_shy=1;
+      }
+      else if (strcmp(argv[n],"-snapshot") == 0 ) {
+         if (argc > ++n) {
+            snapshot_option=argv[n];
+         }
+         else {
+            fprintf(stderr,"Error: snapshot file not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-render") == 0 ) {
+         if (argc > ++n) {
+            if (strcmp(argv[n],"-") == 0)
+               render_out=stdout;
+            else if ((render_out=fopen(argv[n],"w")) == NULL) {
+               fprintf(stderr,"Error: can't write %s\n",argv[n]);
+               exit(1);
+            }
+            i=strlen(argv[n]);
+            if (i > 4 && strcmp(argv[n]+i-4,".ppm") == 0)
+               render_format=TOON_FRAME_PPM;
+            backend_name="null";
+         }
+         else {
+            fprintf(stderr,"Error: render file not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-frames") == 0 ) {
+         if (argc > ++n) {
+            render_frames=atol(argv[n]);
+         }
+         else {
+            fprintf(stderr,"Error: number of frames not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-layout") == 0 ) {
+         if (argc > ++n) {
+            layout_option=argv[n];
+         }
+         else {
+            fprintf(stderr,"Error: layout file not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-seed") == 0 ) {
+         if (argc > ++n) {
+            random_seed=strtoul(argv[n],NULL,0);
+            seed_given=1;
+         }
+         else {
+            fprintf(stderr,"Error: seed not specified\n");
+            ShowUsage(argv);
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[n],"-vsync") == 0 ) {
+         configure_mask |= TOON_VSYNC;
+      }
+      else if (strcmp(argv[n],"-fulldetail") == 0 ) {
+         full_detail=1;
+      }
+      else if (strcmp(argv[n],"-ignorepopups") == 0 ) {
+         configure_mask |= TOON_NOSOLIDPOPUPS;
+      }
+      else if (strcmp(argv[n],"-share") == 0 ) {
+         configure_mask |= TOON_SHAREDPIXMAPS;
+      }
+      else if (strcmp(argv[n],"-rectwin") == 0 ) {
+         configure_mask |= TOON_NOSHAPEDWINDOWS;
+      }
+      else if (strcmp(argv[n],"-gapvoids") == 0 ) {
+         configure_mask |= TOON_GAPVOIDS;
+      }
+      else if (strcmp(argv[n],"-h") == 0 || strcmp(argv[n],"-help") == 0 || 
+               strcmp(argv[n],"-?") == 0 || strcmp(argv[n],"--help") == 0) {
+         fprintf(stdout,"XPenguins %s (%s) by %s\n",
+               XPENGUINS_VERSION, XPENGUINS_DATE, XPENGUINS_AUTHOR);
+         ShowUsage(argv);
+         exit(0);
+      }
+      else if (strcmp(argv[n],"-v") == 0 || strcmp(argv[n],"-version") == 0 || 
+               strcmp(argv[n],"--version") == 0) {
+         fprintf(stdout,"XPenguins %s\n", XPENGUINS_VERSION);
+         exit(0);
+      }
+      else if (strcmp(argv[n],"-q") == 0 || strcmp(argv[n],"-quiet") == 0 || 
+               strcmp(argv[n],"--quiet") == 0) {
+         verbose=0;
+      }
+      else {
+         fprintf(stderr,"Warning: `%s' not understood - use `-h' for a list of options\n",argv[n]);
+      }
+   }
+
+   /* A theme must have the same types, in the same order, as the
+    * compiled-in penguins/def.h; each display loads it again, sharing
+    * the same mapping */
+   if (theme_option) {
+      if ((theme = ToonLoadTheme(theme_option, &ntypes)) == NULL) {
+         fprintf(stderr,"Error: %s\n", ToonErrorMessage());
+         exit(1);
+      }
+      if (ntypes < PENGUIN_TYPES) {
+         fprintf(stderr,"Error: theme %s has only %d of %d types\n",
+               theme_option, ntypes, PENGUIN_TYPES);
+         exit(1);
+      }
+   }
+   /* penguin_data should have been defined in penguins/def.h */
+   ToonUseRaw(penguin_data,PENGUIN_TYPES,penguin_raw);
+
+   /* reset random-number generator, unless the same run is wanted again */
+   if (!seed_given)
+      random_seed = time((long *) NULL);
+   if (snapshot_option)
+      signal(SIGUSR2, SnapshotSignalHandler);
+
+   /* Every screen of every display asked for, or of the default one;
+    * rendering needs none, just the one desktop of its own */
+   if (render_out) {
+      signal(SIGPIPE, SIG_IGN);
+      if ((names = calloc(1, sizeof(char *))) == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         exit(1);
+      }
+      ndisplays = 1;
+      ndisplay_names = 0;
+   }
+   else if (ndisplay_names == 0) {
+      display_names = &default_display;
+      ndisplay_names = 1;
+   }
+   for (i=0;i<ndisplay_names;i++) {
+      char **screens;
+      n = ToonScreenNames(display_names[i], &screens);
+      if ((names = realloc(names, (ndisplays+n)*sizeof(char *))) == NULL) {
+         fprintf(stderr,"Error: Out of memory\n");
+         exit(1);
+      }
+      for (j=0;j<n;j++)
+         names[ndisplays++] = screens[j];
+      free(screens);
+   }
+
+   /* The first display is run here, and any others by threads */
+   if ((threads = malloc(ndisplays*sizeof(pthread_t))) == NULL) {
+      fprintf(stderr,"Error: Out of memory\n");
+      exit(1);
+   }
+   for (i=1;i<ndisplays;i++) {
+      if (pthread_create(threads+i, NULL, RunDisplay, names[i])) {
+         fprintf(stderr,"Error: can't start a thread for %s\n", names[i]);
+         exit(1);
+      }
+   }
+   first_display=1;
+   if (RunDisplay(names[0])) nfailed++;
+   for (i=1;i<ndisplays;i++) {
+      pthread_join(threads[i], &failed);
+      if (failed) nfailed++;
+   }
+
+   for (i=0;i<ndisplays;i++)
+      if (names[i]) free(names[i]);
+   free(names);
+   free(threads);
+   if (theme) ToonFreeTheme(theme);
+   exit(nfailed == ndisplays);
+}